@@ -0,0 +1,33 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+// Included by every benchmark program: they time themselves with
+// wall_seconds() and share the scripts below.
+
+#include "utils.h"
+
+// a rule-sized script: a handful of globals, a small loop and some string
+// work, but no output
+#define RULE_SCRIPT                                                            \
+    "let limit = 10;\n"                                                        \
+    "let base = 3.5;\n"                                                        \
+    "let label = \"rule\";\n"                                                  \
+    "let score = 0;\n"                                                         \
+    "let matched = false;\n"                                                   \
+    "for (let i = 0; i < limit; i = i + 1) {\n"                                \
+    "    let weight = i * base;\n"                                             \
+    "    if (weight > 12 and !(i == 7)) {\n"                                   \
+    "        score = score + weight / 2;\n"                                    \
+    "    } else {\n"                                                           \
+    "        score = score - 1;\n"                                             \
+    "    }\n"                                                                  \
+    "}\n"                                                                      \
+    "let name = label + \"-\" + \"accepted\";\n"                               \
+    "if (score > 40) matched = true;\n"                                        \
+    "let threshold = (score - 40) * 2 + base;\n"                               \
+    "while (threshold > 100) threshold = threshold / 2;\n"                     \
+    "let tag = nil;\n"                                                         \
+    "if (matched and threshold < 100) tag = name;\n"                           \
+    "else tag = label;\n"
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define KEYS 4096
+#define ROUNDS 500
+
+// KEYS random keys of `min_len` to `max_len` bytes drawn from `alphabet`,
+// packed back to back into one buffer
+static char *make_keys(int min_len, int max_len, const char *alphabet,
+                       int *lens) {
+    char *keys = malloc((size_t)KEYS * max_len);
+    int alphabet_len = 0;
+    while (alphabet[alphabet_len] != '\0')
+        alphabet_len++;
+
+    for (int i = 0; i < KEYS; i++) {
+        lens[i] = min_len + rand() % (max_len - min_len + 1);
+        for (int j = 0; j < lens[i]; j++)
+            keys[i * max_len + j] = alphabet[rand() % alphabet_len];
+    }
+    return keys;
+}
+
+static void bench(const char *name, int min_len, int max_len,
+                  const char *alphabet) {
+    int lens[KEYS];
+    char *keys = make_keys(min_len, max_len, alphabet, lens);
+    uint64_t seed = random_seed();
+
+    long bytes = 0;
+    for (int i = 0; i < KEYS; i++)
+        bytes += lens[i];
+
+    // sum the hashes so the calls can't be dropped
+    uint32_t sink = 0;
+    double start = wall_seconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++)
+            sink += hash_string(keys + i * max_len, lens[i], seed);
+    }
+    double elapsed = wall_seconds() - start;
+
+    printf("%-12s %4d-%-5d %8.2f ns/hash %8.2f GB/s  (%08x)\n",
+           name, min_len, max_len,
+           elapsed / ((double)ROUNDS * KEYS) * 1e9,
+           (double)bytes * ROUNDS / elapsed / 1e9, sink);
+    free(keys);
+}
+
+int main(void) {
+    const char *ident = "abcdefghijklmnopqrstuvwxyz_0123456789";
+    const char *text = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                       "0123456789.,;:-";
+
+    srand(1);
+
+#ifdef STRING_HASH_FNV1A
+    printf("fnv1a\n");
+#else
+    printf("wyhash\n");
+#endif
+
+    bench("identifier", 1, 8, ident);
+    bench("identifier", 8, 24, ident);
+    bench("payload", 32, 64, text);
+    bench("payload", 128, 256, text);
+    bench("payload", 1024, 4096, text);
+
+    return 0;
+}
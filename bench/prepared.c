@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "object.h"
+#include "vm.h"
+
+#define ITERATIONS 20000
+
+// a rule like RULE_SCRIPT with its inputs set by the host
+static const char *INPUT_SCRIPT =
+    "let score = 0;\n"
+    "for (let i = 0; i < limit; i = i + 1) {\n"
+    "    if (i * base > 12) score = score + i * base / 2;\n"
+    "    else score = score - 1;\n"
+    "}\n";
+
+static double bench_interpret(void) {
+    VM vm;
+    vm_init(&vm);
+
+    double start = wall_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (vm_interpret(&vm, RULE_SCRIPT) != INTERPRET_OK)
+            return -1;
+    }
+    double elapsed = wall_seconds() - start;
+
+    vm_free(&vm);
+    return elapsed;
+}
+
+static double bench_prepared(void) {
+    VM vm;
+    vm_init(&vm);
+
+    Script *script = vm_compile(&vm, RULE_SCRIPT);
+    if (script == NULL)
+        return -1;
+
+    double start = wall_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (vm_run(&vm, script, true) != INTERPRET_OK)
+            return -1;
+    }
+    double elapsed = wall_seconds() - start;
+
+    vm_script_free(&vm, script);
+    vm_free(&vm);
+    return elapsed;
+}
+
+static ObjString *name(VM *vm, const char *chars) {
+    return copy_string(vm, chars, (int)strlen(chars));
+}
+
+// Defines the inputs before compiling and sets them again before each run,
+// which keeps its globals.
+static double bench_inputs(void) {
+    VM vm;
+    vm_init(&vm);
+
+    vm_global_set(&vm, name(&vm, "limit"), NUMBER_VAL(0));
+    vm_global_set(&vm, name(&vm, "base"), NUMBER_VAL(3.5));
+
+    Script *script = vm_compile(&vm, INPUT_SCRIPT);
+    if (script == NULL)
+        return -1;
+
+    double start = wall_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        vm_global_set(&vm, name(&vm, "limit"), NUMBER_VAL(i % 20));
+        if (vm_run(&vm, script, false) != INTERPRET_OK)
+            return -1;
+    }
+    double elapsed = wall_seconds() - start;
+
+    // the last run had a limit of 19
+    Value score;
+    if (!vm_global_get(&vm, name(&vm, "score"), &score) ||
+        !IS_NUMBER(score) || AS_NUMBER(score) != 284.75)
+        elapsed = -1;
+
+    vm_script_free(&vm, script);
+    vm_free(&vm);
+    return elapsed;
+}
+
+int main(void) {
+    double interpret = bench_interpret();
+    double prepared = bench_prepared();
+    double inputs = bench_inputs();
+
+    if (interpret < 0 || prepared < 0 || inputs < 0) {
+        fprintf(stderr, "benchmark script failed\n");
+        return 1;
+    }
+
+    printf("vm_interpret: %8.2f us/call\n", interpret / ITERATIONS * 1e6);
+    printf("vm_run:       %8.2f us/call\n", prepared / ITERATIONS * 1e6);
+    printf("speedup:      %8.2fx\n", interpret / prepared);
+    printf("with inputs:  %8.2f us/call\n", inputs / ITERATIONS * 1e6);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "vm.h"
+
+// Runs the same scripts on the stack and the register VM. Built with
+// -DCOUNT_INSTRUCTIONS it also reports how many instructions each executed,
+// which costs a little time on every dispatch.
+
+// tight loops over locals and globals, like bench/loop.lox but silent
+static const char LOOP[] =
+    "let sum = 0;\n"
+    "let i = 0;\n"
+    "while (i < 1000000) {\n"
+    "    sum = sum + i;\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "let total = 0;\n"
+    "for (let a = 0; a < 500; a = a + 1) {\n"
+    "    for (let b = 0; b < 500; b = b + 1) {\n"
+    "        if (a < b) total = total + 1;\n"
+    "        else total = total - 1;\n"
+    "    }\n"
+    "}\n";
+
+// local arithmetic in a block, where registers save the most moves
+static const char LOCALS[] =
+    "{\n"
+    "    let x = 0;\n"
+    "    let y = 1;\n"
+    "    let z = 0;\n"
+    "    for (let i = 0; i < 300000; i = i + 1) {\n"
+    "        z = x * 2 + y - i / 4;\n"
+    "        if (z > 1000 or z < -1000) z = 0;\n"
+    "        x = y;\n"
+    "        y = z;\n"
+    "    }\n"
+    "}\n";
+
+typedef struct {
+    const char *name;
+    const char *source;
+    int iterations;
+} Workload;
+
+static const Workload WORKLOADS[] = {
+    {"loop",   LOOP,        1},
+    {"rule",   RULE_SCRIPT, 20000},
+    {"locals", LOCALS,      1},
+};
+
+// Seconds per run of `source`, -1 if it fails. `instructions` gets the
+// number executed by one run.
+static double bench(const char *source, int iterations, bool registers,
+                    uint64_t *instructions) {
+    VM vm;
+    vm_init(&vm);
+    vm.registers = registers;
+
+    Script *script = vm_compile(&vm, source);
+    if (script == NULL)
+        return -1;
+
+    double start = wall_seconds();
+    for (int i = 0; i < iterations; i++) {
+        if (vm_run(&vm, script, true) != INTERPRET_OK)
+            return -1;
+    }
+    double elapsed = wall_seconds() - start;
+
+    *instructions = vm.instructions / iterations;
+
+    vm_script_free(&vm, script);
+    vm_free(&vm);
+    return elapsed / iterations;
+}
+
+int main(void) {
+    printf("%-8s %14s %14s %12s %12s %8s\n", "script", "stack ops",
+           "register ops", "stack", "register", "speedup");
+
+    for (size_t i = 0; i < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]); i++) {
+        const Workload *workload = &WORKLOADS[i];
+        uint64_t stack_ops, register_ops;
+        double stack = bench(workload->source, workload->iterations, false,
+                             &stack_ops);
+        double registers = bench(workload->source, workload->iterations, true,
+                                 &register_ops);
+
+        if (stack < 0 || registers < 0) {
+            fprintf(stderr, "benchmark script %s failed\n", workload->name);
+            return 1;
+        }
+
+#ifdef COUNT_INSTRUCTIONS
+        printf("%-8s %14llu %14llu", workload->name,
+               (unsigned long long)stack_ops,
+               (unsigned long long)register_ops);
+#else
+        printf("%-8s %14s %14s", workload->name, "-", "-");
+#endif
+        printf(" %10.1fus %10.1fus %7.2fx\n", stack * 1e6, registers * 1e6,
+               stack / registers);
+    }
+
+    return 0;
+}
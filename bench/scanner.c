@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "lexer.h"
+#include "scanner.h"
+
+#define SOURCE_SIZE (16 * 1024 * 1024)
+#define ROUNDS 5
+
+static void append_word(char **p, const char *alphabet, int min_len,
+                        int max_len) {
+    int len = min_len + rand() % (max_len - min_len + 1);
+    int alphabet_len = (int)strlen(alphabet);
+    for (int i = 0; i < len; i++)
+        *(*p)++ = alphabet[rand() % alphabet_len];
+}
+
+static void append_text(char **p, const char *text) {
+    size_t len = strlen(text);
+    memcpy(*p, text, len);
+    *p += len;
+}
+
+// Generated code in the shape of our machine written scripts: indented
+// statements with long identifiers, numbers, string literals that now and
+// then span lines, and comment lines.
+static char *generate_source(void) {
+    char *source = malloc(SOURCE_SIZE + 256);
+    char *p = source;
+
+    while (p - source < SOURCE_SIZE) {
+        int indent = 4 * (rand() % 4);
+        memset(p, ' ', indent);
+        p += indent;
+
+        switch (rand() % 4) {
+            case 0:
+                append_text(&p, "// ");
+                append_word(&p, "abcdefghij klmnopqrst uvwxyz,.", 20, 80);
+                break;
+            case 1:
+                append_text(&p, "let ");
+                append_word(&p, "abcdefghijklmnopqrstuvwxyz_", 1, 1);
+                append_word(&p, "abcdefghijklmnopqrstuvwxyz_0123456789", 4, 24);
+                append_text(&p, " = ");
+                append_word(&p, "123456789", 1, 1);
+                append_word(&p, "0123456789", 0, 8);
+                append_text(&p, ".5;");
+                break;
+            case 2:
+                append_text(&p, "print \"");
+                append_word(&p, "abcdefghij klmnopqrst uvwxyz\n", 10, 120);
+                append_text(&p, "\";");
+                break;
+            case 3:
+                append_word(&p, "abcdefghijklmnopqrstuvwxyz", 1, 1);
+                append_word(&p, "abcdefghijklmnopqrstuvwxyz_0123456789", 2, 16);
+                append_text(&p, " = (a + b1) * c_2 >= 42 and !x;\t\r");
+                break;
+        }
+        *p++ = '\n';
+    }
+
+    *p = '\0';
+    return source;
+}
+
+static uint64_t checksum_token(uint64_t checksum, Token token) {
+    checksum = checksum * 31 + token.type;
+    checksum = checksum * 31 + token.line;
+    checksum = checksum * 31 + token.length;
+    return checksum;
+}
+
+static void report(const char *name, long tokens, size_t size, double best,
+                   uint64_t checksum) {
+    printf("%-12s %ld tokens, %.1f MB in %7.2f ms, %5.0f MB/s  (%016" PRIx64
+           ")\n", name, tokens, size / 1e6, best * 1e3, size / best / 1e6,
+           checksum);
+}
+
+static void bench_scanner(const char *source) {
+    uint64_t checksum = 0;
+    long tokens = 0;
+    double best = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        Scanner scanner;
+        scanner_init(&scanner, source);
+
+        checksum = 0;
+        tokens = 0;
+
+        double start = wall_seconds();
+        for (;;) {
+            Token token = scanner_scan_token(&scanner);
+            checksum = checksum_token(checksum, token);
+            tokens++;
+            if (token.type == TOKEN_EOF)
+                break;
+        }
+        double elapsed = wall_seconds() - start;
+
+        if (round == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    report("scanner", tokens, strlen(source), best, checksum);
+}
+
+static void bench_lexer(const char *source, int threads) {
+    double best = 0;
+    TokenStream stream;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = wall_seconds();
+        token_stream_lex(&stream, source, threads);
+        double elapsed = wall_seconds() - start;
+
+        if (round == 0 || elapsed < best)
+            best = elapsed;
+        if (round + 1 < ROUNDS)
+            token_stream_free(&stream);
+    }
+
+    uint64_t checksum = 0;
+    for (int i = 0; i < stream.len; i++)
+        checksum = checksum_token(checksum, token_stream_get(&stream, i));
+
+    char name[32];
+    snprintf(name, sizeof(name), "lexer x%d", threads);
+    report(name, stream.len, strlen(source), best, checksum);
+    token_stream_free(&stream);
+}
+
+// The checksum over every token's type, line and length must be the same
+// on every line, and between builds with and without -DSCANNER_NO_SIMD.
+int main(void) {
+    srand(1);
+    char *source = generate_source();
+
+    bench_scanner(source);
+    for (int threads = 1; threads <= 8; threads *= 2)
+        bench_lexer(source, threads);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Write `script` to `file` as a standalone C translation unit whose main()
+// runs it like vm_run() does, see aot.c for how to build it. False, with
+// nothing written, if the script has code it can't translate.
+bool aot_emit(VM *vm, Script *script, FILE *file);
+
+#endif
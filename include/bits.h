@@ -0,0 +1,34 @@
+#ifndef clox_bits_h
+#define clox_bits_h
+
+#include "common.h"
+
+// Helpers for the bit masks the SIMD paths in table.c and scanner.c
+// produce, one bit per byte of a vector.
+
+// index of the lowest set bit, `mask` must not be zero
+static inline int bits_lowest(uint32_t mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static inline int bits_count(uint32_t mask) {
+#ifdef __GNUC__
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        count++;
+    return count;
+#endif
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "vm.h"
+
+// bump whenever the opcodes or the file layout change
+#define CACHE_VERSION 5
+
+Script *cache_load(VM *vm, const char *path, const char *source);
+bool cache_write(VM *vm, Script *script, const char *path, const char *source);
+
+#endif
@@ -33,8 +33,29 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_RETURN,
+
+    // superinstructions, only emitted by optimize_chunk()
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_CONSTANT,
+    OP_ADD_LOCALS,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_INCREMENT_LOCAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_LESS,
+
+    // quickened forms for numbers, only written by run() into code it is
+    // running, see chunk_generic_opcode()
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
 } OpCode;
 
 typedef struct {
@@ -43,12 +64,47 @@ typedef struct {
     int *line;
     uint8_t *code;
     ValueArray constants;
+
+    // open addressing index over `constants` used to store each distinct
+    // constant once, a slot holds the constant's offset + 1 or 0 if empty
+    int index_cap;
+    int *index;
+    int deduplicated;
+    // operators the compiler evaluated or simplified away
+    int folded;
 } Chunk;
 
+// One generic instruction of those chunk_decode() splits an instruction into.
+typedef struct {
+    uint8_t opcode;
+    // the index or slot, the distance for jumps
+    uint16_t operand;
+    // values the earlier parts of the same instruction pushed
+    int pushed;
+    // offset after the whole instruction and, for jumps, of the target
+    int next;
+    int target;
+} InstructionPart;
+
+// the most parts an instruction decodes into
+#define INSTRUCTION_PARTS_MAX 5
+
 void chunk_init(Chunk *chunk);
 void chunk_free(Chunk *chunk);
 void chunk_push(Chunk *chunk, uint8_t byte, int line);
 
-uint16_t chunk_push_constant(Chunk *chunk, Value value, int line);
+int chunk_opcode_size(uint8_t opcode);
+uint8_t chunk_generic_opcode(uint8_t opcode);
+// Split the instruction at `offset` into generic parts, quickened forms and
+// superinstructions included, and return how many. -1 if the instruction is
+// unknown or cut off by the end of the chunk.
+int chunk_decode(Chunk *chunk, int offset, InstructionPart *parts);
+int chunk_add_constant(Chunk *chunk, Value value);
+// Push an instruction loading `value`, returns the constant's offset or -1
+// without pushing anything if the pool has no room left for it.
+int chunk_push_constant(Chunk *chunk, Value value, int line);
+// Remove the constants from offset `len` on. The compiler drops the ones only
+// code it rewound referenced.
+void chunk_drop_constants(Chunk *chunk, int len);
 
 #endif
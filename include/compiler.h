@@ -3,7 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
-#include "scanner.h"
+#include "parser.h"
 #include "vm.h"
 
 typedef enum {
@@ -32,20 +32,22 @@ typedef struct {
     int local_count;
     int scope_depth;
     Chunk *compiling_chunk;
-} Compiler;
 
-typedef struct {
-    Token prev;
-    Token curr;
-    bool had_error;
-    bool panic_mode;
-} Parser;
+    // the folder never rewrites code at or before the latest jump target
+    int jump_target;
+    // where the left operand of the infix rule being parsed starts
+    int operand_start;
+    // and how many constants the chunk had at that point
+    int operand_constants;
+    // chunk length right after the last instruction known to leave a number
+    // on the stack, -1 if unknown
+    int number_end;
+} Compiler;
 
 typedef struct {
     VM *vm;
 
     Parser parser;
-    Scanner scanner;
     Compiler compiler;
 } State;
 
@@ -3,8 +3,22 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "regchunk.h"
+
+// longest sequence print_ngrams() counts
+#define NGRAM_MAX 4
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_opcode(Chunk *chunk, int offset);
+const char *opcode_name(uint8_t opcode);
+
+// Count the opcode sequences of `n` instructions in `chunk` and print the
+// `limit` most common ones to stderr.
+void print_ngrams(Chunk *chunk, int n, int limit);
+
+void disassemble_reg_chunk(RegChunk *chunk, ValueArray *constants,
+                           const char *name);
+void disassemble_reg_instruction(RegChunk *chunk, ValueArray *constants,
+                                 int offset);
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+// Native code for one chunk, only produced on x86-64 Linux.
+typedef struct JitCode JitCode;
+
+typedef enum {
+    JIT_RETURNED,
+    // an instruction could not complete natively, vm->ip points at its
+    // first byte and the stack is as the interpreter expects it there
+    JIT_EXITED,
+} JitResult;
+
+// NULL if the platform or the chunk isn't supported, the chunk then runs on
+// the interpreter
+JitCode *jit_compile(Chunk *chunk);
+struct TraceOp;
+
+// Native code that runs the recorded loop body `ops` until one of its guards
+// fails, it always returns JIT_EXITED. `height` is the stack height at the
+// loop header. NULL if the platform or the trace isn't supported.
+JitCode *jit_compile_trace(Chunk *chunk, struct TraceOp *ops, int len,
+                           int height);
+// vm->chunk must be the chunk `code` was compiled from
+JitResult jit_run(VM *vm, JitCode *code);
+void jit_free(JitCode *code);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef clox_lexer_h
+#define clox_lexer_h
+
+#include "common.h"
+#include "scanner.h"
+
+// The whole source lexed up front into parallel arrays, one element per
+// token, ending with TOKEN_EOF. Error tokens only record where and on which
+// line they start and are rescanned by token_stream_get() to recover their
+// message.
+//
+// The arrays live outside of the managed heap, lexing threads must not
+// touch the VM.
+typedef struct {
+    const char *source;
+    int len;
+    int cap;
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    int *lines;
+} TokenStream;
+
+// Sources of at least LEX_MIN_CHUNK bytes per thread are split at line
+// breaks and lexed on up to `threads` threads.
+#define LEX_MIN_CHUNK (256 * 1024)
+
+void token_stream_lex(TokenStream *stream, const char *source, int threads);
+void token_stream_free(TokenStream *stream);
+Token token_stream_get(TokenStream *stream, int index);
+
+#endif
@@ -4,6 +4,11 @@
 #include "common.h"
 #include "object.h"
 
+// the first collection runs once this much has been allocated, after that
+// the threshold is the live heap times VM.gc_growth_factor
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
 #define GROW_ARRAY(type, pointer, old_count, new_count)                        \
@@ -17,9 +22,19 @@
     reallocate(pointer, sizeof(type), 0)
 
 #define ALLOCATE(type, count)                                                  \
-    (type *)reallocate(NULL, 0, sizeof(type) * count)
+    (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
-void free_objects(Obj *objects);
+void memory_bind(VM *vm);
+
+// Objects come from the VM's pool when they are small enough and from
+// malloc otherwise, either way they are charged to `vm`.
+void *allocate_pooled(VM *vm, size_t size);
+void free_pooled(VM *vm, void *pointer, size_t size);
+
+void mark_value(VM *vm, Value value);
+void mark_object(VM *vm, Obj *object);
+void collect_garbage(VM *vm);
+void free_objects(VM *vm);
 
 #endif
@@ -8,29 +8,74 @@
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 
 #define IS_STRING(value)    is_obj_type(value, OBJ_STRING)
+#define IS_ROPE(value)      is_obj_type(value, OBJ_ROPE)
+// strings and ropes, everything OP_ADD concatenates
+#define IS_TEXT(value)      (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)    ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString *)AS_OBJ(value))->data)
+#define AS_ROPE(value)      ((ObjRope *)AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct Obj {
     ObjType type;
+    bool is_marked;
     struct Obj *next;
 };
 
+// The characters are stored inline right after the header, so a string is
+// a single allocation and short ones fit into one cache line together with
+// the length and hash a lookup compares first.
 struct ObjString {
     Obj obj;
     int len;
-    char *data;
     uint32_t hash;
+    char data[];
 };
 
-ObjString *take_string(VM *vm, char *data, int len);
+#define STRING_SIZE(len)    (sizeof(ObjString) + (size_t)(len) + 1)
+
+// reserve_string() returns a string of `len` bytes for the caller to fill
+// in, that has to be handed to take_string() before anything else is
+// allocated. take_string() interns it and returns the interned copy, which
+// may be an older string with the same contents.
+ObjString *reserve_string(VM *vm, int len);
+ObjString *take_string(VM *vm, ObjString *string);
 ObjString *copy_string(VM *vm, const char *data, int len);
 
+// Concatenations that are at least ROPE_MIN_LENGTH characters long build a
+// rope which only records its two halves, so appending to a long string in
+// a loop doesn't copy and rehash it every time. A rope is flattened into an
+// interned string the first time it is compared, after that `flat` is set
+// and the halves are dropped.
+#define ROPE_MIN_LENGTH 128
+
+typedef struct {
+    Obj obj;
+    int len;
+    // longest path to a leaf, bounds the stack needed to walk the rope
+    int depth;
+    // each an ObjString or an ObjRope
+    Obj *left;
+    Obj *right;
+    ObjString *flat;
+} ObjRope;
+
+// `left` and `right` have to be reachable from the VM while the rope is
+// allocated, as does `rope` while it is flattened.
+ObjRope *concat_rope(VM *vm, Obj *left, Obj *right);
+ObjString *flatten_rope(VM *vm, ObjRope *rope);
+void print_rope(FILE *file, ObjRope *rope);
+
+static inline int text_length(Obj *text) {
+    return text->type == OBJ_STRING ? ((ObjString *)text)->len
+                                    : ((ObjRope *)text)->len;
+}
+
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -0,0 +1,14 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "common.h"
+#include "chunk.h"
+
+// Rewrite the control flow of a finished chunk: jumps to jumps are threaded,
+// branches on constants are decided, OP_JUMP_IF_FALSE followed by OP_POP
+// becomes OP_POP_JUMP_IF_FALSE and unreachable code is dropped. Common
+// sequences are then fused into superinstructions. The chunk is left alone if
+// a rewritten jump would not fit its operand.
+void optimize_chunk(Chunk *chunk);
+
+#endif
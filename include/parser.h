@@ -0,0 +1,32 @@
+#ifndef clox_parser_h
+#define clox_parser_h
+
+#include "common.h"
+#include "scanner.h"
+#include "lexer.h"
+
+// The token level of the front end, shared by the stack and the register
+// compilers.
+typedef struct {
+    Token prev;
+    Token curr;
+    bool had_error;
+    bool panic_mode;
+
+    Scanner scanner;
+    // when set, tokens come from here instead of `scanner`
+    TokenStream *tokens;
+    int next_token;
+} Parser;
+
+void parser_init(Parser *parser, const char *source, TokenStream *tokens);
+void parser_advance(Parser *parser);
+void parser_consume(Parser *parser, TokenType type, const char *message);
+bool parser_check(Parser *parser, TokenType type);
+bool parser_match(Parser *parser, TokenType type);
+void parser_error_at(Parser *parser, Token *token, const char *message);
+void parser_error_at_current(Parser *parser, const char *message);
+// skip to the next statement after an error
+void parser_synchronize(Parser *parser);
+
+#endif
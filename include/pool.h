@@ -0,0 +1,35 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+// Size classes are powers of two from POOL_MIN_SIZE up to POOL_MAX_SIZE,
+// every class carves its blocks out of slabs of POOL_SLAB_SIZE bytes.
+#define POOL_MIN_SIZE 16
+#define POOL_MAX_SIZE 512
+#define POOL_CLASSES 6
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct PoolSlab {
+    struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct {
+    PoolBlock *free_lists[POOL_CLASSES];
+    PoolSlab *slabs;
+    int slab_count;
+} Pool;
+
+void pool_init(Pool *pool);
+void pool_free(Pool *pool);
+
+// Blocks are not zeroed. `size` must be at most POOL_MAX_SIZE and the same
+// size has to be passed back to pool_release().
+void *pool_alloc(Pool *pool, size_t size);
+void pool_release(Pool *pool, void *pointer, size_t size);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef clox_regchunk_h
+#define clox_regchunk_h
+
+#include "common.h"
+#include "value.h"
+
+// The three-address instruction set of the register VM, see regvm.c. Every
+// instruction is one 32 bit word: the opcode in the low byte followed by the
+// 8 bit operands A, B and C, or by A and a 16 bit operand Bx. R(x) is
+// register x, K(x) constant x.
+typedef enum {
+    ROP_MOVE,           // R(A) = R(B)
+    ROP_LOADK,          // R(A) = K(Bx)
+    ROP_LOADNIL,        // R(A) = nil
+    ROP_LOADTRUE,       // R(A) = true
+    ROP_LOADFALSE,      // R(A) = false
+    ROP_GET_GLOBAL,     // R(A) = global Bx
+    ROP_SET_GLOBAL,     // global Bx = R(A), which must be defined
+    ROP_DEFINE_GLOBAL,  // global Bx = R(A)
+    ROP_ADD,            // R(A) = R(B) + R(C)
+    ROP_SUBTRACT,       // R(A) = R(B) - R(C)
+    ROP_MULTIPLY,       // R(A) = R(B) * R(C)
+    ROP_DIVIDE,         // R(A) = R(B) / R(C)
+    ROP_ADDK,           // R(A) = R(B) + K(C)
+    ROP_SUBTRACTK,      // R(A) = R(B) - K(C)
+    ROP_MULTIPLYK,      // R(A) = R(B) * K(C)
+    ROP_DIVIDEK,        // R(A) = R(B) / K(C)
+    ROP_EQUAL,          // R(A) = R(B) == R(C)
+    ROP_NOT_EQUAL,      // R(A) = !(R(B) == R(C))
+    ROP_LESS,           // R(A) = R(B) < R(C)
+    ROP_GREATER,        // R(A) = R(B) > R(C)
+    ROP_NOT_LESS,       // R(A) = !(R(B) < R(C)), `>=`
+    ROP_NOT_GREATER,    // R(A) = !(R(B) > R(C)), `<=`
+    ROP_LESSK,          // R(A) = R(B) < K(C)
+    ROP_GREATERK,       // R(A) = R(B) > K(C)
+    ROP_NOT,            // R(A) = !R(B)
+    ROP_NEGATE,         // R(A) = -R(B)
+    ROP_PRINT,          // print R(A)
+    ROP_JUMP,           // skip Bx instructions
+    ROP_JUMP_IF_FALSE,  // skip Bx instructions if R(A) is falsy
+    ROP_JUMP_IF_TRUE,   // skip Bx instructions unless R(A) is falsy
+    ROP_LOOP,           // go back Bx instructions
+    ROP_RETURN,
+} RegOpCode;
+
+#define REG_ABC(op, a, b, c)                                                   \
+    ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(b) << 16 |               \
+     (uint32_t)(c) << 24)
+#define REG_ABX(op, a, bx)                                                     \
+    ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(bx) << 16)
+
+#define REG_OP(instruction) ((instruction) & 0xff)
+#define REG_A(instruction)  (((instruction) >> 8) & 0xff)
+#define REG_B(instruction)  (((instruction) >> 16) & 0xff)
+#define REG_C(instruction)  ((instruction) >> 24)
+#define REG_BX(instruction) ((instruction) >> 16)
+
+// Code for the register VM. Its constants live in the ValueArray of an
+// ordinary Chunk so that deduplication and the collector work unchanged.
+typedef struct {
+    int len;
+    int cap;
+    int *line;
+    uint32_t *code;
+    // registers the code uses, the VM clears this many stack slots
+    int registers;
+} RegChunk;
+
+void reg_chunk_init(RegChunk *chunk);
+void reg_chunk_free(RegChunk *chunk);
+void reg_chunk_push(RegChunk *chunk, uint32_t instruction, int line);
+void reg_chunk_insert(RegChunk *chunk, int offset, uint32_t instruction,
+                      int line);
+
+// whether `opcode` stores its result in R(A)
+bool reg_opcode_writes_a(uint8_t opcode);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef clox_regcompiler_h
+#define clox_regcompiler_h
+
+#include "common.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "parser.h"
+#include "regchunk.h"
+#include "vm.h"
+
+// Locals live in registers 0 up to local_count, temporaries are allocated
+// above them and released at the end of every statement.
+typedef struct {
+    Local locals[UINT8_MAX + 1];
+    int local_count;
+    int scope_depth;
+    RegChunk *chunk;
+    // holds the constants of `chunk`
+    Chunk *constants;
+
+    int next_register;
+    int max_registers;
+    // the latest jump target, code before it is never rewritten
+    int jump_target;
+    // bumped by every assignment to a local
+    int local_writes;
+} RegCompiler;
+
+typedef struct {
+    VM *vm;
+
+    Parser parser;
+    RegCompiler compiler;
+} RegState;
+
+// Parse functions return the register that holds the value of what they
+// parsed, infix ones also get the register of their left operand.
+typedef int (*RegPrefixFn)(RegState *state, bool can_assign);
+typedef int (*RegInfixFn)(RegState *state, int left, bool can_assign);
+
+typedef struct {
+    RegPrefixFn prefix;
+    RegInfixFn infix;
+    Precedence precedence;
+} RegParseRule;
+
+bool reg_compile(const char *source, VM *vm, Chunk *constants,
+                 RegChunk *chunk);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef clox_regvm_h
+#define clox_regvm_h
+
+#include "common.h"
+#include "regchunk.h"
+#include "vm.h"
+
+// Run register code produced by reg_compile(), its constants are in
+// `constants`. The registers are the bottom of the VM stack.
+InterpretResult reg_vm_run(VM *vm, RegChunk *chunk, ValueArray *constants);
+
+#endif
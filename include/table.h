@@ -9,12 +9,26 @@ typedef struct {
     Value value;
 } Entry;
 
+// `cap` is zero or a power of two of at least 16. Slots without a live
+// entry have a NULL key.
 typedef struct {
+    // live entries
     int len;
+    int tombstones;
     int cap;
     Entry *entries;
+    // one control byte per entry, see table.c
+    uint8_t *ctrl;
 } Table;
 
+typedef struct {
+    int len;
+    int tombstones;
+    int cap;
+    // groups of control bytes a lookup of a live key visits on average
+    double avg_probe;
+} TableStats;
+
 void table_init(Table *table);
 void table_free(Table *table);
 void table_copy_from(Table *from, Table *to);
@@ -23,6 +37,9 @@ bool table_get(Table *table, ObjString *key, Value *value);
 bool table_set(Table *table, ObjString *key, Value value);
 bool table_del(Table *table, ObjString *key);
 
+void table_remove_white(Table *table);
+void table_stats(Table *table, TableStats *stats);
+
 ObjString *table_find_string(Table *table, const char *chars,
                              int length, uint32_t hash);
 
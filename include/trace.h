@@ -0,0 +1,67 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+// back edges a loop takes before it is recorded, the default of
+// VM.trace_threshold
+#define TRACE_THRESHOLD 50
+// a loop whose recording failed this often is left to the interpreter
+#define TRACE_MAX_ABORTS 3
+// longest loop body that is recorded, in generic instructions
+#define TRACE_MAX_OPS 512
+
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    // only in builds without NAN_BOXING
+    TYPE_INT,
+    // a string or a rope
+    TYPE_TEXT,
+} TraceType;
+
+// One generic instruction of a recorded iteration, superinstructions are
+// recorded as the sequence they were fused from.
+typedef struct TraceOp {
+    uint8_t opcode;
+    uint16_t operand;
+    // bytecode offset of the instruction this is part of and the values its
+    // earlier parts pushed, a side exit before this part goes back there
+    int offset;
+    int pushed;
+    // bytecode offset after the instruction and, for jumps, of the target
+    int next;
+    int target;
+    // jumps only, whether the recorded iteration took it
+    bool taken;
+    // the operands seen while recording, `types[1]` is the top of the stack
+    TraceType types[2];
+} TraceOp;
+
+typedef struct Trace {
+    Chunk *chunk;
+    // where the loop's OP_LOOP jumps back to
+    uint8_t *header;
+    // back edges taken since the last recording
+    int counter;
+    int aborts;
+    // the compiled loop body, NULL while there is none
+    JitCode *code;
+    struct Trace *next;
+} Trace;
+
+TraceType trace_type(Value value);
+
+// Called by run() when the OP_LOOP at `loop` has jumped back, vm->ip is the
+// loop header. Counts the back edge, records the loop once it is hot and
+// runs its trace if it has one. Leaves vm->ip where run() continues.
+void trace_loop(VM *vm, uint8_t *loop);
+// drop the traces recorded in `chunk`
+void trace_free_chunk(VM *vm, Chunk *chunk);
+
+#endif
@@ -3,7 +3,27 @@
 
 #include "common.h"
 
-uint32_t hash_string(const char* key, int length);
-char *read_file(const char *path);
+// Strings are hashed with wyhash, or FNV-1a when built with
+// -Dstring_hash=fnv1a. Every VM picks its own random seed so that the
+// layout of its tables can't be predicted from the outside.
+uint32_t hash_string(const char *key, int length, uint64_t seed);
+uint64_t random_seed(void);
+// wall clock time in seconds, for measuring how long something took
+double wall_seconds(void);
+
+// A script's source text, NUL terminated. Regular files are mapped
+// read-only, anything else (pipes, "-" for stdin) is read into a buffer.
+typedef struct {
+    const char *data;
+    size_t len;
+
+    // whichever of the two backs `data`
+    void *mapping;
+    size_t mapping_len;
+    char *buffer;
+} SourceFile;
+
+bool source_file_open(SourceFile *file, const char *path);
+void source_file_close(SourceFile *file);
 
 #endif
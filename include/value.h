@@ -1,30 +1,96 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+
+// UNDEFINED_VAL marks global slots that the compiler has handed out but
+// that were not defined yet at run time. Scripts never get to see it.
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Every non-number is stored in the payload of a quiet NaN. Objects set the
+// sign bit and keep their pointer in the low 48 bits, the singleton values
+// use small tags instead.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL       1
+#define TAG_FALSE     2
+#define TAG_TRUE      3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_OBJ(value)    ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value)   ((value) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value) num_to_value(value)
+#define OBJ_VAL(object)   ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+static inline double value_to_num(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value num_to_value(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+// There is no room for a separate integer type, integers are doubles here.
+#define IS_INT(value)  false
+#define AS_INT(value)  ((int64_t)AS_NUMBER(value))
+#define INT_VAL(value) NUMBER_VAL((double)(value))
+
+#else
+
 #define IS_BOOL(value)   ((value).type == VAL_BOOL)
 #define IS_NIL(value)    ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value)    ((value).type == VAL_INT)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)   ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value)    ((value).as.integer)
 #define AS_OBJ(value)    ((value).as.obj)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL,   { .boolean = value }})
 #define NIL_VAL           ((Value){VAL_NIL,    { .number = 0 }})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, { .number = value }})
+#define INT_VAL(value)    ((Value){VAL_INT,    { .integer = value }})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ,    { .obj = (Obj *)object }})
-
-typedef struct Obj Obj;
-typedef struct ObjString ObjString;
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, { .number = 0 }})
 
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -32,10 +98,148 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;
 } Value;
 
+#endif
+
+// Numbers come in two kinds: IS_NUMBER is a double and IS_INT a 64-bit
+// integer, which integer literals produce. Arithmetic keeps integers as long
+// as the result is one that fits, anything else is done on doubles.
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+// either kind as a double
+#define AS_DOUBLE(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value))
+
+// false, with `result` untouched, if the result would overflow
+static inline bool int_add(int64_t a, int64_t b, int64_t *result) {
+#ifdef __GNUC__
+    return !__builtin_add_overflow(a, b, result);
+#else
+    if (b > 0 ? a > INT64_MAX - b : a < INT64_MIN - b)
+        return false;
+    *result = a + b;
+    return true;
+#endif
+}
+
+static inline bool int_subtract(int64_t a, int64_t b, int64_t *result) {
+#ifdef __GNUC__
+    return !__builtin_sub_overflow(a, b, result);
+#else
+    if (b < 0 ? a > INT64_MAX + b : a < INT64_MIN + b)
+        return false;
+    *result = a - b;
+    return true;
+#endif
+}
+
+static inline bool int_multiply(int64_t a, int64_t b, int64_t *result) {
+#ifdef __GNUC__
+    return !__builtin_mul_overflow(a, b, result);
+#else
+    if (a > 0 ? b > INT64_MAX / a || b < INT64_MIN / a
+              : a < -1 ? b < INT64_MAX / a || b > INT64_MIN / a
+                       : a == -1 && b == INT64_MIN)
+        return false;
+    *result = a * b;
+    return true;
+#endif
+}
+
+// The operands of these must be IS_NUMERIC.
+
+static inline Value number_add(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && int_add(AS_INT(a), AS_INT(b), &result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+}
+
+static inline Value number_subtract(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) &&
+        int_subtract(AS_INT(a), AS_INT(b), &result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b));
+}
+
+// Integers have no -0, so a zero from a negative operand is left to the
+// doubles. Prints and compares the same as it would without integers.
+static inline Value number_multiply(Value a, Value b) {
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) &&
+        int_multiply(AS_INT(a), AS_INT(b), &result) &&
+        (result != 0 || (AS_INT(a) | AS_INT(b)) >= 0))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_DOUBLE(a) * AS_DOUBLE(b));
+}
+
+// always a double, 7 / 2 is 3.5
+static inline Value number_divide(Value a, Value b) {
+    return NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b));
+}
+
+// -0 is a double, as is the negation of INT64_MIN
+static inline Value number_negate(Value a) {
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN && AS_INT(a) != 0)
+        return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-AS_DOUBLE(a));
+}
+
+// The order of integer `a` and double `b`: -1, 0 or 1 for less, equal and
+// greater, 2 if `b` is NaN. Exact, unlike comparing `a` as a double, which
+// would make 2^53 + 1 equal 2^53.
+static inline int int_double_order(int64_t a, double b) {
+    if (b != b)
+        return 2;
+    if (b >= 9223372036854775808.0)
+        return -1;
+    if (b < -9223372036854775808.0)
+        return 1;
+
+    // in range, so the whole part is an integer and exact as a double
+    int64_t whole = (int64_t)b;
+    if (a != whole)
+        return a < whole ? -1 : 1;
+    return b > (double)whole ? -1 : b < (double)whole;
+}
+
+// the order as above of an integer and a double in either position
+static inline int mixed_order(Value a, Value b) {
+    if (IS_INT(a))
+        return int_double_order(AS_INT(a), AS_NUMBER(b));
+
+    int order = int_double_order(AS_INT(b), AS_NUMBER(a));
+    return order == 2 ? order : -order;
+}
+
+static inline bool number_equal(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) == AS_INT(b);
+    if (IS_INT(a) || IS_INT(b))
+        return mixed_order(a, b) == 0;
+    return AS_NUMBER(a) == AS_NUMBER(b);
+}
+
+static inline bool number_greater(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) > AS_INT(b);
+    if (IS_INT(a) || IS_INT(b))
+        return mixed_order(a, b) == 1;
+    return AS_NUMBER(a) > AS_NUMBER(b);
+}
+
+static inline bool number_less(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) < AS_INT(b);
+    if (IS_INT(a) || IS_INT(b))
+        return mixed_order(a, b) == -1;
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
 typedef struct {
     int len;
     int cap;
@@ -46,8 +250,13 @@ void value_array_init(ValueArray *array);
 void value_array_free(ValueArray *array);
 void value_array_push(ValueArray *array, Value value);
 
+// the value of the number literal `chars`, an integer if it has no decimal
+// point and fits
+Value value_parse_number(const char *chars, int len);
 void value_print(Value value);
-void object_print(Value value);
+void value_fprint(FILE *file, Value value);
+void object_print(FILE *file, Value value);
 bool values_equal(Value a, Value b);
+bool value_is_falsy(Value value);
 
 #endif
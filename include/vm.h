@@ -3,11 +3,45 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "regchunk.h"
 #include "value.h"
 #include "table.h"
+#include "pool.h"
 
 #define STACK_MAX 1024
 
+// A script compiled once by vm_compile() that can be run any number of times
+// with vm_run(). It refers to the global slots and interned strings of the
+// VM that compiled it and must only be run on that VM.
+typedef struct Script {
+    Chunk chunk;
+    // code for the register VM when compiled with VM.registers, its
+    // constants are those of `chunk`
+    RegChunk reg;
+    // native code for `chunk`, compiled by the first vm_run() with VM.jit
+    struct JitCode *jit;
+
+    // every live script is linked into its VM so the collector can mark
+    // its constants
+    struct Script *prev;
+    struct Script *next;
+} Script;
+
+typedef struct {
+    int collections;
+    size_t bytes_freed;
+    // in seconds
+    double total_pause;
+    double max_pause;
+} GCStats;
+
+typedef struct {
+    int recorded;
+    int aborted;
+    // times a trace gave control back to the interpreter
+    uint64_t side_exits;
+} TraceStats;
+
 typedef struct {
     Chunk *chunk;
     Value stack[STACK_MAX];
@@ -15,7 +49,55 @@ typedef struct {
     Value *sp;
     Obj *objects;
     Table strings;
+    // seeds hash_string() for every string of this VM
+    uint64_t hash_seed;
+
+    // globals are resolved to slots at compile time, `globals` maps each
+    // name to its slot and is only consulted when going by name
     Table globals;
+    ValueArray global_names;
+    ValueArray global_values;
+
+    // garbage collector state, see memory.c
+    Script *scripts;
+    size_t bytes_allocated;
+    size_t next_gc;
+    double gc_growth_factor;
+    int gray_len;
+    int gray_cap;
+    Obj **gray_stack;
+    GCStats gc_stats;
+
+    // objects and small payloads, released wholesale by free_objects()
+    Pool pool;
+
+    // when positive, vm_compile() lexes the whole source up front on up
+    // to this many threads before parsing, see lexer.h
+    int lex_threads;
+
+    // run optimize_chunk() over everything vm_compile() produces
+    bool optimize;
+    // debug builds print what vm_compile() produced to stdout, off for
+    // output that has to stay clean, like --emit-c's
+    bool print_code;
+    // compile for the register VM instead, see regvm.c
+    bool registers;
+    // run stack VM code as native code where the platform allows, see jit.c
+    bool jit;
+    // record hot loops and run them as native code, see trace.c
+    bool trace;
+    // back edges before a loop is recorded
+    int trace_threshold;
+    struct Trace *traces;
+    TraceStats trace_stats;
+
+    // print statements and runtime errors, stdout and stderr by default
+    FILE *out;
+    FILE *err;
+
+    // instructions executed by either VM, only counted when built with
+    // -DCOUNT_INSTRUCTIONS
+    uint64_t instructions;
 } VM;
 
 typedef enum {
@@ -29,6 +111,19 @@ void vm_free(VM *vm);
 
 void vm_stack_push(VM *vm, Value value);
 Value vm_stack_pop(VM *vm);
+Value vm_stack_peek(VM *vm, int distance);
+// replace the two strings or ropes on top of the stack with their
+// concatenation
+void vm_concatenate(VM *vm);
+
+int vm_global_slot(VM *vm, ObjString *name);
+bool vm_global_get(VM *vm, ObjString *name, Value *value);
+void vm_global_set(VM *vm, ObjString *name, Value value);
+
+Script *vm_script_new(VM *vm);
+Script *vm_compile(VM *vm, const char *source);
+InterpretResult vm_run(VM *vm, Script *script, bool reset_globals);
+void vm_script_free(VM *vm, Script *script);
 
 InterpretResult vm_interpret(VM *vm, const char *source);
 
@@ -0,0 +1,536 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+// Ahead of time translation to C. Every instruction becomes a few lines of C
+// under a label named after its offset and jumps become gotos. The stack
+// height at each offset is worked out first, which turns every stack slot,
+// locals included, into a C local that the C compiler can keep in a
+// register. Values only go through vm->stack around calls into the runtime
+// that may collect garbage, the collector then sees them as roots.
+//
+// The output is built against the headers in include/ and the clox-runtime
+// library, with -DNAN_BOXING if clox was built with it:
+//
+//   clox --emit-c script.lox > script.c
+//   cc -O2 -Iinclude script.c build/libclox-runtime.a -lm -lpthread
+//
+// It prints the same and fails with the same runtime errors as run().
+
+// superinstructions are translated as the sequence they were fused from
+typedef struct {
+    int next;
+    int count;
+    InstructionPart parts[INSTRUCTION_PARTS_MAX];
+} Instruction;
+
+// False if the instruction at `offset` can't be translated.
+static bool decode(Chunk *chunk, int offset, Instruction *instruction) {
+    instruction->next = offset + chunk_opcode_size(chunk->code[offset]);
+    instruction->count = chunk_decode(chunk, offset, instruction->parts);
+    return instruction->count >= 0;
+}
+
+static void stack_effect(uint8_t opcode, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL:
+        case OP_POP_JUMP_IF_FALSE:
+            *pops = 1;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            *pops = 2;
+            *pushes = 1;
+            break;
+    }
+}
+
+// The offsets control goes to after `instruction`, returns how many.
+static int successors(Instruction *instruction, int *next) {
+    if (instruction->count == 0) {
+        next[0] = instruction->next;
+        return 1;
+    }
+
+    InstructionPart *last = &instruction->parts[instruction->count - 1];
+    switch (last->opcode) {
+        case OP_RETURN:
+            return 0;
+        case OP_JUMP:
+        case OP_LOOP:
+            next[0] = last->target;
+            return 1;
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            next[0] = instruction->next;
+            next[1] = last->target;
+            return 2;
+        default:
+            next[0] = instruction->next;
+            return 1;
+    }
+}
+
+// Set the stack height before every instruction, -1 where none is reached,
+// and `slots` to the most values the stack ever holds. False if there is an
+// instruction that can't be translated, that is reached with two heights or
+// that would take more values than there are.
+static bool measure(Chunk *chunk, int *heights, int *slots) {
+    int *pending = ALLOCATE(int, chunk->len);
+    int pending_len = 0;
+    bool ok = chunk->len > 0;
+
+    for (int i = 0; i < chunk->len; i++)
+        heights[i] = -1;
+    if (ok) {
+        heights[0] = 0;
+        pending[pending_len++] = 0;
+    }
+    *slots = 0;
+
+    while (ok && pending_len > 0) {
+        int offset = pending[--pending_len];
+        int height = heights[offset];
+
+        Instruction instruction;
+        if (!decode(chunk, offset, &instruction)) {
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; i < instruction.count && ok; i++) {
+            InstructionPart *part = &instruction.parts[i];
+            int pops, pushes;
+            stack_effect(part->opcode, &pops, &pushes);
+
+            ok = height >= pops && height - pops + pushes <= STACK_MAX;
+            height += pushes - pops;
+            if (height > *slots)
+                *slots = height;
+            // locals are slots like any other
+            if ((part->opcode == OP_GET_LOCAL ||
+                 part->opcode == OP_SET_LOCAL) && part->operand >= *slots)
+                *slots = part->operand + 1;
+        }
+
+        int next[2];
+        int count = successors(&instruction, next);
+        for (int i = 0; i < count && ok; i++) {
+            if (next[i] < 0 || next[i] >= chunk->len) {
+                ok = false;
+            }
+            else if (heights[next[i]] == -1) {
+                heights[next[i]] = height;
+                pending[pending_len++] = next[i];
+            }
+            else {
+                ok = heights[next[i]] == height;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, pending, chunk->len);
+    return ok;
+}
+
+static void emit_number(FILE *file, double number) {
+    if (isnan(number))
+        // keep the sign, x86 makes negative ones
+        fputs(signbit(number) ? "-NAN" : "NAN", file);
+    else if (isinf(number))
+        fputs(number > 0 ? "HUGE_VAL" : "-HUGE_VAL", file);
+    else
+        // hexadecimal, so that it reads back exactly
+        fprintf(file, "%a", number);
+}
+
+static void emit_int(FILE *file, int64_t integer) {
+    // C only has a literal for its negation
+    if (integer == INT64_MIN)
+        fputs("INT64_MIN", file);
+    else
+        fprintf(file, "INT64_C(%" PRId64 ")", integer);
+}
+
+static void emit_string(FILE *file, const char *data, int len) {
+    fputc('"', file);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)data[i];
+        // '?' would start a trigraph
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?')
+            fputc(c, file);
+        else
+            fprintf(file, "\\%03o", c);
+    }
+    fputc('"', file);
+}
+
+static const char PREAMBLE[] =
+    "#include <math.h>\n"
+    "#include <stdarg.h>\n"
+    "#include <stdio.h>\n"
+    "\n"
+    "#include \"memory.h\"\n"
+    "#include \"object.h\"\n"
+    "#include \"value.h\"\n"
+    "#include \"vm.h\"\n"
+    "\n"
+    "// every offset has a label, most are never jumped to\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-function\"\n"
+    "\n"
+    "#define GLOBAL(slot) (vm->global_values.values[slot])\n"
+    "#define NUMBERS(a, b) (IS_NUMERIC(a) && IS_NUMERIC(b))\n"
+    "#define FALSY(value) (IS_NIL(value) || (IS_BOOL(value) && "
+    "!AS_BOOL(value)))\n"
+    "\n"
+    "static int fail(VM *vm, int line, const char *format, ...) {\n"
+    "    va_list args;\n"
+    "    va_start(args, format);\n"
+    "    vfprintf(vm->err, format, args);\n"
+    "    va_end(args);\n"
+    "    fprintf(vm->err, \"\\n[line %d] in script\\n\", line);\n"
+    "    return 70;\n"
+    "}\n"
+    "\n"
+    "static int undefined(VM *vm, int line, int slot) {\n"
+    "    return fail(vm, line, \"Undefined variable '%s'.\",\n"
+    "                AS_STRING(vm->global_names.values[slot])->data);\n"
+    "}\n"
+    "\n"
+    "// the two values on top of vm->stack, flattening ropes allocates\n"
+    "static bool equal(VM *vm) {\n"
+    "    for (int i = 1; i <= 2; i++) {\n"
+    "        if (IS_ROPE(vm->sp[-i]))\n"
+    "            vm->sp[-i] = OBJ_VAL(flatten_rope(vm, "
+    "AS_ROPE(vm->sp[-i])));\n"
+    "    }\n"
+    "    return values_equal(vm->sp[-2], vm->sp[-1]);\n"
+    "}\n"
+    "\n"
+    "static void number(ValueArray *constants, double value) {\n"
+    "    value_array_push(constants, NUMBER_VAL(value));\n"
+    "}\n"
+    "\n"
+    "static void integer(ValueArray *constants, int64_t value) {\n"
+    "    value_array_push(constants, INT_VAL(value));\n"
+    "}\n"
+    "\n"
+    "static void string(VM *vm, ValueArray *constants, const char *data,\n"
+    "                   int len) {\n"
+    "    // kept on the stack until the constants hold it\n"
+    "    vm_stack_push(vm, OBJ_VAL(copy_string(vm, data, len)));\n"
+    "    value_array_push(constants, vm_stack_peek(vm, 0));\n"
+    "    vm_stack_pop(vm);\n"
+    "}\n"
+    "\n"
+    "static void global(VM *vm, const char *data, int len) {\n"
+    "    vm_global_slot(vm, copy_string(vm, data, len));\n"
+    "}\n"
+    "\n";
+
+// Recreates the constants and global slots of the script in a fresh VM.
+static void emit_setup(VM *vm, Chunk *chunk, FILE *file) {
+    fputs("static void setup(VM *vm, ValueArray *constants) {\n", file);
+
+    for (int i = 0; i < chunk->constants.len; i++) {
+        Value value = chunk->constants.values[i];
+        fputs("    ", file);
+        if (IS_STRING(value)) {
+            ObjString *string = AS_STRING(value);
+            fputs("string(vm, constants, ", file);
+            emit_string(file, string->data, string->len);
+            fprintf(file, ", %d);\n", string->len);
+        }
+        else if (IS_INT(value)) {
+            fputs("integer(constants, ", file);
+            emit_int(file, AS_INT(value));
+            fputs(");\n", file);
+        }
+        else {
+            fputs("number(constants, ", file);
+            emit_number(file, AS_NUMBER(value));
+            fputs(");\n", file);
+        }
+    }
+
+    // in slot order, so each gets the slot the code refers to
+    for (int i = 0; i < vm->global_names.len; i++) {
+        ObjString *name = AS_STRING(vm->global_names.values[i]);
+        fputs("    global(vm, ", file);
+        emit_string(file, name->data, name->len);
+        fprintf(file, ", %d);\n", name->len);
+    }
+
+    fputs("}\n\n", file);
+}
+
+// hands the stack to a runtime call that may collect garbage
+static void emit_spill(FILE *file, int height) {
+    for (int i = 0; i < height; i++)
+        fprintf(file, "        vm->stack[%d] = s%d;\n", i, i);
+    fprintf(file, "        vm->sp = vm->stack + %d;\n", height);
+}
+
+// the function of value.h that does `opcode`
+static const char *number_function(uint8_t opcode) {
+    switch (opcode) {
+        case OP_SUBTRACT: return "number_subtract";
+        case OP_MULTIPLY: return "number_multiply";
+        case OP_DIVIDE:   return "number_divide";
+        case OP_LESS:     return "number_less";
+        case OP_GREATER:  return "number_greater";
+        default:          return NULL;
+    }
+}
+
+// C for `part` with `height` values on the stack.
+static void emit_part(FILE *file, Chunk *chunk, InstructionPart *part,
+                      int height, int line) {
+    // the slots of the operands, `b` being the top
+    int a = height - 2;
+    int b = height - 1;
+
+    switch (part->opcode) {
+        case OP_CONSTANT: {
+            Value value = chunk->constants.values[part->operand];
+            fprintf(file, "    s%d = ", height);
+            if (IS_NUMBER(value)) {
+                fputs("NUMBER_VAL(", file);
+                emit_number(file, AS_NUMBER(value));
+                fputs(");\n", file);
+            }
+            else if (IS_INT(value)) {
+                fputs("INT_VAL(", file);
+                emit_int(file, AS_INT(value));
+                fputs(");\n", file);
+            }
+            else {
+                fprintf(file, "constants[%d];\n", part->operand);
+            }
+            break;
+        }
+        case OP_NIL:
+            fprintf(file, "    s%d = NIL_VAL;\n", height);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            fprintf(file, "    s%d = BOOL_VAL(%s);\n", height,
+                    part->opcode == OP_TRUE ? "true" : "false");
+            break;
+        case OP_POP:
+            break;
+        case OP_NOT:
+            fprintf(file, "    s%d = BOOL_VAL(FALSY(s%d));\n", b, b);
+            break;
+
+        case OP_GET_LOCAL:
+            fprintf(file, "    s%d = s%d;\n", height, part->operand);
+            break;
+        case OP_SET_LOCAL:
+            fprintf(file, "    s%d = s%d;\n", part->operand, b);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            fprintf(file,
+                    "    if (IS_UNDEFINED(GLOBAL(%d)))\n"
+                    "        return undefined(vm, %d, %d);\n",
+                    part->operand, line, part->operand);
+            if (part->opcode == OP_GET_GLOBAL)
+                fprintf(file, "    s%d = GLOBAL(%d);\n", height, part->operand);
+            else
+                fprintf(file, "    GLOBAL(%d) = s%d;\n", part->operand, b);
+            break;
+        case OP_DEFINE_GLOBAL:
+            fprintf(file, "    GLOBAL(%d) = s%d;\n", part->operand, b);
+            break;
+
+        case OP_EQUAL:
+            fprintf(file,
+                    "    if (NUMBERS(s%d, s%d))\n"
+                    "        s%d = BOOL_VAL(number_equal(s%d, s%d));\n"
+                    "    else if (!IS_ROPE(s%d) && !IS_ROPE(s%d))\n"
+                    "        s%d = BOOL_VAL(values_equal(s%d, s%d));\n"
+                    "    else {\n",
+                    a, b, a, a, b, a, b, a, a, b);
+            emit_spill(file, height);
+            fprintf(file, "        s%d = BOOL_VAL(equal(vm));\n    }\n", a);
+            break;
+
+        case OP_ADD:
+            fprintf(file,
+                    "    if (NUMBERS(s%d, s%d))\n"
+                    "        s%d = number_add(s%d, s%d);\n"
+                    "    else if (IS_TEXT(s%d) && IS_TEXT(s%d)) {\n",
+                    a, b, a, a, b, a, b);
+            emit_spill(file, height);
+            fprintf(file,
+                    "        vm_concatenate(vm);\n"
+                    "        s%d = vm->stack[%d];\n"
+                    "    }\n"
+                    "    else\n"
+                    "        return fail(vm, %d, "
+                    "\"Operands must be two numbers or strings.\");\n",
+                    a, a, line);
+            break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER: {
+            bool compare = part->opcode == OP_LESS ||
+                           part->opcode == OP_GREATER;
+            fprintf(file,
+                    "    if (!NUMBERS(s%d, s%d))\n"
+                    "        return fail(vm, %d, "
+                    "\"Operands must be numbers.\");\n"
+                    "    s%d = %s(%s(s%d, s%d));\n",
+                    a, b, line, a, compare ? "BOOL_VAL" : "",
+                    number_function(part->opcode), a, b);
+            break;
+        }
+
+        case OP_NEGATE:
+            fprintf(file,
+                    "    if (!IS_NUMERIC(s%d))\n"
+                    "        return fail(vm, %d, "
+                    "\"Operand must be a number.\");\n"
+                    "    s%d = number_negate(s%d);\n",
+                    b, line, b, b);
+            break;
+        case OP_PRINT:
+            fprintf(file,
+                    "    value_fprint(vm->out, s%d);\n"
+                    "    fputc('\\n', vm->out);\n", b);
+            break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+            fprintf(file, "    goto L%d;\n", part->target);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            fprintf(file, "    if (FALSY(s%d))\n        goto L%d;\n", b,
+                    part->target);
+            break;
+        case OP_RETURN:
+            fputs("    return 0;\n", file);
+            break;
+    }
+}
+
+static void emit_run(Chunk *chunk, int *heights, int slots, FILE *file) {
+    fputs("static int run(VM *vm, Value *constants) {\n", file);
+    fputs("    (void)constants;\n", file);
+    for (int i = 0; i < slots; i++)
+        fprintf(file, "    Value s%d = NIL_VAL;\n", i);
+    fputs("\n", file);
+
+    for (int offset = 0; offset < chunk->len;) {
+        // measure() decoded whatever is reached
+        Instruction instruction;
+        if (!decode(chunk, offset, &instruction))
+            break;
+
+        // never reached, there is nothing to jump to either
+        if (heights[offset] < 0) {
+            offset = instruction.next;
+            continue;
+        }
+
+        int line = chunk->line[offset];
+        fprintf(file, "L%d:; // %s, line %d\n", offset,
+                opcode_name(chunk_generic_opcode(chunk->code[offset])), line);
+
+        int height = heights[offset];
+        for (int i = 0; i < instruction.count; i++) {
+            InstructionPart *part = &instruction.parts[i];
+            emit_part(file, chunk, part, height, line);
+
+            int pops, pushes;
+            stack_effect(part->opcode, &pops, &pushes);
+            height += pushes - pops;
+        }
+
+        offset = instruction.next;
+    }
+
+    fputs("}\n\n", file);
+}
+
+bool aot_emit(VM *vm, Script *script, FILE *file) {
+    Chunk *chunk = &script->chunk;
+    // the register VM's code has no stack to translate
+    if (script->reg.len > 0)
+        return false;
+
+    int *heights = ALLOCATE(int, chunk->len + 1);
+    int slots;
+    bool ok = measure(chunk, heights, &slots);
+
+    if (ok) {
+        fputs("// Written by clox --emit-c, see src/aot.c for how to build "
+              "it.\n\n", file);
+#ifdef NAN_BOXING
+        fputs("#ifndef NAN_BOXING\n"
+              "#error \"build with -DNAN_BOXING like the clox that wrote "
+              "this\"\n"
+              "#endif\n\n", file);
+#else
+        fputs("#ifdef NAN_BOXING\n"
+              "#error \"build without NAN_BOXING like the clox that wrote "
+              "this\"\n"
+              "#endif\n\n", file);
+#endif
+        fputs(PREAMBLE, file);
+        emit_setup(vm, chunk, file);
+        emit_run(chunk, heights, slots, file);
+        fputs("int main(void) {\n"
+              "    VM vm;\n"
+              "    vm_init(&vm);\n"
+              "    Script *script = vm_script_new(&vm);\n"
+              "    setup(&vm, &script->chunk.constants);\n"
+              "\n"
+              "    int status = run(&vm, script->chunk.constants.values);\n"
+              "\n"
+              "    vm_script_free(&vm, script);\n"
+              "    vm_free(&vm);\n"
+              "    return status;\n"
+              "}\n", file);
+    }
+
+    FREE_ARRAY(int, heights, chunk->len + 1);
+    return ok;
+}
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+
+// Layout of a cache file, all integers in host byte order:
+//
+//   header     "CLXB", u32 version, u32 flags, u64 source hash,
+//              u32 source length
+//   code       u32 length, bytes
+//   lines      u32 runs, then (i32 line, u32 count) per run
+//   constants  u32 count, then per constant a u8 tag followed by
+//              a f64 for numbers or u32 length + bytes for strings
+//   globals    u32 count, then u32 length + bytes per name, in slot order
+//   checksum   u64 FNV-1a hash of everything before it
+//
+// The global operands in `code` refer to the slots of the VM that wrote the
+// file and are remapped to the slots of the loading VM. The loader checks
+// that every instruction is one run() can execute without reading outside
+// the chunk, the constants or the globals, the checksum catches any other
+// damage, such as a flipped byte that still decodes to a valid instruction.
+
+static const char CACHE_MAGIC[4] = {'C', 'L', 'X', 'B'};
+
+// code compiled with other flags than the loading VM's is compiled again
+#define CACHE_OPTIMIZED 0x1
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    // loaded as a double by builds without integers
+    CONSTANT_INT,
+} ConstantTag;
+
+#define HASH_SEED 14695981039346656037u
+
+typedef struct {
+    const uint8_t *at;
+    const uint8_t *end;
+    bool ok;
+} Reader;
+
+typedef struct {
+    FILE *file;
+    // of everything written so far
+    uint64_t hash;
+} Writer;
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint64_t source_hash(const char *source, size_t length) {
+    return hash_bytes(HASH_SEED, source, length);
+}
+
+static void write_bytes(Writer *writer, const void *data, size_t size) {
+    fwrite(data, 1, size, writer->file);
+    writer->hash = hash_bytes(writer->hash, data, size);
+}
+
+static void write_u32(Writer *writer, uint32_t value) {
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static uint32_t cache_flags(VM *vm) {
+    return vm->optimize ? CACHE_OPTIMIZED : 0;
+}
+
+static const void *read_bytes(Reader *reader, size_t size) {
+    if (!reader->ok || (size_t)(reader->end - reader->at) < size) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    const void *data = reader->at;
+    reader->at += size;
+    return data;
+}
+
+static uint32_t read_u32(Reader *reader) {
+    uint32_t value = 0;
+    const void *data = read_bytes(reader, sizeof(value));
+    if (data != NULL)
+        memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static bool write_chunk(VM *vm, Chunk *chunk, Writer *writer) {
+    // code that already ran may be quickened, the file gets the generic
+    // forms
+    uint8_t *code = ALLOCATE(uint8_t, chunk->len + 1);
+    memcpy(code, chunk->code, chunk->len);
+    for (int offset = 0; offset < chunk->len;) {
+        code[offset] = chunk_generic_opcode(code[offset]);
+        offset += chunk_opcode_size(code[offset]);
+    }
+
+    write_u32(writer, chunk->len);
+    write_bytes(writer, code, chunk->len);
+    FREE_ARRAY(uint8_t, code, chunk->len + 1);
+
+    uint32_t runs = 0;
+    for (int i = 0; i < chunk->len; i++) {
+        if (i == 0 || chunk->line[i] != chunk->line[i - 1])
+            runs++;
+    }
+
+    write_u32(writer, runs);
+    for (int i = 0; i < chunk->len;) {
+        int32_t line = chunk->line[i];
+        uint32_t count = 0;
+        while (i < chunk->len && chunk->line[i] == line) {
+            count++; i++;
+        }
+        write_bytes(writer, &line, sizeof(line));
+        write_u32(writer, count);
+    }
+
+    write_u32(writer, chunk->constants.len);
+    for (int i = 0; i < chunk->constants.len; i++) {
+        Value value = chunk->constants.values[i];
+
+        if (IS_NUMBER(value)) {
+            uint8_t tag = CONSTANT_NUMBER;
+            double number = AS_NUMBER(value);
+            write_bytes(writer, &tag, 1);
+            write_bytes(writer, &number, sizeof(number));
+        }
+        else if (IS_INT(value)) {
+            uint8_t tag = CONSTANT_INT;
+            int64_t integer = AS_INT(value);
+            write_bytes(writer, &tag, 1);
+            write_bytes(writer, &integer, sizeof(integer));
+        }
+        else if (IS_STRING(value)) {
+            uint8_t tag = CONSTANT_STRING;
+            write_bytes(writer, &tag, 1);
+            write_u32(writer, AS_STRING(value)->len);
+            write_bytes(writer, AS_CSTRING(value), AS_STRING(value)->len);
+        }
+        else {
+            return false;
+        }
+    }
+
+    write_u32(writer, vm->global_names.len);
+    for (int i = 0; i < vm->global_names.len; i++) {
+        ObjString *name = AS_STRING(vm->global_names.values[i]);
+        write_u32(writer, name->len);
+        write_bytes(writer, name->data, name->len);
+    }
+
+    return true;
+}
+
+bool cache_write(VM *vm, Script *script, const char *path, const char *source) {
+    size_t path_len = strlen(path);
+    char *tmp_path = ALLOCATE(char, path_len + 5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    Writer writer = {fopen(tmp_path, "wb"), HASH_SEED};
+    if (writer.file == NULL) {
+        FREE_ARRAY(char, tmp_path, path_len + 5);
+        return false;
+    }
+
+    size_t source_len = strlen(source);
+    uint32_t version = CACHE_VERSION;
+    uint64_t hash = source_hash(source, source_len);
+
+    write_bytes(&writer, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    write_u32(&writer, version);
+    write_u32(&writer, cache_flags(vm));
+    write_bytes(&writer, &hash, sizeof(hash));
+    write_u32(&writer, (uint32_t)source_len);
+
+    bool ok = write_chunk(vm, &script->chunk, &writer);
+    uint64_t checksum = writer.hash;
+    write_bytes(&writer, &checksum, sizeof(checksum));
+    ok = !ferror(writer.file) && ok;
+    ok = fclose(writer.file) == 0 && ok;
+
+    // write to the side and rename so that a concurrent run never maps a
+    // half written file
+    if (ok)
+        ok = rename(tmp_path, path) == 0;
+    if (!ok)
+        remove(tmp_path);
+
+    FREE_ARRAY(char, tmp_path, path_len + 5);
+    return ok;
+}
+
+static bool read_header(VM *vm, Reader *reader, const char *source) {
+    const void *magic = read_bytes(reader, sizeof(CACHE_MAGIC));
+    uint32_t version = read_u32(reader);
+    uint32_t flags = read_u32(reader);
+
+    uint64_t hash = 0;
+    const void *hash_data = read_bytes(reader, sizeof(hash));
+    uint32_t source_len = read_u32(reader);
+
+    if (!reader->ok)
+        return false;
+
+    memcpy(&hash, hash_data, sizeof(hash));
+    size_t actual_len = strlen(source);
+
+    return memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+           version == CACHE_VERSION &&
+           flags == cache_flags(vm) &&
+           source_len == actual_len &&
+           hash == source_hash(source, actual_len);
+}
+
+static void read_code(Reader *reader, Chunk *chunk) {
+    uint32_t len = read_u32(reader);
+    const uint8_t *code = read_bytes(reader, len);
+    if (code == NULL)
+        return;
+
+    chunk->cap = len + 1;
+    chunk->code = ALLOCATE(uint8_t, chunk->cap);
+    chunk->line = ALLOCATE(int, chunk->cap);
+    memcpy(chunk->code, code, len);
+    chunk->len = len;
+
+    uint32_t runs = read_u32(reader);
+    int filled = 0;
+    for (uint32_t i = 0; i < runs && reader->ok; i++) {
+        int32_t line = 0;
+        const void *line_data = read_bytes(reader, sizeof(line));
+        uint32_t count = read_u32(reader);
+
+        if (!reader->ok || count > (uint32_t)(chunk->len - filled)) {
+            reader->ok = false;
+            return;
+        }
+
+        memcpy(&line, line_data, sizeof(line));
+        for (uint32_t j = 0; j < count; j++)
+            chunk->line[filled++] = line;
+    }
+
+    if (filled != chunk->len)
+        reader->ok = false;
+}
+
+static void read_constants(VM *vm, Reader *reader, Chunk *chunk) {
+    uint32_t count = read_u32(reader);
+
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        const uint8_t *tag = read_bytes(reader, 1);
+        if (tag == NULL)
+            return;
+
+        switch (*tag) {
+            case CONSTANT_NUMBER: {
+                double number;
+                const void *data = read_bytes(reader, sizeof(number));
+                if (data == NULL)
+                    return;
+
+                memcpy(&number, data, sizeof(number));
+                value_array_push(&chunk->constants, NUMBER_VAL(number));
+                break;
+            }
+            case CONSTANT_INT: {
+                int64_t integer;
+                const void *data = read_bytes(reader, sizeof(integer));
+                if (data == NULL)
+                    return;
+
+                memcpy(&integer, data, sizeof(integer));
+                value_array_push(&chunk->constants, INT_VAL(integer));
+                break;
+            }
+            case CONSTANT_STRING: {
+                uint32_t len = read_u32(reader);
+                const char *data = read_bytes(reader, len);
+                if (data == NULL)
+                    return;
+
+                Value string = OBJ_VAL(copy_string(vm, data, len));
+                vm_stack_push(vm, string);
+                value_array_push(&chunk->constants, string);
+                vm_stack_pop(vm);
+                break;
+            }
+            default:
+                reader->ok = false;
+                return;
+        }
+    }
+}
+
+// Whether the instruction at `offset` jumps only to the start of an
+// instruction, `starts` marks those.
+static bool check_jump(Chunk *chunk, int offset, const bool *starts) {
+    uint8_t *code = &chunk->code[offset];
+    int distance = code[1] << 8 | code[2];
+    int target = offset + 3 + (code[0] == OP_LOOP ? -distance : distance);
+
+    return target >= 0 && target < chunk->len && starts[target];
+}
+
+// Check that the code decodes into known instructions that end with a return
+// and that the constants and jump targets they use exist.
+static void check_code(Reader *reader, Chunk *chunk) {
+    if (!reader->ok)
+        return;
+
+    bool *starts = ALLOCATE(bool, chunk->len + 1);
+    memset(starts, 0, chunk->len + 1);
+
+    int last = -1;
+    for (int offset = 0; offset < chunk->len;) {
+        if (chunk->code[offset] > OP_GREATER_NUM) {
+            reader->ok = false;
+            break;
+        }
+
+        starts[offset] = true;
+        last = offset;
+        offset += chunk_opcode_size(chunk->code[offset]);
+    }
+
+    if (last < 0 || chunk->code[last] != OP_RETURN ||
+        last + chunk_opcode_size(OP_RETURN) != chunk->len)
+        reader->ok = false;
+
+    for (int offset = 0; offset < chunk->len && reader->ok;) {
+        uint8_t *code = &chunk->code[offset];
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+                reader->ok = code[1] < chunk->constants.len;
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_CONSTANT:
+            case OP_INCREMENT_LOCAL:
+                reader->ok = code[2] < chunk->constants.len;
+                break;
+            case OP_CONSTANT_LONG:
+                reader->ok = (code[1] << 8 | code[2]) < chunk->constants.len;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_LESS:
+                reader->ok = check_jump(chunk, offset, starts);
+                break;
+        }
+
+        offset += chunk_opcode_size(code[0]);
+    }
+
+    FREE_ARRAY(bool, starts, chunk->len + 1);
+}
+
+// Resolve the names stored in the file against the loading VM and rewrite
+// every global operand to the slot it got there.
+static void read_globals(VM *vm, Reader *reader, Chunk *chunk) {
+    uint32_t count = read_u32(reader);
+    if (!reader->ok || count > (size_t)(reader->end - reader->at))
+        return;
+
+    int *slots = ALLOCATE(int, count + 1);
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        uint32_t len = read_u32(reader);
+        const char *name = read_bytes(reader, len);
+        if (name != NULL)
+            slots[i] = vm_global_slot(vm, copy_string(vm, name, len));
+    }
+
+    // check_code() made sure the instructions decode
+    for (int offset = 0; offset < chunk->len && reader->ok;) {
+        uint8_t *code = &chunk->code[offset];
+
+        switch (code[0]) {
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL: {
+                if (code[1] >= count || slots[code[1]] > UINT8_MAX)
+                    reader->ok = false;
+                else
+                    code[1] = slots[code[1]];
+                break;
+            }
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+            case OP_DEFINE_GLOBAL_LONG: {
+                uint16_t slot = code[1] << 8 | code[2];
+                if (slot >= count || slots[slot] > UINT16_MAX) {
+                    reader->ok = false;
+                }
+                else {
+                    code[1] = (slots[slot] >> 8) & 0xff;
+                    code[2] = (slots[slot] >> 0) & 0xff;
+                }
+                break;
+            }
+        }
+
+        offset += chunk_opcode_size(code[0]);
+    }
+
+    FREE_ARRAY(int, slots, count + 1);
+}
+
+Script *cache_load(VM *vm, const char *path, const char *source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+    // the checksum is left out of what the reader sees
+    uint64_t checksum = 0;
+    size_t checked = size < sizeof(checksum) ? 0 : size - sizeof(checksum);
+    Reader reader = {data, data + checked, checked > 0};
+    Script *script = NULL;
+
+    if (reader.ok)
+        memcpy(&checksum, data + checked, sizeof(checksum));
+
+    if (read_header(vm, &reader, source) &&
+        hash_bytes(HASH_SEED, data, checked) == checksum) {
+        script = vm_script_new(vm);
+
+        read_code(&reader, &script->chunk);
+        read_constants(vm, &reader, &script->chunk);
+        check_code(&reader, &script->chunk);
+        read_globals(vm, &reader, &script->chunk);
+
+        if (!reader.ok || reader.at != reader.end) {
+            vm_script_free(vm, script);
+            script = NULL;
+        }
+    }
+
+    munmap(data, size);
+    return script;
+}
@@ -1,5 +1,10 @@
+#include <string.h>
+
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+
+#define INDEX_MAX_LOAD 0.5
 
 void chunk_init(Chunk *chunk) {
     chunk->len = 0;
@@ -8,12 +13,18 @@ void chunk_init(Chunk *chunk) {
     chunk->code = NULL;
     chunk->line = NULL;
     value_array_init(&chunk->constants);
+
+    chunk->index_cap = 0;
+    chunk->index = NULL;
+    chunk->deduplicated = 0;
+    chunk->folded = 0;
 }
 
 void chunk_free(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->cap);
     FREE_ARRAY(int, chunk->line, chunk->cap);
     value_array_free(&chunk->constants);
+    FREE_ARRAY(int, chunk->index, chunk->index_cap);
     chunk_init(chunk);
 }
 
@@ -30,9 +41,300 @@ void chunk_push(Chunk *chunk, uint8_t byte, int line) {
     chunk->len++;
 }
 
-uint16_t chunk_push_constant(Chunk *chunk, Value value, int line) {
+// size in bytes of an instruction, including its operands
+int chunk_opcode_size(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+            return 2;
+
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_INCREMENT_LOCAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+            return 3;
+
+        default:
+            return 1;
+    }
+}
+
+// the form of `opcode` from before run() quickened it
+uint8_t chunk_generic_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_ADD_NUM:      return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:   return OP_DIVIDE;
+        case OP_LESS_NUM:     return OP_LESS;
+        case OP_GREATER_NUM:  return OP_GREATER;
+
+        default:
+            return opcode;
+    }
+}
+
+static void add_part(InstructionPart *parts, int *count, uint8_t opcode,
+                     uint16_t operand, int pushed) {
+    InstructionPart *part = &parts[(*count)++];
+    part->opcode = opcode;
+    part->operand = operand;
+    part->pushed = pushed;
+}
+
+int chunk_decode(Chunk *chunk, int offset, InstructionPart *parts) {
+    uint8_t *code = &chunk->code[offset];
+    uint8_t opcode = chunk_generic_opcode(code[0]);
+    int next = offset + chunk_opcode_size(opcode);
+    if (next > chunk->len)
+        return -1;
+
+    uint16_t operand = next - offset > 2 ? code[1] << 8 | code[2] : 0;
+    int count = 0;
+
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+            add_part(parts, &count, opcode, code[1], 0);
+            break;
+        case OP_CONSTANT_LONG:
+            add_part(parts, &count, OP_CONSTANT, operand, 0);
+            break;
+        case OP_GET_GLOBAL_LONG:
+            add_part(parts, &count, OP_GET_GLOBAL, operand, 0);
+            break;
+        case OP_SET_GLOBAL_LONG:
+            add_part(parts, &count, OP_SET_GLOBAL, operand, 0);
+            break;
+        case OP_DEFINE_GLOBAL_LONG:
+            add_part(parts, &count, OP_DEFINE_GLOBAL, operand, 0);
+            break;
+        // no parts, run() doesn't implement these either
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+            break;
+
+        case OP_NOT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_RETURN:
+            add_part(parts, &count, opcode, 0, 0);
+            break;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            add_part(parts, &count, opcode, operand, 0);
+            break;
+
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+            add_part(parts, &count, OP_CONSTANT, code[1], 0);
+            add_part(parts, &count, opcode == OP_ADD_CONSTANT
+                                        ? OP_ADD : OP_SUBTRACT, 0, 1);
+            break;
+        case OP_ADD_LOCALS:
+            add_part(parts, &count, OP_GET_LOCAL, code[1], 0);
+            add_part(parts, &count, OP_GET_LOCAL, code[2], 1);
+            add_part(parts, &count, OP_ADD, 0, 2);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            add_part(parts, &count, OP_GET_LOCAL, code[1], 0);
+            add_part(parts, &count, OP_CONSTANT, code[2], 1);
+            add_part(parts, &count, opcode == OP_ADD_LOCAL_CONSTANT
+                                        ? OP_ADD : OP_SUBTRACT, 0, 2);
+            break;
+        case OP_INCREMENT_LOCAL:
+            add_part(parts, &count, OP_GET_LOCAL, code[1], 0);
+            add_part(parts, &count, OP_CONSTANT, code[2], 1);
+            add_part(parts, &count, OP_ADD, 0, 2);
+            add_part(parts, &count, OP_SET_LOCAL, code[1], 1);
+            add_part(parts, &count, OP_POP, 0, 1);
+            break;
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+            add_part(parts, &count,
+                     opcode == OP_JUMP_IF_NOT_EQUAL ? OP_EQUAL
+                     : opcode == OP_JUMP_IF_NOT_GREATER ? OP_GREATER
+                     : OP_LESS, 0, 0);
+            add_part(parts, &count, OP_POP_JUMP_IF_FALSE, operand, 1);
+            break;
+
+        default:
+            return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        InstructionPart *part = &parts[i];
+        part->next = next;
+        switch (part->opcode) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+                part->target = next + part->operand;
+                break;
+            case OP_LOOP:
+                part->target = next - part->operand;
+                break;
+            default:
+                part->target = next;
+                break;
+        }
+    }
+
+    return count;
+}
+
+// Constants are keyed on their bits rather than on values_equal(): strings
+// are interned so identity is enough for them, and numbers must not be
+// merged when they only compare equal (0 and -0) and must be merged when
+// they don't (NaN).
+static uint64_t constant_bits(Value value) {
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL:   bits = AS_BOOL(value); break;
+        case VAL_NUMBER: memcpy(&bits, &AS_NUMBER(value), sizeof(double)); break;
+        case VAL_INT:    bits = (uint64_t)AS_INT(value); break;
+        case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+        default: break;
+    }
+    return bits ^ ((uint64_t)value.type << 56);
+#endif
+}
+
+static uint32_t constant_hash(Value value) {
+    if (IS_STRING(value))
+        return AS_STRING(value)->hash;
+
+    uint64_t bits = constant_bits(value);
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// integers use all 64 bits, so the type is compared on its own
+static bool same_constant(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return a.type == b.type && constant_bits(a) == constant_bits(b);
+#endif
+}
+
+static int *find_constant(Chunk *chunk, Value value) {
+    uint32_t mask = chunk->index_cap - 1;
+
+    for (uint32_t i = constant_hash(value) & mask;; i = (i + 1) & mask) {
+        int *slot = &chunk->index[i];
+        if (*slot == 0 ||
+            same_constant(chunk->constants.values[*slot - 1], value))
+            return slot;
+    }
+}
+
+static void grow_index(Chunk *chunk) {
+    int old_cap = chunk->index_cap;
+    FREE_ARRAY(int, chunk->index, old_cap);
+
+    chunk->index_cap = GROW_CAPACITY(old_cap);
+    chunk->index = ALLOCATE(int, chunk->index_cap);
+    memset(chunk->index, 0, sizeof(int) * chunk->index_cap);
+
+    for (int i = 0; i < chunk->constants.len; i++)
+        *find_constant(chunk, chunk->constants.values[i]) = i + 1;
+}
+
+int chunk_add_constant(Chunk *chunk, Value value) {
+    if (chunk->constants.len + 1 > chunk->index_cap * INDEX_MAX_LOAD)
+        grow_index(chunk);
+
+    int *slot = find_constant(chunk, value);
+    if (*slot != 0) {
+        chunk->deduplicated++;
+        return *slot - 1;
+    }
+
     value_array_push(&chunk->constants, value);
-    int offset = chunk->constants.len - 1;
+    *slot = chunk->constants.len;
+
+    return chunk->constants.len - 1;
+}
+
+// Remove the entry at `slot` from a linear probing index, moving the entries
+// after it back so that none is left behind an empty slot it was probed past.
+static void remove_index_slot(Chunk *chunk, uint32_t slot) {
+    uint32_t mask = chunk->index_cap - 1;
+
+    for (uint32_t i = (slot + 1) & mask; chunk->index[i] != 0;
+         i = (i + 1) & mask) {
+        Value value = chunk->constants.values[chunk->index[i] - 1];
+        uint32_t home = constant_hash(value) & mask;
+
+        // stays if its home lies cyclically in (slot, i]
+        if (slot < i ? (home > slot && home <= i) : (home > slot || home <= i))
+            continue;
+
+        chunk->index[slot] = chunk->index[i];
+        slot = i;
+    }
+
+    chunk->index[slot] = 0;
+}
+
+void chunk_drop_constants(Chunk *chunk, int len) {
+    while (chunk->constants.len > len) {
+        Value value = chunk->constants.values[chunk->constants.len - 1];
+        remove_index_slot(chunk, (uint32_t)(find_constant(chunk, value) -
+                                            chunk->index));
+        chunk->constants.len--;
+    }
+}
+
+int chunk_push_constant(Chunk *chunk, Value value, int line) {
+    int offset = chunk_add_constant(chunk, value);
+    if (offset > UINT16_MAX)
+        return -1;
 
     if (offset > 0xff) {
         chunk_push(chunk, OP_CONSTANT_LONG, line);
@@ -44,5 +346,5 @@ uint16_t chunk_push_constant(Chunk *chunk, Value value, int line) {
         chunk_push(chunk, offset, line);
     }
 
-    return (uint16_t)offset;
+    return offset;
 }
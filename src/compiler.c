@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include "chunk.h"
 #include "debug.h"
 #include "object.h"
+#include "optimizer.h"
 #include "value.h"
 #include "scanner.h"
 
@@ -13,76 +15,41 @@ static void compiler_init(Compiler *compiler, Chunk *chunk) {
     compiler->local_count = 0;
     compiler->scope_depth = 0;
     compiler->compiling_chunk = chunk;
+    compiler->jump_target = 0;
+    compiler->operand_start = 0;
+    compiler->operand_constants = 0;
+    compiler->number_end = -1;
 }
 
-static void parser_init(Parser *parser) {
-    parser->had_error = false;
-    parser->panic_mode = false;
-}
-
-static void state_init(State *state, const char *source, VM *vm, Chunk *chunk) {
+static void state_init(State *state, const char *source, VM *vm, Chunk *chunk,
+                       TokenStream *tokens) {
     state->vm = vm;
-    parser_init(&state->parser);
-    scanner_init(&state->scanner, source);
+    parser_init(&state->parser, source, tokens);
     compiler_init(&state->compiler, chunk);
 }
 
 static void error_at(State *state, Token *token, const char *message) {
-    if (state->parser.panic_mode)
-        return;
-
-    state->parser.had_error = true;
-    state->parser.panic_mode = true;
-
-    fprintf(stderr, "[line %d] Error", token->line);
-
-    switch (token->type) {
-        case TOKEN_EOF:
-            fprintf(stderr, " at end"); break;
-        case TOKEN_ERROR:
-            break;
-        default:
-            fprintf(stderr, " at '%.*s'", token->length, token->start);
-    }
-
-    fprintf(stderr, ": %s\n", message);
+    parser_error_at(&state->parser, token, message);
 }
 
 static void error_at_current(State *state, const char *message) {
-    error_at(state, &state->parser.curr, message);
+    parser_error_at_current(&state->parser, message);
 }
 
 static void advance(State *state) {
-    state->parser.prev = state->parser.curr;
-
-    for (;;) {
-        state->parser.curr = scanner_scan_token(&state->scanner);
-        if (state->parser.curr.type != TOKEN_ERROR) break;
-
-        error_at_current(state, state->parser.curr.start);
-    }
+    parser_advance(&state->parser);
 }
 
 static void consume(State *state, TokenType type, const char *message) {
-    if (state->parser.curr.type == type) {
-        advance(state);
-        return;
-    }
-
-    error_at_current(state, message);
+    parser_consume(&state->parser, type, message);
 }
 
 static bool check(State *state, TokenType type) {
-    return state->parser.curr.type == type;
+    return parser_check(&state->parser, type);
 }
 
 static bool match(State *state, TokenType type) {
-    if (check(state, type)) {
-        advance(state);
-        return true;
-    }
-
-    return false;
+    return parser_match(&state->parser, type);
 }
 
 static void emit_byte(State *state, uint8_t byte) {
@@ -115,6 +82,7 @@ static void patch_jump(State *state, int offset) {
 
     state->compiler.compiling_chunk->code[offset + 0] = (jump >> 8) & 0xff;
     state->compiler.compiling_chunk->code[offset + 1] = (jump >> 0) & 0xff;
+    state->compiler.jump_target = state->compiler.compiling_chunk->len;
 }
 
 static void emit_return(State *state) {
@@ -142,12 +110,16 @@ static void declaration(State *state);
 static ParseRule *get_rule(TokenType type);
 static void parse_precedence(State *state, Precedence precedence);
 
-static uint16_t identifier_constant(State *state, Token *name) {
-    value_array_push(
-        &state->compiler.compiling_chunk->constants,
-        OBJ_VAL(copy_string(state->vm, name->start, name->length)));
+static uint16_t global_slot(State *state, Token *name) {
+    int slot = vm_global_slot(
+        state->vm, copy_string(state->vm, name->start, name->length));
+
+    if (slot > UINT16_MAX) {
+        error_at(state, name, "Too many global variables.");
+        return 0;
+    }
 
-    return (uint16_t)(state->compiler.compiling_chunk->constants.len - 1);
+    return (uint16_t)slot;
 }
 
 static bool identifiers_equal(Token *a, Token *b) {
@@ -226,13 +198,209 @@ static void or_(State *state, bool can_assign) {
     patch_jump(state, end_jump);
 }
 
+// Decode the code between `start` and `end` if it is a single instruction
+// pushing a constant. Nothing may jump into it, it gets rewritten.
+static bool constant_operand(State *state, int start, int end, Value *value) {
+    Chunk *chunk = state->compiler.compiling_chunk;
+    if (start < state->compiler.jump_target || start >= end)
+        return false;
+
+    uint8_t *code = &chunk->code[start];
+    if (start + chunk_opcode_size(code[0]) != end)
+        return false;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            *value = chunk->constants.values[code[1]];
+            return true;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants.values[code[1] << 8 | code[2]];
+            return true;
+        case OP_NIL:   *value = NIL_VAL; return true;
+        case OP_TRUE:  *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+
+        default:
+            return false;
+    }
+}
+
+// whether the code from `start` to the end of the chunk always leaves a number
+static bool number_operand(State *state, int start) {
+    return state->compiler.number_end == state->compiler.compiling_chunk->len &&
+           start >= state->compiler.jump_target;
+}
+
+static void emit_constant(State *state, Value value, int line) {
+    if (chunk_push_constant(state->compiler.compiling_chunk, value, line) < 0)
+        error_at_current(state, "Too many constants in one chunk.");
+}
+
+// Replace the code from `start` on with a single instruction pushing `value`.
+// The chunk had `constants` constants when it was `start` long, the ones
+// added since only the replaced code used.
+static void emit_folded(State *state, int start, int constants, Value value) {
+    Chunk *chunk = state->compiler.compiling_chunk;
+    int line = chunk->line[start];
+
+    chunk->len = start;
+    chunk_drop_constants(chunk, constants);
+    chunk->folded++;
+    state->compiler.number_end = -1;
+
+    if (IS_NIL(value)) {
+        chunk_push(chunk, OP_NIL, line);
+    }
+    else if (IS_BOOL(value)) {
+        chunk_push(chunk, AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+    }
+    else {
+        // adding the constant may grow the pool and run the collector
+        vm_stack_push(state->vm, value);
+        emit_constant(state, value, line);
+        vm_stack_pop(state->vm);
+
+        if (IS_NUMERIC(value))
+            state->compiler.number_end = chunk->len;
+    }
+}
+
+static bool fold_numbers(TokenType operator, Value a, Value b, Value *result) {
+    switch (operator) {
+        case TOKEN_PLUS:  *result = number_add(a, b); return true;
+        case TOKEN_MINUS: *result = number_subtract(a, b); return true;
+        case TOKEN_STAR:  *result = number_multiply(a, b); return true;
+        case TOKEN_SLASH: *result = number_divide(a, b); return true;
+
+        // spelled the way the VM evaluates them so that NaN behaves the same
+        case TOKEN_GREATER:
+            *result = BOOL_VAL(number_greater(a, b));
+            return true;
+        case TOKEN_LESS:
+            *result = BOOL_VAL(number_less(a, b));
+            return true;
+        case TOKEN_GREATER_EQUAL:
+            *result = BOOL_VAL(!number_less(a, b));
+            return true;
+        case TOKEN_LESS_EQUAL:
+            *result = BOOL_VAL(!number_greater(a, b));
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static Value fold_strings(State *state, ObjString *a, ObjString *b) {
+    // both operands are constants of the chunk and survive a collection
+    ObjString *result = reserve_string(state->vm, a->len + b->len);
+    memcpy(result->data, a->data, a->len);
+    memcpy(result->data + a->len, b->data, b->len);
+
+    return OBJ_VAL(take_string(state->vm, result));
+}
+
+static bool fold_binary(State *state, TokenType operator,
+                        int left_start, int left_constants, int right_start) {
+    Chunk *chunk = state->compiler.compiling_chunk;
+    Value a, b, result;
+
+    if (!constant_operand(state, left_start, right_start, &a) ||
+        !constant_operand(state, right_start, chunk->len, &b))
+        return false;
+
+    if (operator == TOKEN_EQUAL_EQUAL) {
+        result = BOOL_VAL(values_equal(a, b));
+    }
+    else if (operator == TOKEN_BANG_EQUAL) {
+        result = BOOL_VAL(!values_equal(a, b));
+    }
+    else if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+        if (!fold_numbers(operator, a, b, &result))
+            return false;
+    }
+    else if (operator == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        result = fold_strings(state, AS_STRING(a), AS_STRING(b));
+    }
+    else {
+        return false;
+    }
+
+    emit_folded(state, left_start, left_constants, result);
+    return true;
+}
+
+// Whether `value` is `number` of the kind that leaves the other operand as it
+// is, with integers that is only an integer: `i * 1.0` is a double.
+static bool is_exactly(Value value, int64_t number) {
+#ifdef NAN_BOXING
+    return IS_NUMBER(value) && AS_NUMBER(value) == number &&
+           !signbit(AS_NUMBER(value));
+#else
+    return IS_INT(value) && AS_INT(value) == number;
+#endif
+}
+
+// Drop `x * 1`, `1 * x` and `x - 0` when `x` is known to be a number, for
+// anything else the operator still has to raise its error. `x + 0` stays, it
+// turns -0 into 0, and so does `x / 1`, which turns integers into doubles.
+static bool fold_identity(State *state, TokenType operator,
+                          int left_start, int left_constants,
+                          int right_start, int right_constants,
+                          bool left_number) {
+    Chunk *chunk = state->compiler.compiling_chunk;
+    Value constant;
+
+    if (left_number &&
+        constant_operand(state, right_start, chunk->len, &constant) &&
+        ((operator == TOKEN_STAR  && is_exactly(constant, 1)) ||
+         (operator == TOKEN_MINUS && is_exactly(constant, 0)))) {
+        chunk->len = right_start;
+        chunk_drop_constants(chunk, right_constants);
+    }
+    else if (operator == TOKEN_STAR && number_operand(state, right_start) &&
+             constant_operand(state, left_start, right_start, &constant) &&
+             is_exactly(constant, 1)) {
+        int removed = right_start - left_start;
+        int moved = chunk->len - right_start;
+
+        memmove(&chunk->code[left_start], &chunk->code[right_start], moved);
+        memmove(&chunk->line[left_start], &chunk->line[right_start],
+                moved * sizeof(int));
+        chunk->len -= removed;
+        // the constants `x` added would have to be renumbered
+        if (chunk->constants.len == right_constants)
+            chunk_drop_constants(chunk, left_constants);
+    }
+    else {
+        return false;
+    }
+
+    chunk->folded++;
+    state->compiler.number_end = chunk->len;
+    return true;
+}
+
 static void binary(State *state, bool can_assign) {
     (void)can_assign;
 
+    Chunk *chunk = state->compiler.compiling_chunk;
+    int left_start = state->compiler.operand_start;
+    int left_constants = state->compiler.operand_constants;
+    bool left_number = number_operand(state, left_start);
+    int right_start = chunk->len;
+    int right_constants = chunk->constants.len;
+
     TokenType operator_type = state->parser.prev.type;
     ParseRule *rule = get_rule(operator_type);
     parse_precedence(state, (Precedence)(rule->precedence + 1));
 
+    if (fold_binary(state, operator_type,
+                    left_start, left_constants, right_start) ||
+        fold_identity(state, operator_type, left_start, left_constants,
+                      right_start, right_constants, left_number))
+        return;
+
     switch(operator_type) {
         case TOKEN_EQUAL_EQUAL: emit_byte(state, OP_EQUAL); break;
         case TOKEN_GREATER:     emit_byte(state, OP_GREATER); break;
@@ -258,6 +426,11 @@ static void binary(State *state, bool can_assign) {
         default: // unreachable
             return;
     }
+
+    // everything but `+` either leaves a number or raises an error
+    if (operator_type == TOKEN_MINUS || operator_type == TOKEN_STAR ||
+        operator_type == TOKEN_SLASH)
+        state->compiler.number_end = chunk->len;
 }
 
 static void literal(State *state, bool can_assign) {
@@ -283,21 +456,22 @@ static void grouping(State *state, bool can_assign) {
 static void number(State *state, bool can_assign) {
     (void)can_assign;
 
-    chunk_push_constant(
-        state->compiler.compiling_chunk,
-        NUMBER_VAL(strtod(state->parser.prev.start, NULL)), state->parser.prev.line);
+    Token *token = &state->parser.prev;
+    emit_constant(state, value_parse_number(token->start, token->length),
+                  token->line);
+    state->compiler.number_end = state->compiler.compiling_chunk->len;
 }
 
 static void string(State *state, bool can_assign) {
     (void)can_assign;
 
-    chunk_push_constant(
-        state->compiler.compiling_chunk,
-        OBJ_VAL(copy_string(
-                state->vm,
-                state->parser.prev.start + 1,
-                state->parser.prev.length - 2)),
-        state->parser.prev.line);
+    Value value = OBJ_VAL(copy_string(
+        state->vm, state->parser.prev.start + 1, state->parser.prev.length - 2));
+
+    // adding the constant may grow the pool and run the collector
+    vm_stack_push(state->vm, value);
+    emit_constant(state, value, state->parser.prev.line);
+    vm_stack_pop(state->vm);
 }
 
 static void named_variable(State *state, bool can_assign) {
@@ -314,7 +488,7 @@ static void named_variable(State *state, bool can_assign) {
         get_instruction = is_long ? OP_GET_LOCAL_LONG : OP_GET_LOCAL;
     }
     else {
-        offset = identifier_constant(state, name);
+        offset = global_slot(state, name);
         is_long = offset > 0xff;
         set_instruction = is_long ? OP_SET_GLOBAL_LONG : OP_SET_GLOBAL;
         get_instruction = is_long ? OP_GET_GLOBAL_LONG : OP_GET_GLOBAL;
@@ -340,9 +514,25 @@ static void variable(State *state, bool can_assign) {
 static void unary(State *state, bool can_assign) {
     (void)can_assign;
 
+    Chunk *chunk = state->compiler.compiling_chunk;
     TokenType operator = state->parser.prev.type;
+    int start = chunk->len;
+    int constants = chunk->constants.len;
     parse_precedence(state, PREC_UNARY);
 
+    Value value;
+    if (constant_operand(state, start, chunk->len, &value)) {
+        if (operator == TOKEN_BANG) {
+            emit_folded(state, start, constants,
+                        BOOL_VAL(value_is_falsy(value)));
+            return;
+        }
+        if (operator == TOKEN_MINUS && IS_NUMERIC(value)) {
+            emit_folded(state, start, constants, number_negate(value));
+            return;
+        }
+    }
+
     switch (operator) {
         case  TOKEN_BANG: emit_byte(state, OP_NOT); break;
         case TOKEN_MINUS: emit_byte(state, OP_NEGATE); break;
@@ -350,6 +540,9 @@ static void unary(State *state, bool can_assign) {
         default: // unreachable
             return;
     }
+
+    if (operator == TOKEN_MINUS)
+        state->compiler.number_end = chunk->len;
 }
 
 ParseRule RULES[] = {
@@ -365,7 +558,7 @@ ParseRule RULES[] = {
     [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
     [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
-    [TOKEN_BANG_EQUAL]    = {binary,   NULL,   PREC_EQUALITY},
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
     [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
@@ -408,11 +601,15 @@ static void parse_precedence(State *state, Precedence precedence) {
         return;
     }
 
+    int start = state->compiler.compiling_chunk->len;
+    int constants = state->compiler.compiling_chunk->constants.len;
     bool can_assign = precedence <= PREC_ASSIGNMENT;
     prefix_rule(state, can_assign);
 
     while (precedence <= get_rule(state->parser.curr.type)->precedence) {
         advance(state);
+        state->compiler.operand_start = start;
+        state->compiler.operand_constants = constants;
         get_rule(state->parser.prev.type)->infix(state, can_assign);
     }
 
@@ -430,7 +627,7 @@ static uint16_t parse_variable(State *state, const char *message) {
     declare_variable(state);
     if (state->compiler.scope_depth > 0) return 0;
 
-    return identifier_constant(state, &state->parser.prev);
+    return global_slot(state, &state->parser.prev);
 }
 
 static void mark_initialized(State *state) {
@@ -570,32 +767,6 @@ static void block(State *state) {
     consume(state, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void synchronize(State *state) {
-    state->parser.panic_mode = false;
-
-    while (state->parser.curr.type != TOKEN_EOF) {
-        if (state->parser.prev.type == TOKEN_SEMICOLON)
-            return;
-
-        switch (state->parser.prev.type) {
-            case TOKEN_CLASS:
-            case TOKEN_FN:
-            case TOKEN_LET:
-            case TOKEN_FOR:
-            case TOKEN_IF:
-            case TOKEN_WHILE:
-            case TOKEN_PRINT:
-            case TOKEN_RETURN:
-                return;
-
-            default:
-                ;
-        }
-
-        advance(state);
-    }
-}
-
 static void declaration(State *state) {
     if (match(state, TOKEN_LET)) {
         var_declaration(state);
@@ -605,7 +776,7 @@ static void declaration(State *state) {
     }
 
     if (state->parser.panic_mode)
-        synchronize(state);
+        parser_synchronize(&state->parser);
 }
 
 static void statement(State *state) {
@@ -632,8 +803,13 @@ static void statement(State *state) {
 }
 
 bool compile(const char *source, VM *vm, Chunk *chunk) {
+    TokenStream tokens;
+    if (vm->lex_threads > 0)
+        token_stream_lex(&tokens, source, vm->lex_threads);
+
     State state;
-    state_init(&state, source, vm, chunk);
+    state_init(&state, source, vm, chunk,
+               vm->lex_threads > 0 ? &tokens : NULL);
 
     advance(&state);
     while (!match(&state, TOKEN_EOF)) {
@@ -642,10 +818,21 @@ bool compile(const char *source, VM *vm, Chunk *chunk) {
 
     emit_return(&state);
 
+    if (vm->optimize && !state.parser.had_error)
+        optimize_chunk(state.compiler.compiling_chunk);
+
 #ifdef DEBUG
-    disassemble_chunk(state.compiler.compiling_chunk, "chunk");
-    printf("\n");
+    if (vm->print_code) {
+        disassemble_chunk(state.compiler.compiling_chunk, "chunk");
+        printf("%d constants, %d deduplicated, %d folded\n\n",
+               state.compiler.compiling_chunk->constants.len,
+               state.compiler.compiling_chunk->deduplicated,
+               state.compiler.compiling_chunk->folded);
+    }
 #endif
 
+    if (vm->lex_threads > 0)
+        token_stream_free(&tokens);
+
     return !state.parser.had_error;
 }
@@ -1,8 +1,64 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "value.h"
 
+static const char *OPCODE_NAMES[] = {
+    [OP_CONSTANT]                = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]           = "OP_CONSTANT_LONG",
+    [OP_NOT]                     = "OP_NOT",
+    [OP_NIL]                     = "OP_NIL",
+    [OP_TRUE]                    = "OP_TRUE",
+    [OP_FALSE]                   = "OP_FALSE",
+    [OP_POP]                     = "OP_POP",
+    [OP_GET_LOCAL]               = "OP_GET_LOCAL",
+    [OP_GET_LOCAL_LONG]          = "OP_GET_LOCAL_LONG",
+    [OP_GET_GLOBAL]              = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG]         = "OP_GET_GLOBAL_LONG",
+    [OP_EQUAL]                   = "OP_EQUAL",
+    [OP_DEFINE_GLOBAL]           = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG]      = "OP_DEFINE_GLOBAL_LONG",
+    [OP_LESS]                    = "OP_LESS",
+    [OP_GREATER]                 = "OP_GREATER",
+    [OP_ADD]                     = "OP_ADD",
+    [OP_SET_LOCAL]               = "OP_SET_LOCAL",
+    [OP_SET_LOCAL_LONG]          = "OP_SET_LOCAL_LONG",
+    [OP_SET_GLOBAL]              = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG]         = "OP_SET_GLOBAL_LONG",
+    [OP_SUBTRACT]                = "OP_SUBTRACT",
+    [OP_MULTIPLY]                = "OP_MULTIPLY",
+    [OP_DIVIDE]                  = "OP_DIVIDE",
+    [OP_NEGATE]                  = "OP_NEGATE",
+    [OP_PRINT]                   = "OP_PRINT",
+    [OP_JUMP]                    = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]           = "OP_JUMP_IF_FALSE",
+    [OP_POP_JUMP_IF_FALSE]       = "OP_POP_JUMP_IF_FALSE",
+    [OP_LOOP]                    = "OP_LOOP",
+    [OP_RETURN]                  = "OP_RETURN",
+    [OP_ADD_CONSTANT]            = "OP_ADD_CONSTANT",
+    [OP_SUBTRACT_CONSTANT]       = "OP_SUBTRACT_CONSTANT",
+    [OP_ADD_LOCALS]              = "OP_ADD_LOCALS",
+    [OP_ADD_LOCAL_CONSTANT]      = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_INCREMENT_LOCAL]         = "OP_INCREMENT_LOCAL",
+    [OP_JUMP_IF_NOT_EQUAL]       = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER]     = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_LESS]        = "OP_JUMP_IF_NOT_LESS",
+    [OP_ADD_NUM]                 = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM]            = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM]            = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM]              = "OP_DIVIDE_NUM",
+    [OP_LESS_NUM]                = "OP_LESS_NUM",
+    [OP_GREATER_NUM]             = "OP_GREATER_NUM",
+};
+
+const char *opcode_name(uint8_t opcode) {
+    if (opcode >= sizeof(OPCODE_NAMES) / sizeof(OPCODE_NAMES[0]))
+        return NULL;
+    return OPCODE_NAMES[opcode];
+}
+
 static int simple_opcode(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -24,6 +80,13 @@ static int byte_opcode(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int short_opcode(const char *name, Chunk *chunk, int offset) {
+    uint16_t slot = (chunk->code[offset + 1] << 8) | \
+                    (chunk->code[offset + 2] << 0);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jump_opcode(const char *name, int sign, Chunk *chunk, int offset) {
     uint16_t jump = (chunk->code[offset + 1] << 8) | \
                     (chunk->code[offset + 2] << 0);
@@ -32,6 +95,24 @@ static int jump_opcode(const char *name, int sign, Chunk *chunk, int offset) {
     return offset + 3;
 }
 
+static int locals_opcode(const char *name, Chunk *chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int local_constant_opcode(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+
+    printf("%-16s %4d %4" PRIu8 " '", name, slot, constant);
+    value_print(chunk->constants.values[constant]);
+    printf("'\n");
+
+    return offset + 3;
+}
+
 static int constant_long_opcode(const char *name, Chunk *chunk, int offset) {
     uint16_t constant = (chunk->code[offset + 1] << 8) | \
                         (chunk->code[offset + 2]);
@@ -60,65 +141,264 @@ int disassemble_opcode(Chunk *chunk, int offset) {
         printf("%4d ", chunk->line[offset]);
 
     uint8_t opcode = chunk->code[offset];
+    const char *name = opcode_name(opcode);
+
     switch (opcode) {
         case OP_CONSTANT:
-            return constant_opcode("OP_CONSTANT", chunk, offset);
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+            return constant_opcode(name, chunk, offset);
         case OP_CONSTANT_LONG:
-            return constant_long_opcode("OP_CONSTANT_LONG", chunk, offset);
-        case OP_NOT:
-            return simple_opcode("OP_NOT", offset);
-        case OP_NIL:
-            return simple_opcode("OP_NIL", offset);
-        case OP_TRUE:
-            return simple_opcode("OP_TRUE", offset);
-        case OP_FALSE:
-            return simple_opcode("OP_FALSE", offset);
-        case OP_POP:
-            return simple_opcode("OP_POP", offset);
-        case OP_EQUAL:
-            return simple_opcode("OP_EQUAL", offset);
+            return constant_long_opcode(name, chunk, offset);
+
         case OP_SET_LOCAL:
-            return byte_opcode("OP_SET_LOCAL", chunk, offset);
         case OP_GET_LOCAL:
-            return byte_opcode("OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_opcode("OP_GET_GLOBAL", chunk, offset);
-        case OP_GET_GLOBAL_LONG:
-            return constant_long_opcode("OP_GET_GLOBAL_LONG", chunk, offset);
-        case OP_DEFINE_GLOBAL:
-            return constant_opcode("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL_LONG:
-            return constant_long_opcode("OP_DEFINE_GLOBAL_LONG", chunk, offset);
-        case OP_GREATER:
-            return simple_opcode("OP_GREATER", offset);
-        case OP_LESS:
-            return simple_opcode("OP_LESS", offset);
-        case OP_ADD:
-            return simple_opcode("OP_ADD", offset);
         case OP_SET_GLOBAL:
-            return constant_opcode("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL:
+            return byte_opcode(name, chunk, offset);
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
         case OP_SET_GLOBAL_LONG:
-            return constant_long_opcode("OP_SET_GLOBAL_LONG", chunk, offset);
-        case OP_SUBTRACT:
-            return simple_opcode("OP_SUBTRACT", offset);
-        case OP_MULTIPLY:
-            return simple_opcode("OP_MULTIPLY", offset);
-        case OP_DIVIDE:
-            return simple_opcode("OP_DIVIDE", offset);
-        case OP_NEGATE:
-            return simple_opcode("OP_NEGATE", offset);
-        case OP_PRINT:
-            return simple_opcode("OP_PRINT", offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return short_opcode(name, chunk, offset);
+
         case OP_JUMP:
-            return jump_opcode("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jump_opcode("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+            return jump_opcode(name, 1, chunk, offset);
         case OP_LOOP:
-            return jump_opcode("OP_LOOP", -1, chunk, offset);
-        case OP_RETURN:
-            return simple_opcode("OP_RETURN", offset);
+            return jump_opcode(name, -1, chunk, offset);
+
+        case OP_ADD_LOCALS:
+            return locals_opcode(name, chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_INCREMENT_LOCAL:
+            return local_constant_opcode(name, chunk, offset);
+
         default:
+            if (name != NULL)
+                return simple_opcode(name, offset);
+
             printf("unknown opcode: %" PRIu8 "\n", opcode);
             return offset + 1;
     }
 }
+
+typedef struct {
+    uint32_t key;
+    int count;
+} Ngram;
+
+static int compare_keys(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_counts(const void *a, const void *b) {
+    const Ngram *x = a, *y = b;
+    if (x->count != y->count)
+        return y->count - x->count;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static bool ends_sequence(uint8_t opcode) {
+    switch (opcode) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_LOOP:
+        case OP_RETURN:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Windows of `n` instructions are packed into one key, a byte per opcode.
+// A window may end with a jump but never continues past one.
+void print_ngrams(Chunk *chunk, int n, int limit) {
+    if (n < 1 || n > NGRAM_MAX)
+        return;
+
+    uint32_t *keys = malloc(sizeof(uint32_t) * (chunk->len + 1));
+    Ngram *ngrams = malloc(sizeof(Ngram) * (chunk->len + 1));
+    if (keys == NULL || ngrams == NULL)
+        exit(1);
+
+    int key_count = 0;
+    uint32_t window = 0;
+    int filled = 0;
+    uint32_t mask = n == 4 ? UINT32_MAX : (1u << (8 * n)) - 1;
+
+    for (int offset = 0; offset < chunk->len;) {
+        uint8_t opcode = chunk->code[offset];
+        window = (window << 8 | opcode) & mask;
+        if (++filled >= n)
+            keys[key_count++] = window;
+        if (ends_sequence(opcode))
+            filled = 0;
+
+        offset += chunk_opcode_size(opcode);
+    }
+
+    qsort(keys, key_count, sizeof(uint32_t), compare_keys);
+
+    int ngram_count = 0;
+    for (int i = 0; i < key_count; i++) {
+        if (ngram_count > 0 && ngrams[ngram_count - 1].key == keys[i])
+            ngrams[ngram_count - 1].count++;
+        else
+            ngrams[ngram_count++] = (Ngram){keys[i], 1};
+    }
+
+    qsort(ngrams, ngram_count, sizeof(Ngram), compare_counts);
+
+    fprintf(stderr, "%d-grams: %d windows, %d distinct\n",
+            n, key_count, ngram_count);
+    for (int i = 0; i < ngram_count && i < limit; i++) {
+        fprintf(stderr, "%8d ", ngrams[i].count);
+        for (int j = n - 1; j >= 0; j--) {
+            uint8_t opcode = (ngrams[i].key >> (8 * j)) & 0xff;
+            const char *name = opcode_name(opcode);
+            fprintf(stderr, " %s", name != NULL ? name : "?");
+        }
+        fprintf(stderr, "\n");
+    }
+
+    free(ngrams);
+    free(keys);
+}
+
+static const char *REG_OPCODE_NAMES[] = {
+    [ROP_MOVE]          = "ROP_MOVE",
+    [ROP_LOADK]         = "ROP_LOADK",
+    [ROP_LOADNIL]       = "ROP_LOADNIL",
+    [ROP_LOADTRUE]      = "ROP_LOADTRUE",
+    [ROP_LOADFALSE]     = "ROP_LOADFALSE",
+    [ROP_GET_GLOBAL]    = "ROP_GET_GLOBAL",
+    [ROP_SET_GLOBAL]    = "ROP_SET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+    [ROP_ADD]           = "ROP_ADD",
+    [ROP_SUBTRACT]      = "ROP_SUBTRACT",
+    [ROP_MULTIPLY]      = "ROP_MULTIPLY",
+    [ROP_DIVIDE]        = "ROP_DIVIDE",
+    [ROP_ADDK]          = "ROP_ADDK",
+    [ROP_SUBTRACTK]     = "ROP_SUBTRACTK",
+    [ROP_MULTIPLYK]     = "ROP_MULTIPLYK",
+    [ROP_DIVIDEK]       = "ROP_DIVIDEK",
+    [ROP_EQUAL]         = "ROP_EQUAL",
+    [ROP_NOT_EQUAL]     = "ROP_NOT_EQUAL",
+    [ROP_LESS]          = "ROP_LESS",
+    [ROP_GREATER]       = "ROP_GREATER",
+    [ROP_NOT_LESS]      = "ROP_NOT_LESS",
+    [ROP_NOT_GREATER]   = "ROP_NOT_GREATER",
+    [ROP_LESSK]         = "ROP_LESSK",
+    [ROP_GREATERK]      = "ROP_GREATERK",
+    [ROP_NOT]           = "ROP_NOT",
+    [ROP_NEGATE]        = "ROP_NEGATE",
+    [ROP_PRINT]         = "ROP_PRINT",
+    [ROP_JUMP]          = "ROP_JUMP",
+    [ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+    [ROP_JUMP_IF_TRUE]  = "ROP_JUMP_IF_TRUE",
+    [ROP_LOOP]          = "ROP_LOOP",
+    [ROP_RETURN]        = "ROP_RETURN",
+};
+
+void disassemble_reg_chunk(RegChunk *chunk, ValueArray *constants,
+                           const char *name) {
+    printf("== %s (%d registers) ==\n", name, chunk->registers);
+
+    for (int offset = 0; offset < chunk->len; offset++)
+        disassemble_reg_instruction(chunk, constants, offset);
+}
+
+void disassemble_reg_instruction(RegChunk *chunk, ValueArray *constants,
+                                 int offset) {
+    printf("%04d ", offset);
+
+    if (offset > 0 && chunk->line[offset] == chunk->line[offset - 1])
+        printf("   | ");
+    else
+        printf("%4d ", chunk->line[offset]);
+
+    uint32_t instruction = chunk->code[offset];
+    uint8_t opcode = REG_OP(instruction);
+    const char *name = NULL;
+    if (opcode < sizeof(REG_OPCODE_NAMES) / sizeof(REG_OPCODE_NAMES[0]))
+        name = REG_OPCODE_NAMES[opcode];
+
+    if (name == NULL) {
+        printf("unknown opcode: %" PRIu8 "\n", opcode);
+        return;
+    }
+
+    printf("%-18s", name);
+
+    switch (opcode) {
+        case ROP_MOVE:
+        case ROP_NOT:
+        case ROP_NEGATE:
+            printf(" r%d r%d\n", REG_A(instruction), REG_B(instruction));
+            break;
+
+        case ROP_LOADK:
+            printf(" r%d '", REG_A(instruction));
+            value_print(constants->values[REG_BX(instruction)]);
+            printf("'\n");
+            break;
+
+        case ROP_LOADNIL:
+        case ROP_LOADTRUE:
+        case ROP_LOADFALSE:
+        case ROP_PRINT:
+            printf(" r%d\n", REG_A(instruction));
+            break;
+
+        case ROP_GET_GLOBAL:
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+            printf(" r%d g%d\n", REG_A(instruction), REG_BX(instruction));
+            break;
+
+        case ROP_ADDK:
+        case ROP_SUBTRACTK:
+        case ROP_MULTIPLYK:
+        case ROP_DIVIDEK:
+        case ROP_LESSK:
+        case ROP_GREATERK:
+            printf(" r%d r%d '", REG_A(instruction), REG_B(instruction));
+            value_print(constants->values[REG_C(instruction)]);
+            printf("'\n");
+            break;
+
+        case ROP_JUMP:
+            printf(" -> %d\n", offset + 1 + (int)REG_BX(instruction));
+            break;
+        case ROP_JUMP_IF_FALSE:
+        case ROP_JUMP_IF_TRUE:
+            printf(" r%d -> %d\n", REG_A(instruction),
+                   offset + 1 + (int)REG_BX(instruction));
+            break;
+        case ROP_LOOP:
+            printf(" -> %d\n", offset + 1 - (int)REG_BX(instruction));
+            break;
+
+        case ROP_RETURN:
+            printf("\n");
+            break;
+
+        default:
+            printf(" r%d r%d r%d\n", REG_A(instruction), REG_B(instruction),
+                   REG_C(instruction));
+    }
+}
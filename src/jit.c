@@ -0,0 +1,1239 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+// A template JIT. Every instruction becomes a stub of native code: pushes,
+// locals, globals, arithmetic and comparisons on numbers of one kind and
+// branches are done inline, everything else and every other operand calls
+// one of the helpers below. The generated code keeps the VM in rbx and the
+// top of its stack in r12, vm->sp is only brought up to date around helper
+// calls. The stack holds the same values as under run().
+//
+// A helper that returns false would have to raise a runtime error. It leaves
+// the stack alone, and the stub stores the address of its instruction in
+// vm->ip and returns JIT_EXITED so that run() executes the instruction again
+// and reports the error with its line.
+
+typedef JitResult (*JitFunction)(VM *vm);
+
+struct JitCode {
+    uint8_t *memory;
+    size_t size;
+};
+
+// a rel32 to patch once every stub has its place
+typedef struct {
+    int at;
+    // bytecode offset of the stub jumped to
+    int target;
+} Jump;
+
+typedef struct {
+    int at;
+    // bytecode offset of the instruction run() executes again
+    int offset;
+    // values the stub pushed before it gave up, superinstructions are
+    // translated to the sequence they were fused from
+    int pushed;
+} Exit;
+
+// the out of line path of an inline operation whose guards failed, it calls
+// `helper` and goes back to `resume`, or to `target` if that is set and the
+// helper left a falsy value
+typedef struct {
+    // the rel32s of the jumps to it, -1 if unused
+    int at[4];
+    uintptr_t helper;
+    int offset;
+    int pushed;
+    int resume;
+    int target;
+} Slow;
+
+typedef struct {
+    int len;
+    int cap;
+    uint8_t *code;
+
+    int jump_len;
+    int jump_cap;
+    Jump *jumps;
+
+    int exit_len;
+    int exit_cap;
+    Exit *exits;
+
+    int slow_len;
+    int slow_cap;
+    Slow *slows;
+} Assembler;
+
+static void flatten_operand(VM *vm, Value *slot) {
+    if (IS_ROPE(*slot))
+        *slot = OBJ_VAL(flatten_rope(vm, AS_ROPE(*slot)));
+}
+
+static void op_not(VM *vm) {
+    vm->sp[-1] = BOOL_VAL(value_is_falsy(vm->sp[-1]));
+}
+
+static void op_define_global(VM *vm, int slot) {
+    vm->global_values.values[slot] = vm_stack_pop(vm);
+}
+
+static void op_equal(VM *vm) {
+    flatten_operand(vm, &vm->sp[-1]);
+    flatten_operand(vm, &vm->sp[-2]);
+    Value b = vm_stack_pop(vm);
+    Value a = vm_stack_pop(vm);
+    vm_stack_push(vm, BOOL_VAL(values_equal(a, b)));
+}
+
+static bool op_add(VM *vm) {
+    Value b = vm_stack_peek(vm, 0);
+    Value a = vm_stack_peek(vm, 1);
+
+    if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+        vm->sp[-2] = number_add(a, b);
+        vm->sp--;
+    }
+    else if (IS_TEXT(a) && IS_TEXT(b)) {
+        vm_concatenate(vm);
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+// only reached for mixed kinds, overflows and operands that aren't numbers,
+// the rest is done inline
+#define NUMBER_HELPER(name, result)                                            \
+    static bool name(VM *vm) {                                                 \
+        Value b = vm_stack_peek(vm, 0);                                        \
+        Value a = vm_stack_peek(vm, 1);                                        \
+        if (!IS_NUMERIC(a) || !IS_NUMERIC(b))                                  \
+            return false;                                                      \
+        vm->sp[-2] = (result);                                                 \
+        vm->sp--;                                                              \
+        return true;                                                           \
+    }
+
+NUMBER_HELPER(op_subtract, number_subtract(a, b))
+NUMBER_HELPER(op_multiply, number_multiply(a, b))
+NUMBER_HELPER(op_divide, number_divide(a, b))
+NUMBER_HELPER(op_less, BOOL_VAL(number_less(a, b)))
+NUMBER_HELPER(op_greater, BOOL_VAL(number_greater(a, b)))
+
+#undef NUMBER_HELPER
+
+static bool op_negate(VM *vm) {
+    if (!IS_NUMERIC(vm->sp[-1]))
+        return false;
+    vm->sp[-1] = number_negate(vm->sp[-1]);
+    return true;
+}
+
+static void op_print(VM *vm) {
+    value_fprint(vm->out, vm_stack_pop(vm));
+    fputc('\n', vm->out);
+}
+
+#define APPEND(type, array, len, cap, value)                                   \
+    do {                                                                       \
+        if ((len) + 1 > (cap)) {                                               \
+            int old_cap = (cap);                                               \
+            (cap) = GROW_CAPACITY(old_cap);                                    \
+            (array) = GROW_ARRAY(type, array, old_cap, cap);                   \
+        }                                                                      \
+        (array)[(len)++] = (value);                                            \
+    } while (false)
+
+static void emit_bytes(Assembler *as, const void *bytes, int count) {
+    for (int i = 0; i < count; i++)
+        APPEND(uint8_t, as->code, as->len, as->cap, ((uint8_t *)bytes)[i]);
+}
+
+#define EMIT(...)                                                              \
+    do {                                                                       \
+        const uint8_t bytes[] = {__VA_ARGS__};                                 \
+        emit_bytes(as, bytes, sizeof(bytes));                                  \
+    } while (false)
+
+static void emit_u32(Assembler *as, uint32_t value) {
+    emit_bytes(as, &value, sizeof(value));
+}
+
+static void emit_u64(Assembler *as, uint64_t value) {
+    emit_bytes(as, &value, sizeof(value));
+}
+
+static void patch(Assembler *as, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(&as->code[at], &rel, sizeof(rel));
+}
+
+// the rel32 just emitted is patched to jump to the stub at `target`
+static void add_jump(Assembler *as, int target) {
+    Jump jump = {as->len, target};
+    APPEND(Jump, as->jumps, as->jump_len, as->jump_cap, jump);
+    emit_u32(as, 0);
+}
+
+// the rel32 at `at` is patched to the exit of the instruction at `offset`
+static void add_exit_at(Assembler *as, int at, int offset, int pushed) {
+    Exit exit = {at, offset, pushed};
+    APPEND(Exit, as->exits, as->exit_len, as->exit_cap, exit);
+}
+
+// the same for the rel32 just emitted
+static void add_exit(Assembler *as, int offset, int pushed) {
+    add_exit_at(as, as->len, offset, pushed);
+    emit_u32(as, 0);
+}
+
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    R12 = 12,
+    R13 = 13,
+} Register;
+
+#define XMM0 0
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+// stack slots relative to r12
+#define TOP    (-VALUE_SIZE)
+#define SECOND (-2 * VALUE_SIZE)
+
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define TYPE    ((int32_t)offsetof(Value, type))
+#define PAYLOAD ((int32_t)offsetof(Value, as))
+#endif
+
+// `opcode reg, [base + disp]` with a disp32, two byte opcodes are given as
+// 0x0fxx
+static void emit_mem(Assembler *as, uint8_t prefix, bool wide, int opcode,
+                     int reg, Register base, int32_t disp) {
+    if (prefix != 0)
+        EMIT(prefix);
+
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg >> 3) << 2 | base >> 3;
+    if (rex != 0x40)
+        EMIT(rex);
+
+    if (opcode > 0xff)
+        EMIT(0x0f);
+    EMIT(opcode & 0xff, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == 4)
+        EMIT(0x24);
+    emit_u32(as, (uint32_t)disp);
+}
+
+static void emit_load(Assembler *as, Register reg, Register base,
+                      int32_t disp) {
+    emit_mem(as, 0, true, 0x8b, reg, base, disp);
+}
+
+static void emit_store(Assembler *as, Register base, int32_t disp,
+                       Register reg) {
+    emit_mem(as, 0, true, 0x89, reg, base, disp);
+}
+
+// r12 += disp without touching the flags
+static void emit_move_top(Assembler *as, int32_t disp) {
+    emit_mem(as, 0, true, 0x8d, R12, R12, disp);
+}
+
+static void emit_copy(Assembler *as, Register to, int32_t to_disp,
+                      Register from, int32_t from_disp) {
+    for (int32_t i = 0; i < VALUE_SIZE; i += 8) {
+        emit_load(as, RAX, from, from_disp + i);
+        emit_store(as, to, to_disp + i, RAX);
+    }
+}
+
+static void emit_push_value(Assembler *as, Value value) {
+    uint64_t words[sizeof(Value) / 8];
+    memcpy(words, &value, sizeof(Value));
+
+    for (int i = 0; i < VALUE_SIZE / 8; i++) {
+        EMIT(0x48, 0xb8);           // mov rax, word
+        emit_u64(as, words[i]);
+        emit_store(as, R12, i * 8, RAX);
+    }
+    emit_move_top(as, VALUE_SIZE);
+}
+
+// rcx = vm->global_values.values
+static void emit_load_globals(Assembler *as) {
+    emit_load(as, RCX, RBX, offsetof(VM, global_values.values));
+}
+
+static void emit_call(Assembler *as, uintptr_t helper) {
+    emit_store(as, RBX, offsetof(VM, sp), R12);
+    EMIT(0x48, 0x89, 0xdf);         // mov rdi, rbx
+    // through rax, the code may be mapped too far from the helper for a
+    // rel32
+    EMIT(0x48, 0xb8);               // mov rax, helper
+    emit_u64(as, helper);
+    EMIT(0xff, 0xd0);               // call rax
+    emit_load(as, R12, RBX, offsetof(VM, sp));
+}
+
+static void emit_call_with(Assembler *as, uintptr_t helper, int operand) {
+    EMIT(0xbe);                     // mov esi, operand
+    emit_u32(as, (uint32_t)operand);
+    emit_call(as, helper);
+}
+
+// exits through the instruction at `offset` if the helper just called
+// returned false
+static void emit_check(Assembler *as, int offset, int pushed) {
+    EMIT(0x84, 0xc0);               // test al, al
+    EMIT(0x0f, 0x84);               // jz exit
+    add_exit(as, offset, pushed);
+}
+
+// The opcode of a jcc that is taken when the value at [base + disp] is not a
+// double, the caller adds its rel32.
+static void emit_guard_number(Assembler *as, Register base, int32_t disp) {
+#ifdef NAN_BOXING
+    emit_load(as, RAX, base, disp);
+    EMIT(0x48, 0xf7, 0xd0);         // not rax
+    EMIT(0x4c, 0x85, 0xe8);         // test rax, r13, r13 holds QNAN
+    EMIT(0x0f, 0x84);               // jz slow
+#else
+    emit_mem(as, 0, false, 0x81, 7, base, disp + TYPE);
+    emit_u32(as, VAL_NUMBER);       // cmp dword [base + disp], VAL_NUMBER
+    EMIT(0x0f, 0x85);               // jne slow
+#endif
+}
+
+// Like emit_guard_number for integers. Without NaN boxing only, there are
+// no integers with it.
+static void emit_guard_int(Assembler *as, Register base, int32_t disp) {
+#ifdef NAN_BOXING
+    (void)base;
+    (void)disp;
+    EMIT(0xe9);                     // jmp
+#else
+    emit_mem(as, 0, false, 0x81, 7, base, disp + TYPE);
+    emit_u32(as, VAL_INT);          // cmp dword [base + disp], VAL_INT
+    EMIT(0x0f, 0x85);               // jne
+#endif
+}
+
+// Guards that the two values on top are doubles and adds the slow path for
+// when they aren't, the caller sets where it resumes.
+static Slow *emit_guard_numbers(Assembler *as, uintptr_t helper, int offset,
+                                int pushed) {
+    Slow slow = {{0, 0, -1, -1}, helper, offset, pushed, -1, -1};
+
+    emit_guard_number(as, R12, SECOND);
+    slow.at[0] = as->len;
+    emit_u32(as, 0);
+    emit_guard_number(as, R12, TOP);
+    slow.at[1] = as->len;
+    emit_u32(as, 0);
+
+    APPEND(Slow, as->slows, as->slow_len, as->slow_cap, slow);
+    return &as->slows[as->slow_len - 1];
+}
+
+// jumps to the stub at `target` if the value in rax (rax and rdx without
+// NaN boxing) is falsy
+static void emit_branch_if_falsy(Assembler *as, int target) {
+#ifdef NAN_BOXING
+    EMIT(0x48, 0xba);               // mov rdx, NIL_VAL
+    emit_u64(as, NIL_VAL);
+    EMIT(0x48, 0x39, 0xd0);         // cmp rax, rdx
+    EMIT(0x0f, 0x84);               // je target
+    add_jump(as, target);
+    EMIT(0x48, 0xba);               // mov rdx, FALSE_VAL
+    emit_u64(as, FALSE_VAL);
+    EMIT(0x48, 0x39, 0xd0);         // cmp rax, rdx
+    EMIT(0x0f, 0x84);               // je target
+    add_jump(as, target);
+#else
+    EMIT(0x3d);                     // cmp eax, VAL_NIL
+    emit_u32(as, VAL_NIL);
+    EMIT(0x0f, 0x84);               // je target
+    add_jump(as, target);
+    EMIT(0x3d);                     // cmp eax, VAL_BOOL
+    emit_u32(as, VAL_BOOL);
+    EMIT(0x75, 0x08);               // jne over the next two
+    EMIT(0x84, 0xd2);               // test dl, dl
+    EMIT(0x0f, 0x84);               // je target
+    add_jump(as, target);
+#endif
+}
+
+// rax (rax and rdx) = the value on top
+static void emit_peek(Assembler *as) {
+#ifdef NAN_BOXING
+    emit_load(as, RAX, R12, TOP);
+#else
+    emit_load(as, RAX, R12, TOP);
+    emit_load(as, RDX, R12, TOP + PAYLOAD);
+#endif
+}
+
+// [r12 + SECOND] = the bool in al
+static void emit_store_bool(Assembler *as) {
+    EMIT(0x0f, 0xb6, 0xc0);         // movzx eax, al
+#ifdef NAN_BOXING
+    EMIT(0x48, 0xba);               // mov rdx, FALSE_VAL
+    emit_u64(as, FALSE_VAL);
+    EMIT(0x48, 0x09, 0xd0);         // or rax, rdx, TRUE_VAL is FALSE_VAL | 1
+    emit_store(as, R12, SECOND, RAX);
+#else
+    emit_mem(as, 0, false, 0xc7, 0, R12, SECOND + TYPE);
+    emit_u32(as, VAL_BOOL);         // mov dword [second], VAL_BOOL
+    emit_store(as, R12, SECOND + PAYLOAD, RAX);
+#endif
+}
+
+// [r12 + SECOND] = a bool from the flags of a ucomisd, true if above
+static void emit_store_above(Assembler *as) {
+    EMIT(0x0f, 0x97, 0xc0);         // seta al
+    emit_store_bool(as);
+}
+
+// xmm0 = the number at [r12 + disp]
+static void emit_load_number(Assembler *as, int32_t disp) {
+    emit_mem(as, 0xf2, false, 0x0f10, XMM0, R12, disp + PAYLOAD);
+}
+
+// doubles on top, `opcode` is one of addsd, subsd, mulsd, divsd
+static void emit_arithmetic(Assembler *as, int opcode) {
+    emit_load_number(as, SECOND);
+    emit_mem(as, 0xf2, false, opcode, XMM0, R12, TOP + PAYLOAD);
+    emit_mem(as, 0xf2, false, 0x0f11, XMM0, R12, SECOND + PAYLOAD);
+    emit_move_top(as, -VALUE_SIZE);
+}
+
+// doubles on top, sets the flags so that "above" means a > b for
+// `greater` and a < b otherwise, false either way if one is NaN
+static void emit_compare(Assembler *as, bool greater) {
+    emit_load_number(as, greater ? SECOND : TOP);
+    // ucomisd xmm0, other
+    emit_mem(as, 0x66, false, 0x0f2e, XMM0, R12,
+             (greater ? TOP : SECOND) + PAYLOAD);
+}
+
+// The integer form of the SSE `opcode`: add, sub or imul r64, r/m64. 0 for
+// divsd, dividing integers gives a double.
+static int int_opcode(int opcode) {
+    switch (opcode) {
+        case 0x0f58: return 0x03;
+        case 0x0f5c: return 0x2b;
+        case 0x0f59: return 0x0faf;
+        default:     return 0;
+    }
+}
+
+// Integers on top, rax = a op b with `opcode` from int_opcode(). Jumps
+// away through the rel32s put in `away` if that overflowed or, for imul,
+// came out zero, which may have to be -0. The second is -1 for the others.
+// The result is stored by emit_store_int().
+static void emit_int_arithmetic(Assembler *as, int opcode, int away[2]) {
+    emit_load(as, RAX, R12, SECOND + PAYLOAD);
+    emit_mem(as, 0, true, opcode, RAX, R12, TOP + PAYLOAD);
+    EMIT(0x0f, 0x80);               // jo away
+    away[0] = as->len;
+    emit_u32(as, 0);
+
+    away[1] = -1;
+    if (opcode == 0x0faf) {
+        EMIT(0x48, 0x85, 0xc0);     // test rax, rax
+        EMIT(0x0f, 0x84);           // jz away
+        away[1] = as->len;
+        emit_u32(as, 0);
+    }
+}
+
+// the integer in rax replaces the two on top
+static void emit_store_int(Assembler *as) {
+    emit_store(as, R12, SECOND + PAYLOAD, RAX);
+    emit_move_top(as, -VALUE_SIZE);
+}
+
+// The integer on top is negated and stored. Jumps away through the rel32s
+// put in `away` if it is INT64_MIN or 0, whose negations are doubles.
+static void emit_int_negate(Assembler *as, int away[2]) {
+    emit_load(as, RAX, R12, TOP + PAYLOAD);
+    EMIT(0x48, 0xf7, 0xd8);         // neg rax
+    EMIT(0x0f, 0x80);               // jo away
+    away[0] = as->len;
+    emit_u32(as, 0);
+    EMIT(0x0f, 0x84);               // jz away
+    away[1] = as->len;
+    emit_u32(as, 0);
+    emit_store(as, R12, TOP + PAYLOAD, RAX);
+}
+
+// the double on top is negated
+static void emit_flip_sign(Assembler *as) {
+    emit_load(as, RAX, R12, TOP + PAYLOAD);
+    EMIT(0x48, 0xba);               // mov rdx, sign bit
+    emit_u64(as, (uint64_t)1 << 63);
+    EMIT(0x48, 0x31, 0xd0);         // xor rax, rdx
+    emit_store(as, R12, TOP + PAYLOAD, RAX);
+}
+
+// integers on top, sets the flags of a signed a - b
+static void emit_int_compare(Assembler *as) {
+    emit_load(as, RAX, R12, SECOND + PAYLOAD);
+    emit_mem(as, 0, true, 0x3b, RAX, R12, TOP + PAYLOAD);  // cmp rax, b
+}
+
+static void emit_return(Assembler *as, JitResult result) {
+    emit_store(as, RBX, offsetof(VM, sp), R12);
+    EMIT(0xb8);                     // mov eax, result
+    emit_u32(as, result);
+    EMIT(0x41, 0x5d);               // pop r13
+    EMIT(0x41, 0x5c);               // pop r12
+    EMIT(0x5b);                     // pop rbx
+    EMIT(0xc3);                     // ret
+}
+
+static void emit_exit(Assembler *as, Chunk *chunk, Exit *exit) {
+    EMIT(0x48, 0xb8);               // mov rax, ip
+    emit_u64(as, (uintptr_t)&chunk->code[exit->offset]);
+    emit_store(as, RBX, offsetof(VM, ip), RAX);
+    if (exit->pushed > 0)
+        emit_move_top(as, -exit->pushed * VALUE_SIZE);
+    emit_return(as, JIT_EXITED);
+}
+
+static void emit_slow(Assembler *as, Slow *slow) {
+    for (int i = 0; i < 4; i++) {
+        if (slow->at[i] >= 0)
+            patch(as, slow->at[i], as->len);
+    }
+
+    emit_call(as, slow->helper);
+    emit_check(as, slow->offset, slow->pushed);
+
+    if (slow->target >= 0) {
+        emit_peek(as);
+        emit_move_top(as, -VALUE_SIZE);
+        emit_branch_if_falsy(as, slow->target);
+    }
+
+    EMIT(0xe9);                     // jmp resume
+    emit_u32(as, 0);
+    patch(as, as->len - 4, slow->resume);
+}
+
+#define HELPER(helper) ((uintptr_t)(helper))
+
+static void emit_get_local(Assembler *as, int slot) {
+    emit_copy(as, R12, 0, RBX, offsetof(VM, stack) + slot * VALUE_SIZE);
+    emit_move_top(as, VALUE_SIZE);
+}
+
+static void emit_push_constant(Assembler *as, Chunk *chunk, int index) {
+    emit_push_value(as, chunk->constants.values[index]);
+}
+
+#ifndef NAN_BOXING
+// Without NaN boxing the stubs try integers before doubles. Jumps on to the
+// double path, through the rel32s put in `doubles`, unless the two values on
+// top are integers.
+static void emit_guard_ints(Assembler *as, int doubles[2]) {
+    emit_guard_int(as, R12, SECOND);
+    doubles[0] = as->len;
+    emit_u32(as, 0);
+    emit_guard_int(as, R12, TOP);
+    doubles[1] = as->len;
+    emit_u32(as, 0);
+}
+
+// ends the integer path with a jump over the double one, returns its rel32
+static int emit_skip_doubles(Assembler *as, int doubles[2]) {
+    EMIT(0xe9);                     // jmp done
+    int done = as->len;
+    emit_u32(as, 0);
+    patch(as, doubles[0], as->len);
+    patch(as, doubles[1], as->len);
+    return done;
+}
+#endif
+
+// `helper` is the generic form, called for mixed kinds, integer overflows
+// and operands that aren't numbers
+static void emit_number_op(Assembler *as, int opcode, uintptr_t helper,
+                           int offset, int pushed) {
+    bool greater = helper == HELPER(op_greater);
+#ifndef NAN_BOXING
+    int doubles[2];
+    int away[2] = {-1, -1};
+    int done = -1;
+
+    if (opcode == 0 || int_opcode(opcode) != 0) {
+        emit_guard_ints(as, doubles);
+        if (opcode != 0) {
+            emit_int_arithmetic(as, int_opcode(opcode), away);
+            emit_store_int(as);
+        }
+        else {
+            emit_int_compare(as);
+            EMIT(0x0f, greater ? 0x9f : 0x9c, 0xc0);    // setg or setl al
+            emit_store_bool(as);
+            emit_move_top(as, -VALUE_SIZE);
+        }
+        done = emit_skip_doubles(as, doubles);
+    }
+#endif
+
+    Slow *slow = emit_guard_numbers(as, helper, offset, pushed);
+
+    if (opcode != 0) {
+        emit_arithmetic(as, opcode);
+    }
+    else {
+        emit_compare(as, greater);
+        emit_store_above(as);
+        emit_move_top(as, -VALUE_SIZE);
+    }
+
+    slow->resume = as->len;
+#ifndef NAN_BOXING
+    slow->at[2] = away[0];
+    slow->at[3] = away[1];
+    if (done >= 0)
+        patch(as, done, as->len);
+#endif
+}
+
+// the operands are popped, jumps to `target` unless a > b for `greater` or
+// a < b otherwise
+static void emit_compare_jump(Assembler *as, bool greater, int offset,
+                              int target) {
+    uintptr_t helper = greater ? HELPER(op_greater) : HELPER(op_less);
+#ifndef NAN_BOXING
+    int doubles[2];
+    emit_guard_ints(as, doubles);
+    emit_int_compare(as);
+    emit_move_top(as, -2 * VALUE_SIZE);
+    EMIT(0x0f, greater ? 0x8e : 0x8d);  // jle or jge target
+    add_jump(as, target);
+    int done = emit_skip_doubles(as, doubles);
+#endif
+
+    Slow *slow = emit_guard_numbers(as, helper, offset, 0);
+    slow->target = target;
+
+    emit_compare(as, greater);
+    emit_move_top(as, -2 * VALUE_SIZE);
+    EMIT(0x0f, 0x86);               // jbe target
+    add_jump(as, target);
+
+    slow->resume = as->len;
+#ifndef NAN_BOXING
+    patch(as, done, as->len);
+#endif
+}
+
+// integers whose negation is a double and values that aren't numbers go
+// through the helper
+static void emit_negate(Assembler *as, int offset) {
+    Slow slow = {{-1, -1, -1, -1}, HELPER(op_negate), offset, 0, -1, -1};
+#ifndef NAN_BOXING
+    int doubles[2];
+    emit_guard_int(as, R12, TOP);
+    doubles[0] = doubles[1] = as->len;
+    emit_u32(as, 0);
+    emit_int_negate(as, &slow.at[1]);
+    int done = emit_skip_doubles(as, doubles);
+#endif
+
+    emit_guard_number(as, R12, TOP);
+    slow.at[0] = as->len;
+    emit_u32(as, 0);
+    emit_flip_sign(as);
+
+    slow.resume = as->len;
+#ifndef NAN_BOXING
+    patch(as, done, as->len);
+#endif
+    APPEND(Slow, as->slows, as->slow_len, as->slow_cap, slow);
+}
+
+static void emit_get_global(Assembler *as, int slot, int offset) {
+    int32_t disp = slot * VALUE_SIZE;
+    emit_load_globals(as);
+
+#ifdef NAN_BOXING
+    emit_load(as, RAX, RCX, disp);
+    EMIT(0x48, 0xba);               // mov rdx, UNDEFINED_VAL
+    emit_u64(as, UNDEFINED_VAL);
+    EMIT(0x48, 0x39, 0xd0);         // cmp rax, rdx
+#else
+    emit_mem(as, 0, false, 0x81, 7, RCX, disp + TYPE);
+    emit_u32(as, VAL_UNDEFINED);    // cmp dword [rcx + disp], VAL_UNDEFINED
+#endif
+    EMIT(0x0f, 0x84);               // je exit
+    add_exit(as, offset, 0);
+}
+
+// Emit `part` of the instruction at `offset`.
+static bool translate_part(Assembler *as, Chunk *chunk, InstructionPart *part,
+                           int offset) {
+    int operand = part->operand;
+
+    switch (part->opcode) {
+        case OP_CONSTANT: emit_push_constant(as, chunk, operand); break;
+        case OP_NIL:   emit_push_value(as, NIL_VAL); break;
+        case OP_TRUE:  emit_push_value(as, BOOL_VAL(true)); break;
+        case OP_FALSE: emit_push_value(as, BOOL_VAL(false)); break;
+        case OP_POP:   emit_move_top(as, -VALUE_SIZE); break;
+        case OP_NOT:   emit_call(as, HELPER(op_not)); break;
+
+        case OP_GET_LOCAL: emit_get_local(as, operand); break;
+        case OP_SET_LOCAL:
+            emit_copy(as, RBX, offsetof(VM, stack) + operand * VALUE_SIZE,
+                      R12, TOP);
+            break;
+
+        case OP_GET_GLOBAL:
+            emit_get_global(as, operand, offset);
+            emit_copy(as, R12, 0, RCX, operand * VALUE_SIZE);
+            emit_move_top(as, VALUE_SIZE);
+            break;
+        case OP_SET_GLOBAL:
+            emit_get_global(as, operand, offset);
+            emit_copy(as, RCX, operand * VALUE_SIZE, R12, TOP);
+            break;
+        case OP_DEFINE_GLOBAL:
+            emit_call_with(as, HELPER(op_define_global), operand);
+            break;
+
+        case OP_EQUAL: emit_call(as, HELPER(op_equal)); break;
+
+        case OP_ADD:
+            emit_number_op(as, 0x0f58, HELPER(op_add), offset, part->pushed);
+            break;
+        case OP_SUBTRACT:
+            emit_number_op(as, 0x0f5c, HELPER(op_subtract), offset,
+                           part->pushed);
+            break;
+        case OP_MULTIPLY:
+            emit_number_op(as, 0x0f59, HELPER(op_multiply), offset,
+                           part->pushed);
+            break;
+        case OP_DIVIDE:
+            emit_number_op(as, 0x0f5e, HELPER(op_divide), offset,
+                           part->pushed);
+            break;
+        case OP_LESS:
+            emit_number_op(as, 0, HELPER(op_less), offset, part->pushed);
+            break;
+        case OP_GREATER:
+            emit_number_op(as, 0, HELPER(op_greater), offset, part->pushed);
+            break;
+
+        case OP_NEGATE: emit_negate(as, offset); break;
+        case OP_PRINT:  emit_call(as, HELPER(op_print)); break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+            EMIT(0xe9);             // jmp target
+            add_jump(as, part->target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            emit_peek(as);
+            emit_branch_if_falsy(as, part->target);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            emit_peek(as);
+            emit_move_top(as, -VALUE_SIZE);
+            emit_branch_if_falsy(as, part->target);
+            break;
+        case OP_RETURN:
+            emit_return(as, JIT_RETURNED);
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Emit the stub of every instruction, `native` gets the offset of each stub.
+static bool translate(Assembler *as, Chunk *chunk, int *native) {
+    for (int offset = 0; offset < chunk->len;) {
+        // code that already ran on the interpreter may be quickened,
+        // superinstructions run as the sequence they were fused from
+        InstructionPart parts[INSTRUCTION_PARTS_MAX];
+        int count = chunk_decode(chunk, offset, parts);
+        if (count < 0)
+            return false;
+
+        native[offset] = as->len;
+
+        for (int i = 0; i < count; i++) {
+            InstructionPart *part = &parts[i];
+
+            // a comparison that only decides a jump sets no boolean
+            if ((part->opcode == OP_LESS || part->opcode == OP_GREATER) &&
+                i + 1 < count && parts[i + 1].opcode == OP_POP_JUMP_IF_FALSE) {
+                emit_compare_jump(as, part->opcode == OP_GREATER, offset,
+                                  parts[++i].target);
+                continue;
+            }
+
+            if (!translate_part(as, chunk, part, offset))
+                return false;
+        }
+
+        offset += chunk_opcode_size(chunk->code[offset]);
+    }
+
+    return true;
+}
+
+static void emit_exits(Assembler *as, Chunk *chunk) {
+    for (int i = 0; i < as->exit_len; i++) {
+        patch(as, as->exits[i].at, as->len);
+        emit_exit(as, chunk, &as->exits[i]);
+    }
+}
+
+static bool resolve(Assembler *as, Chunk *chunk, int *native) {
+    // slow paths add exits and jumps of their own
+    for (int i = 0; i < as->slow_len; i++)
+        emit_slow(as, &as->slows[i]);
+
+    for (int i = 0; i < as->jump_len; i++) {
+        Jump *jump = &as->jumps[i];
+        if (jump->target < 0 || jump->target >= chunk->len ||
+            native[jump->target] < 0)
+            return false;
+        patch(as, jump->at, native[jump->target]);
+    }
+
+    emit_exits(as, chunk);
+    return true;
+}
+
+static void emit_prologue(Assembler *as) {
+    emit_bytes(as, (uint8_t[]){
+        0x53,                       // push rbx
+        0x41, 0x54,                 // push r12
+        0x41, 0x55,                 // push r13
+        0x48, 0x89, 0xfb,           // mov rbx, rdi
+        0x49, 0xbd,                 // mov r13, QNAN
+    }, 10);
+#ifdef NAN_BOXING
+    emit_u64(as, QNAN);
+#else
+    emit_u64(as, 0);
+#endif
+    emit_load(as, R12, RBX, offsetof(VM, sp));
+}
+
+// NULL if the code can't be mapped
+static JitCode *install(Assembler *as) {
+    // written while writable, then only executable
+    uint8_t *memory = mmap(NULL, as->len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+
+    memcpy(memory, as->code, as->len);
+    if (mprotect(memory, as->len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, as->len);
+        return NULL;
+    }
+
+    JitCode *code = ALLOCATE(JitCode, 1);
+    code->memory = memory;
+    code->size = as->len;
+    return code;
+}
+
+static void assembler_free(Assembler *as) {
+    FREE_ARRAY(uint8_t, as->code, as->cap);
+    FREE_ARRAY(Jump, as->jumps, as->jump_cap);
+    FREE_ARRAY(Exit, as->exits, as->exit_cap);
+    FREE_ARRAY(Slow, as->slows, as->slow_cap);
+}
+
+JitCode *jit_compile(Chunk *chunk) {
+    Assembler as = {0};
+    int *native = ALLOCATE(int, chunk->len + 1);
+    for (int i = 0; i <= chunk->len; i++)
+        native[i] = -1;
+
+    emit_prologue(&as);
+    bool ok = translate(&as, chunk, native) && resolve(&as, chunk, native);
+    JitCode *code = ok ? install(&as) : NULL;
+
+    FREE_ARRAY(int, native, chunk->len + 1);
+    assembler_free(&as);
+    return code;
+}
+
+// Traces. A trace repeats one recorded iteration of a loop as straight line
+// code and leaves through a side exit wherever a value has another type or a
+// branch goes another way than it did while recording. What is known about
+// the types of the stack slots only holds within an iteration: the top of
+// the loop assumes nothing and every later operation knows what the earlier
+// ones left behind, so only the first use of a value is guarded.
+
+typedef struct {
+    Assembler *as;
+    Chunk *chunk;
+    // of every stack slot, locals included, below `top`
+    TraceType types[STACK_MAX];
+    int top;
+} TraceCompiler;
+
+// exits through `op` unless the value `distance` below the top is of `type`,
+// TYPE_NUMBER or TYPE_INT
+static void guard_type(TraceCompiler *tc, TraceOp *op, int distance,
+                       TraceType type) {
+    TraceType *known = &tc->types[tc->top - 1 - distance];
+    if (*known == type)
+        return;
+
+    int32_t disp = -(distance + 1) * VALUE_SIZE;
+    if (type == TYPE_INT)
+        emit_guard_int(tc->as, R12, disp);
+    else
+        emit_guard_number(tc->as, R12, disp);
+    add_exit(tc->as, op->offset, op->pushed);
+    *known = type;
+}
+
+// ZF is set if the value in rax (rax and rdx without NaN boxing) is falsy,
+// `boolean` if it is known to be a bool
+static void emit_test_falsy(Assembler *as, bool boolean) {
+#ifdef NAN_BOXING
+    if (!boolean) {
+        EMIT(0x48, 0xba);           // mov rdx, NIL_VAL
+        emit_u64(as, NIL_VAL);
+        EMIT(0x48, 0x39, 0xd0);     // cmp rax, rdx
+        EMIT(0x74, 0x0d);           // je over the next two
+    }
+    EMIT(0x48, 0xba);               // mov rdx, FALSE_VAL
+    emit_u64(as, FALSE_VAL);
+    EMIT(0x48, 0x39, 0xd0);         // cmp rax, rdx
+#else
+    if (!boolean) {
+        EMIT(0x3d);                 // cmp eax, VAL_NIL
+        emit_u32(as, VAL_NIL);
+        EMIT(0x74, 0x09);           // je over the next three
+        EMIT(0x3d);                 // cmp eax, VAL_BOOL
+        emit_u32(as, VAL_BOOL);
+        EMIT(0x75, 0x02);           // jne over the next one, ZF is clear
+    }
+    EMIT(0x84, 0xd2);               // test dl, dl
+#endif
+}
+
+static void trace_branch(TraceCompiler *tc, TraceOp *op) {
+    Assembler *as = tc->as;
+    bool boolean = tc->types[tc->top - 1] == TYPE_BOOL;
+
+    emit_peek(as);
+    if (op->opcode == OP_POP_JUMP_IF_FALSE) {
+        emit_move_top(as, -VALUE_SIZE);
+        tc->top--;
+    }
+
+    emit_test_falsy(as, boolean);
+    // leave for wherever the other direction goes
+    EMIT(0x0f, op->taken ? 0x85 : 0x84);    // jnz or jz exit
+    add_exit(as, op->taken ? op->next : op->target, 0);
+}
+
+// `kind` is the kind of number both operands were recorded as, anything else
+// and integer division go through `helper`, the generic form
+static void trace_arithmetic(TraceCompiler *tc, TraceOp *op, TraceType kind,
+                             int opcode, uintptr_t helper) {
+    Assembler *as = tc->as;
+    if (kind == TYPE_INT && int_opcode(opcode) == 0)
+        kind = TYPE_UNKNOWN;
+
+    if (kind == TYPE_UNKNOWN) {
+        emit_call(as, helper);
+        emit_check(as, op->offset, op->pushed);
+    }
+    else {
+        guard_type(tc, op, 1, kind);
+        guard_type(tc, op, 0, kind);
+        if (kind == TYPE_INT) {
+            int away[2];
+            emit_int_arithmetic(as, int_opcode(opcode), away);
+            emit_store_int(as);
+            // run() redoes it and gets a double
+            add_exit_at(as, away[0], op->offset, op->pushed);
+            if (away[1] >= 0)
+                add_exit_at(as, away[1], op->offset, op->pushed);
+        }
+        else {
+            emit_arithmetic(as, opcode);
+        }
+    }
+
+    tc->types[--tc->top - 1] = kind;
+}
+
+// `kind` as for trace_arithmetic()
+static void trace_compare(TraceCompiler *tc, TraceOp *op, TraceType kind) {
+    Assembler *as = tc->as;
+
+    if (kind == TYPE_UNKNOWN) {
+        if (op->opcode == OP_EQUAL) {
+            emit_call(as, HELPER(op_equal));
+        }
+        else {
+            emit_call(as, op->opcode == OP_GREATER ? HELPER(op_greater)
+                                                   : HELPER(op_less));
+            emit_check(as, op->offset, op->pushed);
+        }
+        tc->types[--tc->top - 1] = TYPE_BOOL;
+        return;
+    }
+
+    guard_type(tc, op, 1, kind);
+    guard_type(tc, op, 0, kind);
+
+    if (kind == TYPE_INT) {
+        emit_int_compare(as);
+        EMIT(0x0f, op->opcode == OP_EQUAL   ? 0x94 :
+                   op->opcode == OP_GREATER ? 0x9f : 0x9c,
+             0xc0);                 // sete, setg or setl al
+        emit_store_bool(as);
+    }
+    else if (op->opcode == OP_EQUAL) {
+        emit_compare(as, false);
+        // ucomisd leaves ZF set and PF clear only for equal numbers
+        EMIT(0x0f, 0x94, 0xc0);     // sete al
+        EMIT(0x0f, 0x9b, 0xc1);     // setnp cl
+        EMIT(0x20, 0xc8);           // and al, cl
+        emit_store_bool(as);
+    }
+    else {
+        emit_compare(as, op->opcode == OP_GREATER);
+        emit_store_above(as);
+    }
+
+    emit_move_top(as, -VALUE_SIZE);
+    tc->types[--tc->top - 1] = TYPE_BOOL;
+}
+
+// Emit the trace and its exits, the last op jumps back to the first.
+static bool translate_trace(TraceCompiler *tc, TraceOp *ops, int len) {
+    Assembler *as = tc->as;
+    TraceType *types = tc->types;
+    int start = as->len;
+
+    for (int i = 0; i < len; i++) {
+        TraceOp *op = &ops[i];
+        // the kind of number both operands were, TYPE_UNKNOWN for mixed
+        // kinds and anything else
+        TraceType kind = op->types[0] == op->types[1] &&
+                         (op->types[0] == TYPE_NUMBER ||
+                          op->types[0] == TYPE_INT) ? op->types[0]
+                                                    : TYPE_UNKNOWN;
+        bool text = op->types[0] == TYPE_TEXT && op->types[1] == TYPE_TEXT;
+
+        switch (op->opcode) {
+            case OP_CONSTANT:
+                emit_push_constant(as, tc->chunk, op->operand);
+                types[tc->top++] =
+                    trace_type(tc->chunk->constants.values[op->operand]);
+                break;
+            case OP_NIL:
+                emit_push_value(as, NIL_VAL);
+                types[tc->top++] = TYPE_NIL;
+                break;
+            case OP_TRUE:
+            case OP_FALSE:
+                emit_push_value(as, BOOL_VAL(op->opcode == OP_TRUE));
+                types[tc->top++] = TYPE_BOOL;
+                break;
+            case OP_POP:
+                emit_move_top(as, -VALUE_SIZE);
+                tc->top--;
+                break;
+            case OP_NOT:
+                emit_call(as, HELPER(op_not));
+                types[tc->top - 1] = TYPE_BOOL;
+                break;
+
+            case OP_GET_LOCAL:
+                emit_get_local(as, op->operand);
+                types[tc->top++] = types[op->operand];
+                break;
+            case OP_SET_LOCAL:
+                emit_copy(as, RBX,
+                          offsetof(VM, stack) + op->operand * VALUE_SIZE,
+                          R12, TOP);
+                types[op->operand] = types[tc->top - 1];
+                break;
+            case OP_GET_GLOBAL:
+                emit_get_global(as, op->operand, op->offset);
+                emit_copy(as, R12, 0, RCX, op->operand * VALUE_SIZE);
+                emit_move_top(as, VALUE_SIZE);
+                types[tc->top++] = TYPE_UNKNOWN;
+                break;
+            case OP_SET_GLOBAL:
+                emit_get_global(as, op->operand, op->offset);
+                emit_copy(as, RCX, op->operand * VALUE_SIZE, R12, TOP);
+                break;
+
+            case OP_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+                trace_compare(tc, op, kind);
+                break;
+
+            case OP_ADD:
+                if (!text) {
+                    trace_arithmetic(tc, op, kind, 0x0f58, HELPER(op_add));
+                    break;
+                }
+                // strings, the helper checks them
+                emit_call(as, HELPER(op_add));
+                emit_check(as, op->offset, op->pushed);
+                types[--tc->top - 1] = TYPE_TEXT;
+                break;
+            case OP_SUBTRACT:
+                trace_arithmetic(tc, op, kind, 0x0f5c, HELPER(op_subtract));
+                break;
+            case OP_MULTIPLY:
+                trace_arithmetic(tc, op, kind, 0x0f59, HELPER(op_multiply));
+                break;
+            case OP_DIVIDE:
+                trace_arithmetic(tc, op, kind, 0x0f5e, HELPER(op_divide));
+                break;
+
+            case OP_NEGATE:
+                if (op->types[1] == TYPE_INT) {
+                    int away[2];
+                    guard_type(tc, op, 0, TYPE_INT);
+                    emit_int_negate(as, away);
+                    add_exit_at(as, away[0], op->offset, op->pushed);
+                    add_exit_at(as, away[1], op->offset, op->pushed);
+                }
+                else {
+                    guard_type(tc, op, 0, TYPE_NUMBER);
+                    emit_flip_sign(as);
+                }
+                break;
+
+            case OP_PRINT:
+                emit_call(as, HELPER(op_print));
+                tc->top--;
+                break;
+
+            // the trace is laid out in the order it ran
+            case OP_JUMP:
+            case OP_LOOP:
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+                trace_branch(tc, op);
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    EMIT(0xe9);                     // jmp start
+    emit_u32(as, 0);
+    patch(as, as->len - 4, start);
+
+    emit_exits(as, tc->chunk);
+    return true;
+}
+
+JitCode *jit_compile_trace(Chunk *chunk, TraceOp *ops, int len, int height) {
+    Assembler as = {0};
+    TraceCompiler tc;
+    tc.as = &as;
+    tc.chunk = chunk;
+    tc.top = height;
+    for (int i = 0; i < STACK_MAX; i++)
+        tc.types[i] = TYPE_UNKNOWN;
+
+    emit_prologue(&as);
+    JitCode *code = translate_trace(&tc, ops, len) ? install(&as) : NULL;
+
+    assembler_free(&as);
+    return code;
+}
+
+JitResult jit_run(VM *vm, JitCode *code) {
+    // ISO C has no cast from an object to a function pointer
+    JitFunction function;
+    memcpy(&function, &code->memory, sizeof(function));
+    return function(vm);
+}
+
+void jit_free(JitCode *code) {
+    if (code == NULL)
+        return;
+
+    munmap(code->memory, code->size);
+    FREE(JitCode, code);
+}
+
+#undef HELPER
+#undef PAYLOAD
+#undef TYPE
+#undef SECOND
+#undef TOP
+#undef VALUE_SIZE
+#undef XMM0
+#undef EMIT
+#undef APPEND
+
+#else
+
+JitCode *jit_compile(Chunk *chunk) {
+    (void)chunk;
+    return NULL;
+}
+
+JitCode *jit_compile_trace(Chunk *chunk, struct TraceOp *ops, int len,
+                           int height) {
+    (void)chunk;
+    (void)ops;
+    (void)len;
+    (void)height;
+    return NULL;
+}
+
+JitResult jit_run(VM *vm, JitCode *code) {
+    (void)vm;
+    (void)code;
+    return JIT_EXITED;
+}
+
+void jit_free(JitCode *code) {
+    (void)code;
+}
+
+#endif
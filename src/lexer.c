@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "lexer.h"
+
+// A piece of the source lexed on its own thread, as if a line started at
+// `begin`. Its lines count from 1 and are rebased while stitching.
+typedef struct {
+    const char *source;
+    uint32_t begin;
+    uint32_t end;
+    TokenStream tokens;
+    // the line the first token starts on
+    int first_line;
+
+    // the first token at or after `end`, where the next piece takes over,
+    // and the line it starts on
+    uint32_t next_start;
+    int next_line;
+} LexChunk;
+
+static void stream_init(TokenStream *stream, const char *source) {
+    *stream = (TokenStream){.source = source};
+}
+
+static void *grow(void *pointer, size_t size) {
+    void *result = realloc(pointer, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+static void stream_push(TokenStream *stream, TokenType type, uint32_t offset,
+                        uint32_t length, int line) {
+    if (stream->len + 1 > stream->cap) {
+        stream->cap = stream->cap < 64 ? 64 : stream->cap * 2;
+        stream->types = grow(stream->types, sizeof(uint8_t) * stream->cap);
+        stream->offsets = grow(stream->offsets, sizeof(uint32_t) * stream->cap);
+        stream->lengths = grow(stream->lengths, sizeof(uint32_t) * stream->cap);
+        stream->lines = grow(stream->lines, sizeof(int) * stream->cap);
+    }
+
+    stream->types[stream->len] = (uint8_t)type;
+    stream->offsets[stream->len] = offset;
+    stream->lengths[stream->len] = length;
+    stream->lines[stream->len] = line;
+    stream->len++;
+}
+
+void token_stream_free(TokenStream *stream) {
+    free(stream->types);
+    free(stream->offsets);
+    free(stream->lengths);
+    free(stream->lines);
+    stream_init(stream, NULL);
+}
+
+// Tokens carry the line they end on, which differs from the line they
+// start on for strings that span lines.
+static int start_line(Scanner *scanner) {
+    int line = scanner->line;
+    for (const char *c = scanner->start; c < scanner->current; c++) {
+        if (*c == '\n')
+            line--;
+    }
+    return line;
+}
+
+// Appends the tokens that start in [begin, end) when scanning from `begin`
+// on `line`, and returns the start of the token after them. `first_line`
+// and `next_line` receive the lines the first token and that one start on.
+static uint32_t lex_range(TokenStream *stream, const char *source,
+                          uint32_t begin, uint32_t end, int line,
+                          int *first_line, int *next_line) {
+    Scanner scanner;
+    scanner_init(&scanner, source + begin);
+    scanner.line = line;
+
+    for (bool first = true;; first = false) {
+        Token token = scanner_scan_token(&scanner);
+        // error tokens point at their message, not into the source
+        uint32_t start = (uint32_t)(scanner.start - source);
+
+        if (first && first_line != NULL)
+            *first_line = start_line(&scanner);
+
+        if (start >= end || token.type == TOKEN_EOF) {
+            *next_line = start_line(&scanner);
+            return start;
+        }
+
+        if (token.type == TOKEN_ERROR)
+            stream_push(stream, token.type, start, 0, start_line(&scanner));
+        else
+            stream_push(stream, token.type, start, token.length, token.line);
+    }
+}
+
+static void *lex_chunk(void *data) {
+    LexChunk *chunk = data;
+    chunk->next_start = lex_range(&chunk->tokens, chunk->source, chunk->begin,
+                                  chunk->end, 1, &chunk->first_line,
+                                  &chunk->next_line);
+    return NULL;
+}
+
+// Splits `source` into `count` pieces that start right after a line feed.
+static int split_source(const char *source, uint32_t len, LexChunk *chunks,
+                        int count) {
+    int pieces = 0;
+    uint32_t begin = 0;
+
+    for (int i = 1; i <= count && begin < len; i++) {
+        uint32_t end = len;
+
+        if (i < count) {
+            uint32_t target = (uint32_t)((uint64_t)len * i / count);
+            const char *newline = target > begin
+                ? memchr(source + target, '\n', len - target) : NULL;
+            if (newline == NULL)
+                continue;
+            end = (uint32_t)(newline - source) + 1;
+        }
+
+        chunks[pieces] = (LexChunk){.source = source, .begin = begin,
+                                    .end = end};
+        stream_init(&chunks[pieces].tokens, source);
+        pieces++;
+        begin = end;
+    }
+
+    return pieces;
+}
+
+// The pieces are lexed speculatively: a piece that starts inside a string
+// literal produces garbage. Piece j is only taken as is when its first
+// token starts where the previous piece handed over, then both scanners
+// were in the same state there. Otherwise it is lexed again from the hand
+// over point, and skipped if the previous piece already ran past it.
+static void stitch(TokenStream *stream, LexChunk *chunks, int count) {
+    uint32_t start = 0;
+    int line = 1;
+
+    for (int i = 0; i < count; i++) {
+        LexChunk *chunk = &chunks[i];
+        TokenStream *tokens = &chunk->tokens;
+
+        if (start >= chunk->end)
+            continue;
+
+        if (tokens->len > 0 && tokens->offsets[0] == start) {
+            int rebase = line - chunk->first_line;
+            for (int j = 0; j < tokens->len; j++) {
+                stream_push(stream, tokens->types[j], tokens->offsets[j],
+                            tokens->lengths[j], tokens->lines[j] + rebase);
+            }
+            start = chunk->next_start;
+            line = chunk->next_line + rebase;
+        }
+        else {
+            start = lex_range(stream, stream->source, start, chunk->end,
+                              line, NULL, &line);
+        }
+    }
+
+    stream_push(stream, TOKEN_EOF, start, 0, line);
+}
+
+void token_stream_lex(TokenStream *stream, const char *source, int threads) {
+    stream_init(stream, source);
+
+    uint32_t len = (uint32_t)strlen(source);
+    int count = threads;
+    if ((uint32_t)count > len / LEX_MIN_CHUNK)
+        count = len / LEX_MIN_CHUNK;
+
+    if (count <= 1) {
+        int line;
+        uint32_t end = lex_range(stream, source, 0, len, 1, NULL, &line);
+        stream_push(stream, TOKEN_EOF, end, 0, line);
+        return;
+    }
+
+    LexChunk *chunks = malloc(sizeof(LexChunk) * count);
+    pthread_t *workers = malloc(sizeof(pthread_t) * count);
+    if (chunks == NULL || workers == NULL)
+        exit(1);
+
+    count = split_source(source, len, chunks, count);
+
+    // the first piece is lexed on this thread, a piece whose thread can't
+    // be started is too
+    bool *started = calloc(count, sizeof(bool));
+    if (started == NULL)
+        exit(1);
+
+    for (int i = 1; i < count; i++)
+        started[i] = pthread_create(&workers[i], NULL, lex_chunk,
+                                    &chunks[i]) == 0;
+
+    for (int i = 0; i < count; i++) {
+        if (started[i])
+            pthread_join(workers[i], NULL);
+        else
+            lex_chunk(&chunks[i]);
+    }
+
+    stitch(stream, chunks, count);
+
+    for (int i = 0; i < count; i++)
+        token_stream_free(&chunks[i].tokens);
+    free(started);
+    free(workers);
+    free(chunks);
+}
+
+Token token_stream_get(TokenStream *stream, int index) {
+    const char *start = stream->source + stream->offsets[index];
+
+    if (stream->types[index] == TOKEN_ERROR) {
+        Scanner scanner;
+        scanner_init(&scanner, start);
+        scanner.line = stream->lines[index];
+        return scanner_scan_token(&scanner);
+    }
+
+    return (Token){
+        .type   = stream->types[index],
+        .line   = stream->lines[index],
+        .start  = start,
+        .length = (int)stream->lengths[index],
+    };
+}
@@ -3,28 +3,228 @@
 #include <string.h>
 
 #include "common.h"
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 #include "utils.h"
 
+typedef struct {
+    // keep compiled bytecode in `<path>c` next to the script
+    bool cache;
+    bool stats;
+    bool gc_stats;
+    bool table_stats;
+    double gc_growth_factor;
+    int lex_threads;
+    bool optimize;
+    // compile for the register VM, the cache and -O only apply to the
+    // stack VM
+    bool registers;
+    // run stack VM code natively where supported, --jit-verify runs it on
+    // both the interpreter and the JIT and compares what they print
+    bool jit;
+    bool jit_verify;
+    // record hot loops and run them natively, --jit-verify then checks the
+    // traces instead of the JIT
+    bool trace;
+    int trace_threshold;
+    bool trace_stats;
+    // print the script as C instead of running it, see aot.c
+    bool emit_c;
+    // print the most common opcode sequences of this length, 0 for none
+    int ngrams;
+} Options;
+
+#define NGRAMS_SHOWN 20
+
 static int repl(void) {
     return 0;
 }
 
-static int run_file(const char *path) {
+static char *cache_path(const char *path) {
+    size_t len = strlen(path);
+    char *cache = ALLOCATE(char, len + 2);
+    memcpy(cache, path, len);
+    memcpy(cache + len, "c", 2);
+    return cache;
+}
+
+static Script *load_script(VM *vm, const char *path, const char *source,
+                           Options *options) {
+    if (!options->cache || options->registers || strcmp(path, "-") == 0)
+        return vm_compile(vm, source);
+
+    char *cache = cache_path(path);
+
+    Script *script = cache_load(vm, cache, source);
+    if (script == NULL) {
+        script = vm_compile(vm, source);
+        if (script != NULL)
+            cache_write(vm, script, cache, source);
+    }
+
+    FREE_ARRAY(char, cache, strlen(path) + 2);
+    return script;
+}
+
+static bool same_contents(FILE *a, FILE *b) {
+    rewind(a);
+    rewind(b);
+
+    int ca, cb;
+    do {
+        ca = fgetc(a);
+        cb = fgetc(b);
+    } while (ca == cb && ca != EOF);
+
+    return ca == cb;
+}
+
+static void copy_contents(FILE *from, FILE *to) {
+    char buffer[4096];
+    size_t len;
+
+    rewind(from);
+    while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0)
+        fwrite(buffer, 1, len, to);
+}
+
+// Runs the script on the interpreter and then natively, with the JIT or with
+// traces, each time with fresh globals, and passes on what the second run
+// printed. `verified` is false if
+// the two printed different things or ended differently.
+static InterpretResult run_verified(VM *vm, Script *script, bool *verified) {
+    FILE *out[2] = {tmpfile(), tmpfile()};
+    FILE *err[2] = {tmpfile(), tmpfile()};
+    InterpretResult results[2] = {INTERPRET_RUNTIME_ERROR,
+                                  INTERPRET_RUNTIME_ERROR};
+
+    bool trace = vm->trace;
+    bool jit = vm->jit || !trace;
+    *verified = out[0] && out[1] && err[0] && err[1];
+
+    for (int i = 0; i < 2 && *verified; i++) {
+        vm->jit = i == 1 && jit;
+        vm->trace = i == 1 && trace;
+        vm->out = out[i];
+        vm->err = err[i];
+        results[i] = vm_run(vm, script, true);
+    }
+
+    vm->out = stdout;
+    vm->err = stderr;
+
+    if (*verified) {
+        copy_contents(out[1], stdout);
+        copy_contents(err[1], stderr);
+        *verified = results[0] == results[1] &&
+                    same_contents(out[0], out[1]) &&
+                    same_contents(err[0], err[1]);
+        if (!*verified)
+            fprintf(stderr, "jit: output differs from the interpreter's\n");
+    }
+    else {
+        fprintf(stderr, "jit: could not create temporary files\n");
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (out[i] != NULL)
+            fclose(out[i]);
+        if (err[i] != NULL)
+            fclose(err[i]);
+    }
+
+    return results[1];
+}
+
+static void print_table_stats(const char *name, Table *table) {
+    TableStats stats;
+    table_stats(table, &stats);
+    fprintf(stderr,
+            "%s: %d entries, %d tombstones, capacity %d, "
+            "%.2f groups probed on average\n",
+            name, stats.len, stats.tombstones, stats.cap, stats.avg_probe);
+}
+
+static int run_file(const char *path, Options *options) {
     VM vm;
     vm_init(&vm);
 
-    char *source = read_file(path);
-    if (source == NULL)
+    if (options->gc_growth_factor > 0)
+        vm.gc_growth_factor = options->gc_growth_factor;
+    vm.lex_threads = options->lex_threads;
+    vm.optimize = options->optimize;
+    vm.print_code = !options->emit_c;
+    vm.registers = options->registers;
+    vm.jit = options->jit;
+    vm.trace = options->trace;
+    if (options->trace_threshold > 0)
+        vm.trace_threshold = options->trace_threshold;
+
+    SourceFile file;
+    if (!source_file_open(&file, path))
         exit(74);
 
-    InterpretResult result = vm_interpret(&vm, source);
+    const char *source = file.data;
+
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
+    bool verified = true;
+
+    Script *script = load_script(&vm, path, source, options);
+    if (script != NULL) {
+        if (options->ngrams > 0)
+            print_ngrams(&script->chunk, options->ngrams, NGRAMS_SHOWN);
+
+        if (options->emit_c) {
+            verified = aot_emit(&vm, script, stdout);
+            if (!verified)
+                fprintf(stderr, "emit-c: the script can't be translated\n");
+            result = INTERPRET_OK;
+        }
+        else if (options->jit_verify)
+            result = run_verified(&vm, script, &verified);
+        else
+            result = vm_run(&vm, script, false);
 
-    free(source);
+        // a script loaded from the cache reports zeros, it wasn't compiled
+        if (options->stats)
+            fprintf(stderr,
+                    "compiler: %d operators folded, "
+                    "%d constants deduplicated\n",
+                    script->chunk.folded, script->chunk.deduplicated);
+        vm_script_free(&vm, script);
+    }
+
+    if (options->gc_stats) {
+        GCStats *stats = &vm.gc_stats;
+        fprintf(stderr,
+                "gc: %d collections, %zu bytes freed, "
+                "pause %.3f ms total, %.3f ms max\n",
+                stats->collections, stats->bytes_freed,
+                stats->total_pause * 1e3, stats->max_pause * 1e3);
+    }
+
+    if (options->trace_stats) {
+        TraceStats *stats = &vm.trace_stats;
+        fprintf(stderr, "trace: %d recorded, %d aborted, %llu side exits\n",
+                stats->recorded, stats->aborted,
+                (unsigned long long)stats->side_exits);
+    }
+
+    if (options->table_stats) {
+        print_table_stats("strings", &vm.strings);
+        print_table_stats("globals", &vm.globals);
+    }
+
+    source_file_close(&file);
     vm_free(&vm);
 
+    if (!verified)
+        return 1;
+
     switch (result) {
         case INTERPRET_OK:            return 0;
         case INTERPRET_COMPILE_ERROR: return 65;
@@ -35,12 +235,94 @@ static int run_file(const char *path) {
 }
 
 int main(int argc, const char *argv[]) {
-    switch (argc) {
-        case 1: return repl();
-        case 2: return run_file(argv[1]);
+    Options options = {
+        .cache = false,
+        .stats = false,
+        .gc_stats = false,
+        .table_stats = false,
+        .gc_growth_factor = 0,
+        .lex_threads = 0,
+        .optimize = false,
+        .registers = false,
+        .jit = false,
+        .jit_verify = false,
+        .trace = false,
+        .trace_threshold = 0,
+        .trace_stats = false,
+        .emit_c = false,
+        .ngrams = 0,
+    };
+    const char *path = NULL;
 
-        default:
-            fprintf(stderr, "usage: %s [path]\n", argv[0]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0) {
+            options.optimize = true;
+        }
+        else if (strcmp(argv[i], "--registers") == 0) {
+            options.registers = true;
+        }
+        else if (strcmp(argv[i], "--jit") == 0) {
+            options.jit = true;
+        }
+        else if (strcmp(argv[i], "--jit-verify") == 0) {
+            options.jit_verify = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            options.trace = true;
+        }
+        else if (strcmp(argv[i], "--trace-stats") == 0) {
+            options.trace_stats = true;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0) {
+            options.emit_c = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            options.cache = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = true;
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0) {
+            options.gc_stats = true;
+        }
+        else if (strcmp(argv[i], "--table-stats") == 0) {
+            options.table_stats = true;
+        }
+        else if (strncmp(argv[i], "--gc-growth=", 12) == 0 &&
+                 atof(argv[i] + 12) > 1) {
+            options.gc_growth_factor = atof(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "--trace-threshold=", 18) == 0 &&
+                 atoi(argv[i] + 18) > 0) {
+            options.trace_threshold = atoi(argv[i] + 18);
+        }
+        else if (strncmp(argv[i], "--lex-threads=", 14) == 0 &&
+                 atoi(argv[i] + 14) > 0) {
+            options.lex_threads = atoi(argv[i] + 14);
+        }
+        else if (strncmp(argv[i], "--ngrams=", 9) == 0 &&
+                 atoi(argv[i] + 9) > 0 && atoi(argv[i] + 9) <= NGRAM_MAX) {
+            options.ngrams = atoi(argv[i] + 9);
+        }
+        else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) &&
+                 path == NULL) {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr,
+                    "usage: %s [-O] [--registers] [--jit] [--jit-verify] "
+                    "[--trace] [--trace-threshold=n]\n"
+                    "          [--trace-stats] [--emit-c] [--cache] [--stats] "
+                    "[--gc-stats]\n"
+                    "          [--gc-growth=factor] [--table-stats] "
+                    "[--lex-threads=n] [--ngrams=n]\n"
+                    "          [path | -]\n", argv[0]);
             return 64;
+        }
     }
+
+    if (path == NULL)
+        return repl();
+
+    return run_file(path, &options);
 }
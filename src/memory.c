@@ -1,7 +1,41 @@
+#include <stdio.h>
 #include <stdlib.h>
+
 #include "memory.h"
+#include "utils.h"
+#include "vm.h"
+
+// Allocations are charged to the VM that was bound last, it is the one whose
+// collector may run when its heap outgrows VM.next_gc.
+static VM *bound_vm = NULL;
+
+void memory_bind(VM *vm) {
+    bound_vm = vm;
+}
+
+static void account(VM *vm, size_t old_size, size_t new_size) {
+    if (vm == NULL)
+        return;
+
+    if (new_size > old_size) {
+        vm->bytes_allocated += new_size - old_size;
+#ifdef DEBUG_STRESS_GC
+        collect_garbage(vm);
+#else
+        if (vm->bytes_allocated > vm->next_gc)
+            collect_garbage(vm);
+#endif
+    }
+    else {
+        size_t freed = old_size - new_size;
+        vm->bytes_allocated -=
+            freed < vm->bytes_allocated ? freed : vm->bytes_allocated;
+    }
+}
 
 void *reallocate(void *pointer, size_t old_size, size_t new_size) {
+    account(bound_vm, old_size, new_size);
+
     if (new_size == 0) {
         free(pointer);
         return NULL;
@@ -15,21 +49,195 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size) {
     return result;
 }
 
-static void free_object(Obj *object) {
+void *allocate_pooled(VM *vm, size_t size) {
+    account(vm, 0, size);
+
+    if (size <= POOL_MAX_SIZE)
+        return pool_alloc(&vm->pool, size);
+
+    void *result = malloc(size);
+    if (result == NULL)
+        exit(1);
+
+    return result;
+}
+
+void free_pooled(VM *vm, void *pointer, size_t size) {
+    account(vm, size, 0);
+
+    if (size <= POOL_MAX_SIZE)
+        pool_release(&vm->pool, pointer, size);
+    else
+        free(pointer);
+}
+
+void mark_object(VM *vm, Obj *object) {
+    if (object == NULL || object->is_marked)
+        return;
+
+    object->is_marked = true;
+
+    // the gray stack lives outside of the managed heap so that growing it
+    // can't start another collection
+    if (vm->gray_len + 1 > vm->gray_cap) {
+        vm->gray_cap = GROW_CAPACITY(vm->gray_cap);
+        vm->gray_stack = realloc(vm->gray_stack, sizeof(Obj *) * vm->gray_cap);
+        if (vm->gray_stack == NULL)
+            exit(1);
+    }
+
+    vm->gray_stack[vm->gray_len++] = object;
+}
+
+void mark_value(VM *vm, Value value) {
+    if (IS_OBJ(value))
+        mark_object(vm, AS_OBJ(value));
+}
+
+static void mark_array(VM *vm, ValueArray *array) {
+    for (int i = 0; i < array->len; i++)
+        mark_value(vm, array->values[i]);
+}
+
+static void mark_table(VM *vm, Table *table) {
+    for (int i = 0; i < table->cap; i++) {
+        Entry *entry = &table->entries[i];
+        mark_object(vm, (Obj *)entry->key);
+        mark_value(vm, entry->value);
+    }
+}
+
+static void blacken_object(VM *vm, Obj *object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            break;
+        case OBJ_ROPE: {
+            ObjRope *rope = (ObjRope *)object;
+            mark_object(vm, rope->left);
+            mark_object(vm, rope->right);
+            mark_object(vm, (Obj *)rope->flat);
+            break;
+        }
+    }
+}
+
+// The chunk being compiled belongs to a script that is already linked into
+// vm->scripts, so constants the compiler has added are covered by the script
+// list. Values the compiler or the runtime hold in C locals while allocating
+// are kept on the VM stack for the duration.
+static void mark_roots(VM *vm) {
+    for (Value *slot = vm->stack; slot < vm->sp; slot++)
+        mark_value(vm, *slot);
+
+    mark_table(vm, &vm->globals);
+    mark_array(vm, &vm->global_names);
+    mark_array(vm, &vm->global_values);
+
+    for (Script *script = vm->scripts; script != NULL; script = script->next)
+        mark_array(vm, &script->chunk.constants);
+}
+
+static void trace_references(VM *vm) {
+    while (vm->gray_len > 0) {
+        Obj *object = vm->gray_stack[--vm->gray_len];
+        blacken_object(vm, object);
+    }
+}
+
+static void free_object(VM *vm, Obj *object) {
     switch (object->type) {
         case OBJ_STRING: {
             ObjString *string = (ObjString *)object;
-            FREE_ARRAY(char, string->data, string->len + 1);
-            FREE(ObjString, string);
+            free_pooled(vm, string, STRING_SIZE(string->len));
+            break;
         }
+        case OBJ_ROPE:
+            free_pooled(vm, object, sizeof(ObjRope));
+            break;
     }
 }
 
-void free_objects(Obj *objects) {
-    Obj *object = objects;
+static void sweep(VM *vm) {
+    Obj *previous = NULL;
+    Obj *object = vm->objects;
+
+    while (object != NULL) {
+        if (object->is_marked) {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        Obj *unreached = object;
+        object = object->next;
+
+        if (previous != NULL)
+            previous->next = object;
+        else
+            vm->objects = object;
+
+        free_object(vm, unreached);
+    }
+}
+
+void collect_garbage(VM *vm) {
+    double start = wall_seconds();
+    size_t before = vm->bytes_allocated;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    mark_roots(vm);
+    trace_references(vm);
+    table_remove_white(&vm->strings);
+    sweep(vm);
+
+    vm->next_gc = (size_t)(vm->bytes_allocated * vm->gc_growth_factor);
+    if (vm->next_gc < GC_INITIAL_HEAP)
+        vm->next_gc = GC_INITIAL_HEAP;
+
+    double pause = wall_seconds() - start;
+    vm->gc_stats.collections++;
+    vm->gc_stats.bytes_freed += before - vm->bytes_allocated;
+    vm->gc_stats.total_pause += pause;
+    if (pause > vm->gc_stats.max_pause)
+        vm->gc_stats.max_pause = pause;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end, collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->bytes_allocated, before, vm->bytes_allocated,
+           vm->next_gc);
+#endif
+}
+
+// Everything that fit into the pool goes away with its slab, only the
+// objects that were too large for it are released one by one.
+static void free_large(Obj *object) {
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *)object;
+            if (STRING_SIZE(string->len) > POOL_MAX_SIZE)
+                free(string);
+            break;
+        }
+        case OBJ_ROPE:
+            break;
+    }
+}
+
+void free_objects(VM *vm) {
+    Obj *object = vm->objects;
     while (object != NULL) {
         Obj *next = object->next;
-        free_object(object);
+        free_large(object);
         object = next;
     }
+
+    pool_free(&vm->pool);
+    vm->objects = NULL;
+    free(vm->gray_stack);
+    vm->gray_stack = NULL;
+    vm->gray_len = vm->gray_cap = 0;
 }
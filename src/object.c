@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -5,44 +7,139 @@
 #include "utils.h"
 #include "value.h"
 
-#define ALLOCATE_OBJ(vm, type, object_type)                                    \
-    (type *)allocate_obj(vm, sizeof(type), object_type)
-
-static Obj *allocate_obj(VM *vm, size_t size, ObjType object_type) {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+static void link_object(VM *vm, Obj *object, ObjType object_type) {
     object->type = object_type;
+    object->is_marked = false;
     object->next = vm->objects;
     vm->objects = object;
-    return object;
 }
 
-static ObjString *allocate_string(VM *vm, char *data, int len, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
-    string->len = len;
-    string->data = data;
-    string->hash = hash;
+static ObjString *intern_string(VM *vm, ObjString *string) {
+    link_object(vm, (Obj *)string, OBJ_STRING);
+
+    vm_stack_push(vm, OBJ_VAL(string));
     table_set(&vm->strings, string, NIL_VAL);
+    vm_stack_pop(vm);
+
     return string;
 }
 
-ObjString *take_string(VM *vm, char *data, int len) {
-    uint32_t hash = hash_string(data, len);
-    ObjString *interned = table_find_string(&vm->strings, data, len, hash);
+ObjString *reserve_string(VM *vm, int len) {
+    ObjString *string = (ObjString *)allocate_pooled(vm, STRING_SIZE(len));
+    string->len = len;
+    string->data[len] = '\0';
+    return string;
+}
+
+ObjString *take_string(VM *vm, ObjString *string) {
+    string->hash = hash_string(string->data, string->len, vm->hash_seed);
+    ObjString *interned = table_find_string(
+        &vm->strings, string->data, string->len, string->hash);
+
     if (interned != NULL) {
-        FREE_ARRAY(char, data, len + 1);
+        // never linked into vm->objects, so it can go straight back
+        free_pooled(vm, string, STRING_SIZE(string->len));
         return interned;
     }
 
-    return allocate_string(vm, data, len, hash);
+    return intern_string(vm, string);
 }
 
 ObjString *copy_string(VM *vm, const char *data, int len) {
-    uint32_t hash = hash_string(data, len);
+    uint32_t hash = hash_string(data, len, vm->hash_seed);
     ObjString *interned = table_find_string(&vm->strings, data, len, hash);
     if (interned != NULL) return interned;
 
-    char *heap_chars = ALLOCATE(char, len + 1);
-    memcpy(heap_chars, data, len);
-    heap_chars[len] = '\0';
-    return allocate_string(vm, heap_chars, len, hash);
+    ObjString *string = reserve_string(vm, len);
+    memcpy(string->data, data, len);
+    string->hash = hash;
+    return intern_string(vm, string);
+}
+
+// a rope that has already been flattened stands in for its string
+static Obj *rope_child(Obj *text) {
+    if (text->type == OBJ_ROPE && ((ObjRope *)text)->flat != NULL)
+        return (Obj *)((ObjRope *)text)->flat;
+    return text;
+}
+
+static int rope_depth(Obj *text) {
+    return text->type == OBJ_ROPE ? ((ObjRope *)text)->depth : 0;
+}
+
+ObjRope *concat_rope(VM *vm, Obj *left, Obj *right) {
+    ObjRope *rope = (ObjRope *)allocate_pooled(vm, sizeof(ObjRope));
+    link_object(vm, (Obj *)rope, OBJ_ROPE);
+
+    rope->left = rope_child(left);
+    rope->right = rope_child(right);
+    rope->len = text_length(rope->left) + text_length(rope->right);
+    rope->flat = NULL;
+
+    int depth = rope_depth(rope->left);
+    if (rope_depth(rope->right) > depth)
+        depth = rope_depth(rope->right);
+    rope->depth = depth + 1;
+
+    return rope;
+}
+
+// Calls `visit` on the leaves of `rope` from left to right. Ropes built in a
+// loop are thousands of levels deep, so the walk keeps the right halves it
+// still has to visit on an explicit stack instead of recursing. The stack
+// lives outside of the managed heap, this can't start a collection.
+static void walk_rope(ObjRope *rope,
+                      void (*visit)(ObjString *leaf, void *data), void *data) {
+    Obj **pending = malloc(sizeof(Obj *) * rope->depth);
+    if (pending == NULL)
+        exit(1);
+
+    int pending_len = 0;
+    Obj *node = (Obj *)rope;
+
+    for (;;) {
+        node = rope_child(node);
+
+        if (node->type == OBJ_ROPE) {
+            pending[pending_len++] = ((ObjRope *)node)->right;
+            node = ((ObjRope *)node)->left;
+            continue;
+        }
+
+        visit((ObjString *)node, data);
+
+        if (pending_len == 0)
+            break;
+        node = pending[--pending_len];
+    }
+
+    free(pending);
+}
+
+static void append_leaf(ObjString *leaf, void *data) {
+    char **end = data;
+    memcpy(*end, leaf->data, leaf->len);
+    *end += leaf->len;
+}
+
+ObjString *flatten_rope(VM *vm, ObjRope *rope) {
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    ObjString *string = reserve_string(vm, rope->len);
+    char *end = string->data;
+    walk_rope(rope, append_leaf, &end);
+
+    rope->flat = take_string(vm, string);
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+static void print_leaf(ObjString *leaf, void *data) {
+    fwrite(leaf->data, 1, leaf->len, (FILE *)data);
+}
+
+void print_rope(FILE *file, ObjRope *rope) {
+    walk_rope(rope, print_leaf, file);
 }
@@ -0,0 +1,541 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "memory.h"
+
+// Jumps are decoded into instruction indices so that instructions can be
+// removed and moved freely, they are turned back into offsets at the end.
+// OP_JUMP and OP_LOOP are the same instruction here and get encoded as
+// whichever the direction calls for.
+typedef struct {
+    uint8_t op;
+    uint8_t operands[2];
+    int size;
+    int line;
+    int target;
+    int offset;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    int first;
+    int last;
+    bool reachable;
+} Block;
+
+typedef struct {
+    Instruction *code;
+    int len;
+    // how many live jumps land on each instruction
+    int *targeted;
+    Block *blocks;
+    int *block_of;
+    int block_count;
+} Graph;
+
+// upper bound on the rewriting rounds, each one usually enables a few more
+#define MAX_ROUNDS 8
+
+static bool is_jump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool is_unconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+static bool ends_block(uint8_t op) {
+    return is_jump(op) || op == OP_RETURN;
+}
+
+static bool decode(Graph *graph, Chunk *chunk) {
+    int *index_of = ALLOCATE(int, chunk->len + 1);
+    for (int i = 0; i <= chunk->len; i++)
+        index_of[i] = -1;
+
+    graph->len = 0;
+    graph->code = ALLOCATE(Instruction, chunk->len);
+
+    for (int offset = 0; offset < chunk->len;) {
+        Instruction *instruction = &graph->code[graph->len];
+        uint8_t *code = &chunk->code[offset];
+
+        instruction->op = code[0];
+        instruction->size = chunk_opcode_size(code[0]);
+        instruction->line = chunk->line[offset];
+        instruction->offset = offset;
+        instruction->target = -1;
+        instruction->removed = false;
+        memcpy(instruction->operands, code + 1, instruction->size - 1);
+
+        index_of[offset] = graph->len++;
+        offset += instruction->size;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < graph->len && ok; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (!is_jump(instruction->op))
+            continue;
+
+        int jump = instruction->operands[0] << 8 | instruction->operands[1];
+        int next = instruction->offset + 3;
+        int target = instruction->op == OP_LOOP ? next - jump : next + jump;
+
+        if (target < 0 || target >= chunk->len || index_of[target] == -1)
+            ok = false;
+        else
+            instruction->target = index_of[target];
+    }
+
+    FREE_ARRAY(int, index_of, chunk->len + 1);
+    return ok;
+}
+
+// the instruction that runs when control reaches `index`
+static int resolve(Graph *graph, int index) {
+    while (index < graph->len && graph->code[index].removed)
+        index++;
+    return index;
+}
+
+static int next_live(Graph *graph, int index) {
+    return resolve(graph, index + 1);
+}
+
+static void count_targets(Graph *graph) {
+    memset(graph->targeted, 0, sizeof(int) * (graph->len + 1));
+
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (!instruction->removed && is_jump(instruction->op))
+            graph->targeted[resolve(graph, instruction->target)]++;
+    }
+}
+
+static void set_target(Instruction *instruction, uint8_t op, int target) {
+    instruction->op = op;
+    instruction->size = 3;
+    instruction->target = target;
+}
+
+static bool thread_jumps(Graph *graph) {
+    bool changed = false;
+
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed || !is_jump(instruction->op))
+            continue;
+
+        int target = resolve(graph, instruction->target);
+
+        // a chain of jumps may close into a loop, never follow it further
+        // than there are instructions
+        for (int steps = 0; steps < graph->len && target < graph->len; steps++) {
+            Instruction *next = &graph->code[target];
+            int through;
+
+            if (is_unconditional(next->op))
+                through = next->target;
+            // the value tested by OP_JUMP_IF_FALSE is still on the stack and
+            // fails the next test on it as well
+            else if (instruction->op == OP_JUMP_IF_FALSE &&
+                     next->op == OP_JUMP_IF_FALSE)
+                through = next->target;
+            else
+                break;
+
+            through = resolve(graph, through);
+            // only OP_JUMP and OP_LOOP can go backwards
+            if (!is_unconditional(instruction->op) && through <= i)
+                break;
+
+            target = through;
+        }
+
+        if (target != instruction->target) {
+            instruction->target = target;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool constant_condition(Instruction *instruction, Chunk *chunk,
+                               bool *truthy) {
+    switch (instruction->op) {
+        case OP_NIL:   *truthy = false; return true;
+        case OP_TRUE:  *truthy = true;  return true;
+        case OP_FALSE: *truthy = false; return true;
+
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            int index = instruction->op == OP_CONSTANT
+                ? instruction->operands[0]
+                : instruction->operands[0] << 8 | instruction->operands[1];
+            *truthy = !value_is_falsy(chunk->constants.values[index]);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+// Rewrite the branches that test a constant pushed right before them, and
+// fuse a test with the OP_POP that both of its successors start with. The
+// target counts are kept up to date as jumps are added or moved.
+static bool fold_branches(Graph *graph, Chunk *chunk) {
+    bool changed = false;
+    count_targets(graph);
+
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed || instruction->op != OP_JUMP_IF_FALSE)
+            continue;
+
+        int target = resolve(graph, instruction->target);
+        int next = next_live(graph, i);
+        bool pop_next = next < graph->len && graph->code[next].op == OP_POP &&
+                        graph->targeted[next] == 0;
+        bool pop_target = target < graph->len &&
+                          graph->code[target].op == OP_POP;
+
+        int previous = i - 1;
+        while (previous >= 0 && graph->code[previous].removed)
+            previous--;
+
+        // the constant decides the branch only if nothing else jumps to it
+        bool truthy;
+        if (previous >= 0 && graph->targeted[i] == 0 &&
+            constant_condition(&graph->code[previous], chunk, &truthy)) {
+            Instruction *constant = &graph->code[previous];
+
+            if (truthy && pop_next) {
+                // push, never jump, pop
+                constant->removed = true;
+                instruction->removed = true;
+                graph->code[next].removed = true;
+                graph->targeted[next_live(graph, next)] +=
+                    graph->targeted[previous];
+            }
+            else if (truthy) {
+                instruction->removed = true;
+            }
+            else if (pop_target) {
+                // jumps straight past the pop the constant was pushed for,
+                // anything jumping to the constant follows along
+                set_target(constant, OP_JUMP, next_live(graph, target));
+                graph->targeted[constant->target]++;
+                instruction->removed = true;
+            }
+            else {
+                set_target(instruction, OP_JUMP, target);
+            }
+
+            changed = true;
+        }
+        else if (pop_next && pop_target) {
+            set_target(instruction, OP_POP_JUMP_IF_FALSE,
+                       next_live(graph, target));
+            graph->targeted[instruction->target]++;
+            graph->code[next].removed = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool remove_jumps_to_next(Graph *graph) {
+    bool changed = false;
+
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed ||
+            (!is_unconditional(instruction->op) &&
+             instruction->op != OP_JUMP_IF_FALSE &&
+             instruction->op != OP_POP_JUMP_IF_FALSE) ||
+            resolve(graph, instruction->target) != next_live(graph, i))
+            continue;
+
+        // the test of OP_POP_JUMP_IF_FALSE goes away but not its pop
+        if (instruction->op == OP_POP_JUMP_IF_FALSE) {
+            instruction->op = OP_POP;
+            instruction->size = 1;
+            instruction->target = -1;
+        }
+        else {
+            instruction->removed = true;
+        }
+
+        changed = true;
+    }
+
+    return changed;
+}
+
+static void build_blocks(Graph *graph) {
+    count_targets(graph);
+    graph->block_count = 0;
+
+    bool leader = true;
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed)
+            continue;
+
+        if (leader || graph->targeted[i] > 0) {
+            graph->blocks[graph->block_count++] = (Block){i, i, false};
+        }
+
+        graph->blocks[graph->block_count - 1].last = i;
+        graph->block_of[i] = graph->block_count - 1;
+        leader = ends_block(instruction->op);
+    }
+}
+
+static bool remove_unreachable(Graph *graph) {
+    build_blocks(graph);
+    if (graph->block_count == 0)
+        return false;
+
+    // every block is pushed at most once, when it is first reached
+    int *worklist = ALLOCATE(int, graph->block_count);
+    int count = 0;
+
+    graph->blocks[0].reachable = true;
+    worklist[count++] = 0;
+
+    while (count > 0) {
+        Block *block = &graph->blocks[worklist[--count]];
+        Instruction *last = &graph->code[block->last];
+        int successors[2];
+        int successor_count = 0;
+
+        if (is_jump(last->op)) {
+            int target = resolve(graph, last->target);
+            if (target < graph->len)
+                successors[successor_count++] = graph->block_of[target];
+        }
+        if (!is_unconditional(last->op) && last->op != OP_RETURN) {
+            int next = next_live(graph, block->last);
+            if (next < graph->len)
+                successors[successor_count++] = graph->block_of[next];
+        }
+
+        for (int i = 0; i < successor_count; i++) {
+            if (!graph->blocks[successors[i]].reachable) {
+                graph->blocks[successors[i]].reachable = true;
+                worklist[count++] = successors[i];
+            }
+        }
+    }
+
+    FREE_ARRAY(int, worklist, graph->block_count);
+
+    bool changed = false;
+    for (int b = 0; b < graph->block_count; b++) {
+        Block *block = &graph->blocks[b];
+        if (block->reachable)
+            continue;
+
+        for (int i = block->first; i <= block->last; i++)
+            graph->code[i].removed = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Collect up to `count` live instructions starting at `first`, none but the
+// first may be a jump target.
+static int sequence(Graph *graph, int first, Instruction **out, int count) {
+    int found = 0;
+    for (int i = first; i < graph->len && found < count; i++) {
+        if (graph->code[i].removed)
+            continue;
+        if (found > 0 && graph->targeted[i] > 0)
+            break;
+        out[found++] = &graph->code[i];
+    }
+    return found;
+}
+
+// `raising` is the part whose line errors are reported on
+static void fuse(Instruction **parts, int count, int raising, uint8_t op,
+                 int size, uint8_t a, uint8_t b) {
+    Instruction *fused = parts[0];
+    fused->line = parts[raising]->line;
+    fused->op = op;
+    fused->size = size;
+    fused->operands[0] = a;
+    fused->operands[1] = b;
+
+    for (int i = 1; i < count; i++)
+        parts[i]->removed = true;
+}
+
+// Replace the sequences that show up most in loops with superinstructions:
+//
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD, OP_SET_LOCAL a, OP_POP
+//                                       -> OP_INCREMENT_LOCAL a k
+//   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+//                                       -> OP_ADD_LOCALS a b
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD or OP_SUBTRACT
+//                                       -> OP_ADD/SUBTRACT_LOCAL_CONSTANT a k
+//   OP_CONSTANT k, OP_ADD or OP_SUBTRACT
+//                                       -> OP_ADD/SUBTRACT_CONSTANT k
+//   OP_EQUAL, OP_GREATER or OP_LESS, OP_POP_JUMP_IF_FALSE
+//                                       -> OP_JUMP_IF_NOT_EQUAL/GREATER/LESS
+static void fuse_instructions(Graph *graph) {
+    count_targets(graph);
+
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *parts[5];
+        int count = sequence(graph, i, parts, 5);
+        if (count < 2 || parts[0] != &graph->code[i])
+            continue;
+
+        uint8_t ops[5] = {0};
+        for (int j = 0; j < count; j++)
+            ops[j] = parts[j]->op;
+
+        if (count == 5 && ops[0] == OP_GET_LOCAL && ops[1] == OP_CONSTANT &&
+            ops[2] == OP_ADD && ops[3] == OP_SET_LOCAL && ops[4] == OP_POP &&
+            parts[0]->operands[0] == parts[3]->operands[0]) {
+            fuse(parts, 5, 2, OP_INCREMENT_LOCAL, 3,
+                 parts[0]->operands[0], parts[1]->operands[0]);
+        }
+        else if (count >= 3 && ops[0] == OP_GET_LOCAL &&
+                 ops[1] == OP_GET_LOCAL && ops[2] == OP_ADD) {
+            fuse(parts, 3, 2, OP_ADD_LOCALS, 3,
+                 parts[0]->operands[0], parts[1]->operands[0]);
+        }
+        else if (count >= 3 && ops[0] == OP_GET_LOCAL &&
+                 ops[1] == OP_CONSTANT &&
+                 (ops[2] == OP_ADD || ops[2] == OP_SUBTRACT)) {
+            fuse(parts, 3, 2, ops[2] == OP_ADD
+                     ? OP_ADD_LOCAL_CONSTANT : OP_SUBTRACT_LOCAL_CONSTANT,
+                 3, parts[0]->operands[0], parts[1]->operands[0]);
+        }
+        else if (ops[0] == OP_CONSTANT &&
+                 (ops[1] == OP_ADD || ops[1] == OP_SUBTRACT)) {
+            fuse(parts, 2, 1, ops[1] == OP_ADD
+                     ? OP_ADD_CONSTANT : OP_SUBTRACT_CONSTANT,
+                 2, parts[0]->operands[0], 0);
+        }
+        else if (ops[1] == OP_POP_JUMP_IF_FALSE &&
+                 (ops[0] == OP_EQUAL || ops[0] == OP_GREATER ||
+                  ops[0] == OP_LESS)) {
+            int target = parts[1]->target;
+            fuse(parts, 2, 0, ops[0] == OP_EQUAL   ? OP_JUMP_IF_NOT_EQUAL
+                         : ops[0] == OP_GREATER ? OP_JUMP_IF_NOT_GREATER
+                                                : OP_JUMP_IF_NOT_LESS,
+                 3, 0, 0);
+            parts[0]->target = target;
+        }
+    }
+}
+
+static bool encode(Graph *graph, Chunk *chunk) {
+    int len = 0;
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed)
+            continue;
+
+        if (is_unconditional(instruction->op))
+            instruction->op = OP_JUMP;
+        instruction->offset = len;
+        len += instruction->size;
+    }
+
+    // a jump never lands behind the last instruction, it ends in OP_RETURN or
+    // a loop
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed || !is_jump(instruction->op))
+            continue;
+
+        int target = resolve(graph, instruction->target);
+        if (target >= graph->len)
+            return false;
+
+        int jump = graph->code[target].offset - (instruction->offset + 3);
+        if (jump < 0) {
+            instruction->op = OP_LOOP;
+            jump = -jump;
+        }
+        if (jump > UINT16_MAX)
+            return false;
+
+        instruction->operands[0] = (jump >> 8) & 0xff;
+        instruction->operands[1] = (jump >> 0) & 0xff;
+    }
+
+    // the code only ever shrinks, write it back in place
+    chunk->len = 0;
+    for (int i = 0; i < graph->len; i++) {
+        Instruction *instruction = &graph->code[i];
+        if (instruction->removed)
+            continue;
+
+        chunk->code[chunk->len] = instruction->op;
+        chunk->line[chunk->len] = instruction->line;
+        for (int j = 1; j < instruction->size; j++) {
+            chunk->code[chunk->len + j] = instruction->operands[j - 1];
+            chunk->line[chunk->len + j] = instruction->line;
+        }
+        chunk->len += instruction->size;
+    }
+
+    return true;
+}
+
+void optimize_chunk(Chunk *chunk) {
+    int len = chunk->len;
+    if (len == 0)
+        return;
+
+    Graph graph;
+    if (!decode(&graph, chunk)) {
+        FREE_ARRAY(Instruction, graph.code, len);
+        return;
+    }
+
+    graph.targeted = ALLOCATE(int, graph.len + 1);
+    graph.blocks = ALLOCATE(Block, graph.len);
+    graph.block_of = ALLOCATE(int, graph.len);
+
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool changed = thread_jumps(&graph);
+        changed |= fold_branches(&graph, chunk);
+        changed |= remove_jumps_to_next(&graph);
+        changed |= remove_unreachable(&graph);
+
+        if (!changed)
+            break;
+    }
+
+    fuse_instructions(&graph);
+    encode(&graph, chunk);
+
+    FREE_ARRAY(int, graph.block_of, graph.len);
+    FREE_ARRAY(Block, graph.blocks, graph.len);
+    FREE_ARRAY(int, graph.targeted, graph.len + 1);
+    FREE_ARRAY(Instruction, graph.code, len);
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+
+#include "parser.h"
+
+void parser_init(Parser *parser, const char *source, TokenStream *tokens) {
+    parser->had_error = false;
+    parser->panic_mode = false;
+    scanner_init(&parser->scanner, source);
+    parser->tokens = tokens;
+    parser->next_token = 0;
+}
+
+void parser_error_at(Parser *parser, Token *token, const char *message) {
+    if (parser->panic_mode)
+        return;
+
+    parser->had_error = true;
+    parser->panic_mode = true;
+
+    fprintf(stderr, "[line %d] Error", token->line);
+
+    switch (token->type) {
+        case TOKEN_EOF:
+            fprintf(stderr, " at end"); break;
+        case TOKEN_ERROR:
+            break;
+        default:
+            fprintf(stderr, " at '%.*s'", token->length, token->start);
+    }
+
+    fprintf(stderr, ": %s\n", message);
+}
+
+void parser_error_at_current(Parser *parser, const char *message) {
+    parser_error_at(parser, &parser->curr, message);
+}
+
+void parser_advance(Parser *parser) {
+    parser->prev = parser->curr;
+
+    for (;;) {
+        if (parser->tokens != NULL) {
+            parser->curr = token_stream_get(parser->tokens, parser->next_token);
+            // stay on the final TOKEN_EOF like the scanner does
+            if (parser->next_token + 1 < parser->tokens->len)
+                parser->next_token++;
+        }
+        else {
+            parser->curr = scanner_scan_token(&parser->scanner);
+        }
+
+        if (parser->curr.type != TOKEN_ERROR) break;
+
+        parser_error_at_current(parser, parser->curr.start);
+    }
+}
+
+void parser_consume(Parser *parser, TokenType type, const char *message) {
+    if (parser->curr.type == type) {
+        parser_advance(parser);
+        return;
+    }
+
+    parser_error_at_current(parser, message);
+}
+
+bool parser_check(Parser *parser, TokenType type) {
+    return parser->curr.type == type;
+}
+
+bool parser_match(Parser *parser, TokenType type) {
+    if (parser_check(parser, type)) {
+        parser_advance(parser);
+        return true;
+    }
+
+    return false;
+}
+
+void parser_synchronize(Parser *parser) {
+    parser->panic_mode = false;
+
+    while (parser->curr.type != TOKEN_EOF) {
+        if (parser->prev.type == TOKEN_SEMICOLON)
+            return;
+
+        switch (parser->prev.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FN:
+            case TOKEN_LET:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+                return;
+
+            default:
+                ;
+        }
+
+        parser_advance(parser);
+    }
+}
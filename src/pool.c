@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+// Slabs are cache line aligned and blocks start one line in, so blocks of
+// up to 64 bytes never straddle two lines.
+#define CACHE_LINE 64
+#define SLAB_HEADER CACHE_LINE
+
+static int size_class(size_t size) {
+    int class = 0;
+    while ((size_t)(POOL_MIN_SIZE << class) < size)
+        class++;
+    return class;
+}
+
+void pool_init(Pool *pool) {
+    for (int i = 0; i < POOL_CLASSES; i++)
+        pool->free_lists[i] = NULL;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+}
+
+void pool_free(Pool *pool) {
+    PoolSlab *slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    pool_init(pool);
+}
+
+// A fresh slab is given to a single class and threaded onto its free list
+// in address order, so consecutive allocations end up next to each other.
+static void pool_grow(Pool *pool, int class) {
+    PoolSlab *slab = aligned_alloc(CACHE_LINE, POOL_SLAB_SIZE);
+    if (slab == NULL)
+        exit(1);
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+
+    size_t block_size = (size_t)POOL_MIN_SIZE << class;
+    char *start = (char *)slab + SLAB_HEADER;
+    size_t count = (POOL_SLAB_SIZE - SLAB_HEADER) / block_size;
+
+    PoolBlock *head = pool->free_lists[class];
+    for (size_t i = count; i > 0; i--) {
+        PoolBlock *block = (PoolBlock *)(start + (i - 1) * block_size);
+        block->next = head;
+        head = block;
+    }
+
+    pool->free_lists[class] = head;
+}
+
+void *pool_alloc(Pool *pool, size_t size) {
+    int class = size_class(size);
+
+    if (pool->free_lists[class] == NULL)
+        pool_grow(pool, class);
+
+    PoolBlock *block = pool->free_lists[class];
+    pool->free_lists[class] = block->next;
+    return block;
+}
+
+void pool_release(Pool *pool, void *pointer, size_t size) {
+    int class = size_class(size);
+
+    PoolBlock *block = pointer;
+    block->next = pool->free_lists[class];
+    pool->free_lists[class] = block;
+}
@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "regchunk.h"
+#include "memory.h"
+
+void reg_chunk_init(RegChunk *chunk) {
+    chunk->len = 0;
+    chunk->cap = 0;
+    chunk->code = NULL;
+    chunk->line = NULL;
+    chunk->registers = 0;
+}
+
+void reg_chunk_free(RegChunk *chunk) {
+    FREE_ARRAY(uint32_t, chunk->code, chunk->cap);
+    FREE_ARRAY(int, chunk->line, chunk->cap);
+    reg_chunk_init(chunk);
+}
+
+void reg_chunk_push(RegChunk *chunk, uint32_t instruction, int line) {
+    if (chunk->len + 1 >= chunk->cap) {
+        int old_cap = chunk->cap;
+        chunk->cap  = GROW_CAPACITY(old_cap);
+        chunk->code = GROW_ARRAY(uint32_t, chunk->code, old_cap, chunk->cap);
+        chunk->line = GROW_ARRAY(int, chunk->line, old_cap, chunk->cap);
+    }
+
+    chunk->code[chunk->len] = instruction;
+    chunk->line[chunk->len] = line;
+    chunk->len++;
+}
+
+// Jumps are relative, the caller makes sure none crosses `offset`.
+void reg_chunk_insert(RegChunk *chunk, int offset, uint32_t instruction,
+                      int line) {
+    reg_chunk_push(chunk, instruction, line);
+
+    int moved = chunk->len - 1 - offset;
+    memmove(&chunk->code[offset + 1], &chunk->code[offset],
+            moved * sizeof(uint32_t));
+    memmove(&chunk->line[offset + 1], &chunk->line[offset],
+            moved * sizeof(int));
+
+    chunk->code[offset] = instruction;
+    chunk->line[offset] = line;
+}
+
+bool reg_opcode_writes_a(uint8_t opcode) {
+    switch (opcode) {
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+        case ROP_PRINT:
+        case ROP_JUMP:
+        case ROP_JUMP_IF_FALSE:
+        case ROP_JUMP_IF_TRUE:
+        case ROP_LOOP:
+        case ROP_RETURN:
+            return false;
+
+        default:
+            return true;
+    }
+}
@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regcompiler.h"
+#include "debug.h"
+#include "object.h"
+#include "value.h"
+
+static void reg_compiler_init(RegCompiler *compiler, Chunk *constants,
+                              RegChunk *chunk) {
+    compiler->local_count = 0;
+    compiler->scope_depth = 0;
+    compiler->chunk = chunk;
+    compiler->constants = constants;
+    compiler->next_register = 0;
+    compiler->max_registers = 0;
+    compiler->jump_target = 0;
+    compiler->local_writes = 0;
+}
+
+static void state_init(RegState *state, const char *source, VM *vm,
+                       Chunk *constants, RegChunk *chunk,
+                       TokenStream *tokens) {
+    state->vm = vm;
+    parser_init(&state->parser, source, tokens);
+    reg_compiler_init(&state->compiler, constants, chunk);
+}
+
+static void error_at(RegState *state, Token *token, const char *message) {
+    parser_error_at(&state->parser, token, message);
+}
+
+static void error_at_current(RegState *state, const char *message) {
+    parser_error_at_current(&state->parser, message);
+}
+
+static void advance(RegState *state) {
+    parser_advance(&state->parser);
+}
+
+static void consume(RegState *state, TokenType type, const char *message) {
+    parser_consume(&state->parser, type, message);
+}
+
+static bool check(RegState *state, TokenType type) {
+    return parser_check(&state->parser, type);
+}
+
+static bool match(RegState *state, TokenType type) {
+    return parser_match(&state->parser, type);
+}
+
+static void emit(RegState *state, uint32_t instruction) {
+    reg_chunk_push(state->compiler.chunk, instruction, state->parser.prev.line);
+}
+
+static int emit_jump(RegState *state, RegOpCode opcode, int reg) {
+    emit(state, REG_ABX(opcode, reg, 0));
+    return state->compiler.chunk->len - 1;
+}
+
+static void emit_loop(RegState *state, int loop_start) {
+    int offset = state->compiler.chunk->len - loop_start + 1;
+    if (offset > UINT16_MAX)
+        error_at_current(state, "Loop body too large.");
+
+    emit(state, REG_ABX(ROP_LOOP, 0, offset & 0xffff));
+}
+
+static void patch_jump(RegState *state, int offset) {
+    RegChunk *chunk = state->compiler.chunk;
+    int jump = chunk->len - offset - 1;
+    if (jump > UINT16_MAX)
+        error_at_current(state, "Too much code to jump over.");
+
+    uint32_t instruction = chunk->code[offset];
+    chunk->code[offset] =
+        REG_ABX(REG_OP(instruction), REG_A(instruction), jump & 0xffff);
+    state->compiler.jump_target = chunk->len;
+}
+
+// Locals need no code to go away, their registers are simply reused.
+static void begin_scope(RegState *state) {
+    state->compiler.scope_depth++;
+}
+
+static void end_scope(RegState *state) {
+    RegCompiler *compiler = &state->compiler;
+    int depth = --compiler->scope_depth;
+
+    while (compiler->local_count > 0 &&
+           compiler->locals[compiler->local_count - 1].depth > depth)
+        compiler->local_count--;
+}
+
+static void emit_constant(RegState *state, int reg, Value value) {
+    // adding the constant may grow the pool and run the collector
+    vm_stack_push(state->vm, value);
+    int constant = chunk_add_constant(state->compiler.constants, value);
+    vm_stack_pop(state->vm);
+
+    if (constant > UINT16_MAX) {
+        error_at_current(state, "Too many constants in one chunk.");
+        return;
+    }
+
+    emit(state, REG_ABX(ROP_LOADK, reg, constant));
+}
+
+static bool is_temporary(RegState *state, int reg) {
+    return reg >= state->compiler.local_count;
+}
+
+static int allocate_register(RegState *state) {
+    RegCompiler *compiler = &state->compiler;
+    if (compiler->next_register > UINT8_MAX) {
+        error_at_current(state, "Too many registers.");
+        return UINT8_MAX;
+    }
+
+    int reg = compiler->next_register++;
+    if (compiler->next_register > compiler->max_registers)
+        compiler->max_registers = compiler->next_register;
+
+    return reg;
+}
+
+// Keep `reg` and release every temporary allocated after it.
+static void release_above(RegState *state, int reg) {
+    RegCompiler *compiler = &state->compiler;
+    compiler->next_register =
+        reg >= compiler->local_count ? reg + 1 : compiler->local_count;
+}
+
+static void release_temporaries(RegState *state) {
+    state->compiler.next_register = state->compiler.local_count;
+}
+
+// A temporary operand can take the result of the operation on it.
+static int result_register(RegState *state, int left, int right) {
+    if (is_temporary(state, left))
+        return left;
+    if (is_temporary(state, right))
+        return right;
+
+    return allocate_register(state);
+}
+
+// Get the value the code from `start` on left in `from` into `to`. When the
+// last instruction produced it, it writes to `to` directly instead.
+static void move_register(RegState *state, int to, int from, int start) {
+    if (from == to)
+        return;
+
+    RegChunk *chunk = state->compiler.chunk;
+    int last = chunk->len - 1;
+
+    if (is_temporary(state, from) && last >= start &&
+        state->compiler.jump_target <= last) {
+        uint32_t instruction = chunk->code[last];
+
+        if (reg_opcode_writes_a(REG_OP(instruction)) &&
+            (int)REG_A(instruction) == from) {
+            chunk->code[last] =
+                (instruction & ~(0xffu << 8)) | (uint32_t)to << 8;
+            return;
+        }
+    }
+
+    emit(state, REG_ABC(ROP_MOVE, to, from, 0));
+}
+
+// The constant loaded by the code from `start` on if it is a single
+// ROP_LOADK into the temporary `reg` that nothing jumps past, -1 otherwise.
+static int loaded_constant(RegState *state, int reg, int start) {
+    RegChunk *chunk = state->compiler.chunk;
+    if (!is_temporary(state, reg) || chunk->len != start + 1 ||
+        state->compiler.jump_target > start)
+        return -1;
+
+    uint32_t instruction = chunk->code[start];
+    if (REG_OP(instruction) != ROP_LOADK || (int)REG_A(instruction) != reg)
+        return -1;
+
+    return REG_BX(instruction);
+}
+
+static int expression(RegState *state);
+static void statement(RegState *state);
+static void declaration(RegState *state);
+static RegParseRule *get_rule(TokenType type);
+static int parse_precedence(RegState *state, Precedence precedence);
+
+static uint16_t global_slot(RegState *state, Token *name) {
+    int slot = vm_global_slot(
+        state->vm, copy_string(state->vm, name->start, name->length));
+
+    if (slot > UINT16_MAX) {
+        error_at(state, name, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
+static bool identifiers_equal(Token *a, Token *b) {
+    if (a->length != b->length)
+        return false;
+
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static int resolve_local(RegState *state, Token *name) {
+    for (int i = state->compiler.local_count - 1; i >= 0; i--) {
+        Local *local = &state->compiler.locals[i];
+        if (identifiers_equal(name, &local->name)) {
+            if (local->depth == -1)
+                error_at_current(state, "Can't read local variable in its own initializer.");
+
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void add_local(RegState *state, Token name) {
+    RegCompiler *compiler = &state->compiler;
+    if (compiler->local_count == UINT8_MAX + 1) {
+        error_at_current(state, "Too many local variables in function.");
+        return;
+    }
+
+    Local *local = &compiler->locals[compiler->local_count++];
+    local->name = name;
+    local->depth = -1;
+
+    if (compiler->local_count > compiler->max_registers)
+        compiler->max_registers = compiler->local_count;
+}
+
+static void declare_variable(RegState *state) {
+    if (state->compiler.scope_depth == 0)
+        return;
+
+    Token *name = &state->parser.prev;
+    for (int i = state->compiler.local_count - 1; i >= 0; i--) {
+        Local *local = &state->compiler.locals[i];
+
+        if (local->depth != -1 && local->depth < state->compiler.scope_depth) {
+            break;
+        }
+
+        if (identifiers_equal(name, &local->name)) {
+            error_at_current(state, "Already a variable with this name in this scope.");
+        }
+    }
+
+    add_local(state, *name);
+}
+
+static int logical(RegState *state, int left, RegOpCode jump,
+                   Precedence precedence) {
+    int dest = is_temporary(state, left) ? left : allocate_register(state);
+    if (dest != left)
+        emit(state, REG_ABC(ROP_MOVE, dest, left, 0));
+
+    int end_jump = emit_jump(state, jump, dest);
+
+    int start = state->compiler.chunk->len;
+    int right = parse_precedence(state, precedence);
+    move_register(state, dest, right, start);
+
+    patch_jump(state, end_jump);
+    release_above(state, dest);
+    return dest;
+}
+
+static int and_(RegState *state, int left, bool can_assign) {
+    (void)can_assign;
+    return logical(state, left, ROP_JUMP_IF_FALSE, PREC_AND);
+}
+
+static int or_(RegState *state, int left, bool can_assign) {
+    (void)can_assign;
+    return logical(state, left, ROP_JUMP_IF_TRUE, PREC_OR);
+}
+
+static int binary(RegState *state, int left, bool can_assign) {
+    (void)can_assign;
+
+    RegCompiler *compiler = &state->compiler;
+    RegChunk *chunk = compiler->chunk;
+    int right_start = chunk->len;
+    int local_writes = compiler->local_writes;
+
+    TokenType operator_type = state->parser.prev.type;
+    RegParseRule *rule = get_rule(operator_type);
+    int right = parse_precedence(state, (Precedence)(rule->precedence + 1));
+
+    RegOpCode opcode;
+    int constant_opcode = -1;
+
+    switch (operator_type) {
+        case TOKEN_EQUAL_EQUAL:   opcode = ROP_EQUAL; break;
+        case TOKEN_BANG_EQUAL:    opcode = ROP_NOT_EQUAL; break;
+        case TOKEN_GREATER_EQUAL: opcode = ROP_NOT_LESS; break;
+        case TOKEN_LESS_EQUAL:    opcode = ROP_NOT_GREATER; break;
+
+        case TOKEN_GREATER:
+            opcode = ROP_GREATER; constant_opcode = ROP_GREATERK; break;
+        case TOKEN_LESS:
+            opcode = ROP_LESS; constant_opcode = ROP_LESSK; break;
+        case TOKEN_PLUS:
+            opcode = ROP_ADD; constant_opcode = ROP_ADDK; break;
+        case TOKEN_MINUS:
+            opcode = ROP_SUBTRACT; constant_opcode = ROP_SUBTRACTK; break;
+        case TOKEN_STAR:
+            opcode = ROP_MULTIPLY; constant_opcode = ROP_MULTIPLYK; break;
+        case TOKEN_SLASH:
+            opcode = ROP_DIVIDE; constant_opcode = ROP_DIVIDEK; break;
+
+        default: // unreachable
+            return left;
+    }
+
+    // a constant right operand is read from the pool instead of a register
+    int constant = loaded_constant(state, right, right_start);
+    if (constant_opcode != -1 && constant != -1 && constant <= UINT8_MAX) {
+        chunk->len--;
+        compiler->next_register = right;
+
+        int dest = is_temporary(state, left) ? left : allocate_register(state);
+        emit(state, REG_ABC(constant_opcode, dest, left, constant));
+        release_above(state, dest);
+        return dest;
+    }
+
+    if (!is_temporary(state, left) && compiler->local_writes != local_writes) {
+        // the right operand assigned a local, read the left one before it
+        // does, in a register none of its code touches
+        compiler->next_register = compiler->max_registers;
+        int copy = allocate_register(state);
+
+        reg_chunk_insert(chunk, right_start, REG_ABC(ROP_MOVE, copy, left, 0),
+                         state->parser.prev.line);
+        if (compiler->jump_target >= right_start)
+            compiler->jump_target++;
+
+        left = copy;
+    }
+
+    int dest = result_register(state, left, right);
+    emit(state, REG_ABC(opcode, dest, left, right));
+    release_above(state, dest);
+    return dest;
+}
+
+static int literal(RegState *state, bool can_assign) {
+    (void)can_assign;
+
+    int reg = allocate_register(state);
+
+    switch (state->parser.prev.type) {
+        case   TOKEN_NIL: emit(state, REG_ABC(  ROP_LOADNIL, reg, 0, 0)); break;
+        case  TOKEN_TRUE: emit(state, REG_ABC( ROP_LOADTRUE, reg, 0, 0)); break;
+        case TOKEN_FALSE: emit(state, REG_ABC(ROP_LOADFALSE, reg, 0, 0)); break;
+
+        default: // unreachable
+            break;
+    }
+
+    return reg;
+}
+
+static int grouping(RegState *state, bool can_assign) {
+    (void)can_assign;
+
+    int reg = expression(state);
+    consume(state, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    return reg;
+}
+
+static int number(RegState *state, bool can_assign) {
+    (void)can_assign;
+
+    Token *token = &state->parser.prev;
+    int reg = allocate_register(state);
+    emit_constant(state, reg, value_parse_number(token->start, token->length));
+    return reg;
+}
+
+static int string(RegState *state, bool can_assign) {
+    (void)can_assign;
+
+    int reg = allocate_register(state);
+    emit_constant(state, reg, OBJ_VAL(copy_string(
+        state->vm, state->parser.prev.start + 1, state->parser.prev.length - 2)));
+    return reg;
+}
+
+static int variable(RegState *state, bool can_assign) {
+    Token name = state->parser.prev;
+    int local = resolve_local(state, &name);
+
+    if (local != -1) {
+        if (can_assign && match(state, TOKEN_EQUAL)) {
+            int start = state->compiler.chunk->len;
+            int value = expression(state);
+            move_register(state, local, value, start);
+            state->compiler.local_writes++;
+        }
+
+        return local;
+    }
+
+    uint16_t slot = global_slot(state, &name);
+
+    if (can_assign && match(state, TOKEN_EQUAL)) {
+        int value = expression(state);
+        emit(state, REG_ABX(ROP_SET_GLOBAL, value, slot));
+        return value;
+    }
+
+    int reg = allocate_register(state);
+    emit(state, REG_ABX(ROP_GET_GLOBAL, reg, slot));
+    return reg;
+}
+
+static int unary(RegState *state, bool can_assign) {
+    (void)can_assign;
+
+    RegChunk *chunk = state->compiler.chunk;
+    TokenType operator = state->parser.prev.type;
+    int start = chunk->len;
+    int operand = parse_precedence(state, PREC_UNARY);
+
+    // negative number literals are loaded as they are
+    int constant = loaded_constant(state, operand, start);
+    if (operator == TOKEN_MINUS && constant != -1 &&
+        IS_NUMERIC(state->compiler.constants->constants.values[constant])) {
+        Value value = state->compiler.constants->constants.values[constant];
+
+        chunk->len--;
+        emit_constant(state, operand, number_negate(value));
+        return operand;
+    }
+
+    int dest = is_temporary(state, operand) ? operand : allocate_register(state);
+
+    switch (operator) {
+        case  TOKEN_BANG: emit(state, REG_ABC(ROP_NOT, dest, operand, 0)); break;
+        case TOKEN_MINUS: emit(state, REG_ABC(ROP_NEGATE, dest, operand, 0)); break;
+
+        default: // unreachable
+            break;
+    }
+
+    release_above(state, dest);
+    return dest;
+}
+
+RegParseRule REG_RULES[] = {
+    [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+    [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
+    [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
+    [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
+    [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE},
+    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
+    [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
+    [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
+    [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
+    [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
+    [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
+    [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
+    [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_FN]            = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
+    [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
+    [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
+    [TOKEN_LET]           = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
+};
+
+static RegParseRule *get_rule(TokenType type) {
+    return &REG_RULES[type];
+}
+
+static int parse_precedence(RegState *state, Precedence precedence) {
+    advance(state);
+    RegPrefixFn prefix_rule = get_rule(state->parser.prev.type)->prefix;
+
+    if (prefix_rule == NULL) {
+        error_at(state, &state->parser.prev, "Expect expression.");
+        return allocate_register(state);
+    }
+
+    bool can_assign = precedence <= PREC_ASSIGNMENT;
+    int reg = prefix_rule(state, can_assign);
+
+    while (precedence <= get_rule(state->parser.curr.type)->precedence) {
+        advance(state);
+        reg = get_rule(state->parser.prev.type)->infix(state, reg, can_assign);
+    }
+
+    if (can_assign && match(state, TOKEN_EQUAL))
+        error_at_current(state, "Invalid assignment target.");
+
+    return reg;
+}
+
+static int expression(RegState *state) {
+    return parse_precedence(state, PREC_ASSIGNMENT);
+}
+
+static uint16_t parse_variable(RegState *state, const char *message) {
+    consume(state, TOKEN_IDENTIFIER, message);
+
+    declare_variable(state);
+    if (state->compiler.scope_depth > 0) return 0;
+
+    return global_slot(state, &state->parser.prev);
+}
+
+static void mark_initialized(RegState *state) {
+    state->compiler.locals[state->compiler.local_count - 1].depth =
+        state->compiler.scope_depth;
+}
+
+static void var_declaration(RegState *state) {
+    uint16_t global = parse_variable(state, "Expect variable name.");
+    bool is_local = state->compiler.scope_depth > 0;
+
+    // a new local is the last register below the temporaries
+    release_temporaries(state);
+    int start = state->compiler.chunk->len;
+
+    int value;
+    if (match(state, TOKEN_EQUAL)) {
+        value = expression(state);
+    }
+    else {
+        value = allocate_register(state);
+        emit(state, REG_ABC(ROP_LOADNIL, value, 0, 0));
+    }
+
+    consume(state, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    if (is_local && state->compiler.local_count > 0) {
+        move_register(state, state->compiler.local_count - 1, value, start);
+        mark_initialized(state);
+    }
+    else if (!is_local) {
+        emit(state, REG_ABX(ROP_DEFINE_GLOBAL, value, global));
+    }
+}
+
+static void expression_statement(RegState *state) {
+    expression(state);
+    consume(state, TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+static void print_statement(RegState *state) {
+    int value = expression(state);
+    consume(state, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emit(state, REG_ABC(ROP_PRINT, value, 0, 0));
+}
+
+static void if_statement(RegState *state) {
+    consume(state, TOKEN_LEFT_PAREN, "Expect '(' after if.");
+    int condition = expression(state);
+    consume(state, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int then_jump = emit_jump(state, ROP_JUMP_IF_FALSE, condition);
+    release_temporaries(state);
+    statement(state);
+
+    if (match(state, TOKEN_ELSE)) {
+        int else_jump = emit_jump(state, ROP_JUMP, 0);
+        patch_jump(state, then_jump);
+        statement(state);
+        patch_jump(state, else_jump);
+    }
+    else {
+        patch_jump(state, then_jump);
+    }
+}
+
+static void while_statement(RegState *state) {
+    int loop_start = state->compiler.chunk->len;
+
+    consume(state, TOKEN_LEFT_PAREN, "Expect '(' after while.");
+    int condition = expression(state);
+    consume(state, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exit_jump = emit_jump(state, ROP_JUMP_IF_FALSE, condition);
+    release_temporaries(state);
+    statement(state);
+    emit_loop(state, loop_start);
+
+    patch_jump(state, exit_jump);
+}
+
+static void for_statement(RegState *state) {
+    begin_scope(state);
+    consume(state, TOKEN_LEFT_PAREN, "Expect '(' after for.");
+
+    if (match(state, TOKEN_SEMICOLON)) {
+        /* empty initializer */
+    }
+    else if (match(state, TOKEN_LET)) {
+        var_declaration(state);
+    }
+    else {
+        expression_statement(state);
+    }
+
+    release_temporaries(state);
+    int loop_start = state->compiler.chunk->len;
+    int exit_jump = -1;
+    if (!match(state, TOKEN_SEMICOLON)) {
+        int condition = expression(state);
+        consume(state, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        exit_jump = emit_jump(state, ROP_JUMP_IF_FALSE, condition);
+        release_temporaries(state);
+    }
+
+    if (!match(state, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(state, ROP_JUMP, 0);
+        int increment_start = state->compiler.chunk->len;
+
+        expression(state);
+        release_temporaries(state);
+        consume(state, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emit_loop(state, loop_start);
+        loop_start = increment_start;
+        patch_jump(state, body_jump);
+    }
+
+    statement(state);
+    emit_loop(state, loop_start);
+
+    if (exit_jump != -1)
+        patch_jump(state, exit_jump);
+
+    end_scope(state);
+}
+
+static void block(RegState *state) {
+    while (!check(state, TOKEN_RIGHT_BRACE) && !check(state, TOKEN_EOF))
+        declaration(state);
+
+    consume(state, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void declaration(RegState *state) {
+    release_temporaries(state);
+
+    if (match(state, TOKEN_LET)) {
+        var_declaration(state);
+    }
+    else {
+        statement(state);
+    }
+
+    if (state->parser.panic_mode)
+        parser_synchronize(&state->parser);
+}
+
+static void statement(RegState *state) {
+    release_temporaries(state);
+
+    if (match(state, TOKEN_PRINT)) {
+        print_statement(state);
+    }
+    else if (match(state, TOKEN_IF)) {
+        if_statement(state);
+    }
+    else if (match(state, TOKEN_WHILE)) {
+        while_statement(state);
+    }
+    else if (match(state, TOKEN_FOR)) {
+        for_statement(state);
+    }
+    else if (match(state, TOKEN_LEFT_BRACE)) {
+        begin_scope(state);
+        block(state);
+        end_scope(state);
+    }
+    else {
+        expression_statement(state);
+    }
+}
+
+bool reg_compile(const char *source, VM *vm, Chunk *constants,
+                 RegChunk *chunk) {
+    TokenStream tokens;
+    if (vm->lex_threads > 0)
+        token_stream_lex(&tokens, source, vm->lex_threads);
+
+    RegState state;
+    state_init(&state, source, vm, constants, chunk,
+               vm->lex_threads > 0 ? &tokens : NULL);
+
+    advance(&state);
+    while (!match(&state, TOKEN_EOF)) {
+        declaration(&state);
+    }
+
+    emit(&state, REG_ABC(ROP_RETURN, 0, 0, 0));
+    chunk->registers = state.compiler.max_registers;
+
+#ifdef DEBUG
+    if (vm->print_code) {
+        disassemble_reg_chunk(chunk, &constants->constants, "registers");
+        printf("%d constants, %d deduplicated\n\n",
+               constants->constants.len, constants->deduplicated);
+    }
+#endif
+
+    if (vm->lex_threads > 0)
+        token_stream_free(&tokens);
+
+    return !state.parser.had_error;
+}
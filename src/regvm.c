@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "regvm.h"
+#include "debug.h"
+#include "object.h"
+#include "value.h"
+
+static void runtime_error(VM *vm, RegChunk *chunk, uint32_t *ip,
+                          const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputs("\n", vm->err);
+
+    int line = chunk->line[ip - chunk->code - 1];
+    fprintf(vm->err, "[line %d] in script\n", line);
+    vm->sp = vm->stack;
+}
+
+// Strings are compared by identity once interned. A flattened rope keeps its
+// string alive, so this doesn't need to be stored anywhere.
+static Value flatten(VM *vm, Value value) {
+    if (IS_ROPE(value))
+        return OBJ_VAL(flatten_rope(vm, AS_ROPE(value)));
+    return value;
+}
+
+#ifdef COMPUTED_GOTO
+// labels-as-values is a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+InterpretResult reg_vm_run(VM *vm, RegChunk *chunk, ValueArray *constants) {
+    Value *registers = vm->stack;
+    for (int i = 0; i < chunk->registers; i++)
+        registers[i] = NIL_VAL;
+    // the collector marks everything below sp
+    vm->sp = vm->stack + chunk->registers;
+
+    uint32_t *ip = chunk->code;
+    uint32_t instruction;
+
+#define R(x) (registers[x])
+#define K(x) (constants->values[x])
+#define RA() R(REG_A(instruction))
+#define RB() R(REG_B(instruction))
+#define RC() R(REG_C(instruction))
+#define KC() K(REG_C(instruction))
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        runtime_error(vm, chunk, ip, __VA_ARGS__);                             \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    } while (false)
+// NUMBER_OP stores `result`, computed from the numbers `a` and `b`.
+// `operation` is one of the number_ functions of value.h.
+#define BINARY_OP(right, operation) NUMBER_OP(right, operation(a, b))
+#define COMPARE_OP(right, test) NUMBER_OP(right, BOOL_VAL(test))
+#define NUMBER_OP(right, result)                                               \
+    do {                                                                       \
+        Value a = RB();                                                        \
+        Value b = (right);                                                     \
+        if (!IS_NUMERIC(a) || !IS_NUMERIC(b))                                  \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        RA() = (result);                                                       \
+    } while (false)
+#define ADD_OP(right)                                                          \
+    do {                                                                       \
+        Value left_value = RB();                                               \
+        Value right_value = (right);                                           \
+        if (IS_NUMERIC(left_value) && IS_NUMERIC(right_value)) {               \
+            RA() = number_add(left_value, right_value);                        \
+        }                                                                      \
+        else if (IS_TEXT(left_value) && IS_TEXT(right_value)) {                \
+            vm_stack_push(vm, left_value);                                     \
+            vm_stack_push(vm, right_value);                                    \
+            vm_concatenate(vm);                                                \
+            RA() = vm_stack_pop(vm);                                           \
+        }                                                                      \
+        else {                                                                 \
+            RUNTIME_ERROR("Operands must be two numbers or strings.");         \
+        }                                                                      \
+    } while (false)
+#define EQUAL_OP(negate)                                                       \
+    do {                                                                       \
+        Value right_value = flatten(vm, RC());                                 \
+        Value left_value = flatten(vm, RB());                                  \
+        RA() = BOOL_VAL(values_equal(left_value, right_value) != (negate));    \
+    } while (false)
+
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm->instructions++)
+#else
+#define COUNT_INSTRUCTION() do {} while (false)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION()                                                      \
+    do {                                                                       \
+        printf("\t");                                                          \
+        for (int i = 0; i < chunk->registers; i++) {                           \
+            printf("[");                                                       \
+            value_print(registers[i]);                                         \
+            printf("]");                                                       \
+        }                                                                      \
+        printf("\n");                                                          \
+        disassemble_reg_instruction(chunk, constants,                          \
+                                    (int)(ip - chunk->code));                  \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [ROP_MOVE]          = &&L_ROP_MOVE,
+        [ROP_LOADK]         = &&L_ROP_LOADK,
+        [ROP_LOADNIL]       = &&L_ROP_LOADNIL,
+        [ROP_LOADTRUE]      = &&L_ROP_LOADTRUE,
+        [ROP_LOADFALSE]     = &&L_ROP_LOADFALSE,
+        [ROP_GET_GLOBAL]    = &&L_ROP_GET_GLOBAL,
+        [ROP_SET_GLOBAL]    = &&L_ROP_SET_GLOBAL,
+        [ROP_DEFINE_GLOBAL] = &&L_ROP_DEFINE_GLOBAL,
+        [ROP_ADD]           = &&L_ROP_ADD,
+        [ROP_SUBTRACT]      = &&L_ROP_SUBTRACT,
+        [ROP_MULTIPLY]      = &&L_ROP_MULTIPLY,
+        [ROP_DIVIDE]        = &&L_ROP_DIVIDE,
+        [ROP_ADDK]          = &&L_ROP_ADDK,
+        [ROP_SUBTRACTK]     = &&L_ROP_SUBTRACTK,
+        [ROP_MULTIPLYK]     = &&L_ROP_MULTIPLYK,
+        [ROP_DIVIDEK]       = &&L_ROP_DIVIDEK,
+        [ROP_EQUAL]         = &&L_ROP_EQUAL,
+        [ROP_NOT_EQUAL]     = &&L_ROP_NOT_EQUAL,
+        [ROP_LESS]          = &&L_ROP_LESS,
+        [ROP_GREATER]       = &&L_ROP_GREATER,
+        [ROP_NOT_LESS]      = &&L_ROP_NOT_LESS,
+        [ROP_NOT_GREATER]   = &&L_ROP_NOT_GREATER,
+        [ROP_LESSK]         = &&L_ROP_LESSK,
+        [ROP_GREATERK]      = &&L_ROP_GREATERK,
+        [ROP_NOT]           = &&L_ROP_NOT,
+        [ROP_NEGATE]        = &&L_ROP_NEGATE,
+        [ROP_PRINT]         = &&L_ROP_PRINT,
+        [ROP_JUMP]          = &&L_ROP_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&L_ROP_JUMP_IF_FALSE,
+        [ROP_JUMP_IF_TRUE]  = &&L_ROP_JUMP_IF_TRUE,
+        [ROP_LOOP]          = &&L_ROP_LOOP,
+        [ROP_RETURN]        = &&L_ROP_RETURN,
+    };
+
+#define SWITCH(opcode) goto *dispatch_table[opcode];
+#define CASE(opcode) L_##opcode
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        COUNT_INSTRUCTION();                                                   \
+        TRACE_EXECUTION();                                                     \
+        instruction = *ip++;                                                   \
+        goto *dispatch_table[REG_OP(instruction)];                             \
+    } while (false)
+#else
+#define SWITCH(opcode) switch (opcode)
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
+#endif
+
+    for (;;) {
+        COUNT_INSTRUCTION();
+        TRACE_EXECUTION();
+        instruction = *ip++;
+
+        SWITCH(REG_OP(instruction)) {
+            CASE(ROP_MOVE):      RA() = RB(); DISPATCH();
+            CASE(ROP_LOADK):     RA() = K(REG_BX(instruction)); DISPATCH();
+            CASE(ROP_LOADNIL):   RA() = NIL_VAL; DISPATCH();
+            CASE(ROP_LOADTRUE):  RA() = BOOL_VAL(true); DISPATCH();
+            CASE(ROP_LOADFALSE): RA() = BOOL_VAL(false); DISPATCH();
+
+            CASE(ROP_GET_GLOBAL): {
+                uint16_t slot = REG_BX(instruction);
+                Value value = vm->global_values.values[slot];
+                if (IS_UNDEFINED(value))
+                    RUNTIME_ERROR("Undefined variable '%s'.",
+                                  AS_STRING(vm->global_names.values[slot])->data);
+                RA() = value;
+                DISPATCH();
+            }
+            CASE(ROP_SET_GLOBAL): {
+                uint16_t slot = REG_BX(instruction);
+                if (IS_UNDEFINED(vm->global_values.values[slot]))
+                    RUNTIME_ERROR("Undefined variable '%s'.",
+                                  AS_STRING(vm->global_names.values[slot])->data);
+                vm->global_values.values[slot] = RA();
+                DISPATCH();
+            }
+            CASE(ROP_DEFINE_GLOBAL):
+                vm->global_values.values[REG_BX(instruction)] = RA();
+                DISPATCH();
+
+            CASE(ROP_ADD):       ADD_OP(RC()); DISPATCH();
+            CASE(ROP_SUBTRACT):  BINARY_OP(RC(), number_subtract); DISPATCH();
+            CASE(ROP_MULTIPLY):  BINARY_OP(RC(), number_multiply); DISPATCH();
+            CASE(ROP_DIVIDE):    BINARY_OP(RC(), number_divide); DISPATCH();
+            CASE(ROP_ADDK):      ADD_OP(KC()); DISPATCH();
+            CASE(ROP_SUBTRACTK): BINARY_OP(KC(), number_subtract); DISPATCH();
+            CASE(ROP_MULTIPLYK): BINARY_OP(KC(), number_multiply); DISPATCH();
+            CASE(ROP_DIVIDEK):   BINARY_OP(KC(), number_divide); DISPATCH();
+
+            CASE(ROP_EQUAL):       EQUAL_OP(false); DISPATCH();
+            CASE(ROP_NOT_EQUAL):   EQUAL_OP(true); DISPATCH();
+            CASE(ROP_LESS):
+                COMPARE_OP(RC(), number_less(a, b)); DISPATCH();
+            CASE(ROP_GREATER):
+                COMPARE_OP(RC(), number_greater(a, b)); DISPATCH();
+            CASE(ROP_NOT_LESS):
+                COMPARE_OP(RC(), !number_less(a, b)); DISPATCH();
+            CASE(ROP_NOT_GREATER):
+                COMPARE_OP(RC(), !number_greater(a, b)); DISPATCH();
+            CASE(ROP_LESSK):
+                COMPARE_OP(KC(), number_less(a, b)); DISPATCH();
+            CASE(ROP_GREATERK):
+                COMPARE_OP(KC(), number_greater(a, b)); DISPATCH();
+
+            CASE(ROP_NOT): RA() = BOOL_VAL(value_is_falsy(RB())); DISPATCH();
+            CASE(ROP_NEGATE): {
+                if (!IS_NUMERIC(RB()))
+                    RUNTIME_ERROR("Operand must be a number.");
+                RA() = number_negate(RB());
+                DISPATCH();
+            }
+
+            CASE(ROP_PRINT): {
+                value_fprint(vm->out, RA());
+                fputc('\n', vm->out);
+                DISPATCH();
+            }
+
+            CASE(ROP_JUMP): ip += REG_BX(instruction); DISPATCH();
+            CASE(ROP_JUMP_IF_FALSE): {
+                if (value_is_falsy(RA()))
+                    ip += REG_BX(instruction);
+                DISPATCH();
+            }
+            CASE(ROP_JUMP_IF_TRUE): {
+                if (!value_is_falsy(RA()))
+                    ip += REG_BX(instruction);
+                DISPATCH();
+            }
+            CASE(ROP_LOOP): ip -= REG_BX(instruction); DISPATCH();
+
+            CASE(ROP_RETURN):
+                return INTERPRET_OK;
+        }
+    }
+
+#undef DISPATCH
+#undef CASE
+#undef SWITCH
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef EQUAL_OP
+#undef ADD_OP
+#undef BINARY_OP
+#undef COMPARE_OP
+#undef NUMBER_OP
+#undef RUNTIME_ERROR
+#undef KC
+#undef RC
+#undef RB
+#undef RA
+#undef K
+#undef R
+}
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
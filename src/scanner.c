@@ -1,5 +1,14 @@
 #include <string.h>
 
+#if !defined(SCANNER_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCANNER_AVX2
+#elif !defined(SCANNER_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
+
+#include "bits.h"
 #include "scanner.h"
 
 void scanner_init(Scanner *scanner, const char *source) {
@@ -17,6 +26,153 @@ static bool is_alpha(char c) {
            (c >= 'A' && c <= 'Z') || c == '_';
 }
 
+// Runs of whitespace, comment bodies, string bodies, identifiers and digits
+// are skipped a vector at a time. Each step loads the aligned block that
+// holds the current position and computes a mask of the bytes the run stops
+// at, every kind of run stops at the terminating NUL. An aligned load never
+// crosses into another page, so reading the bytes around the source that
+// share a block with it is safe, but AddressSanitizer doesn't know that.
+
+typedef enum {
+    RUN_WHITESPACE,
+    RUN_LINE,
+    RUN_STRING,
+    RUN_IDENTIFIER,
+    RUN_DIGITS,
+} RunKind;
+
+#if defined(SCANNER_AVX2) || defined(SCANNER_SSE2)
+
+#if defined(__has_attribute)
+#if __has_attribute(no_sanitize_address)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef NO_SANITIZE_ADDRESS
+#define NO_SANITIZE_ADDRESS
+#endif
+
+#ifdef SCANNER_AVX2
+#define BLOCK_SIZE 32
+typedef __m256i Block;
+#define block_load(p)       _mm256_load_si256((const __m256i *)(p))
+#define block_set(c)        _mm256_set1_epi8(c)
+#define block_eq(a, b)      _mm256_cmpeq_epi8(a, b)
+#define block_or(a, b)      _mm256_or_si256(a, b)
+#define block_sub(a, b)     _mm256_sub_epi8(a, b)
+#define block_min(a, b)     _mm256_min_epu8(a, b)
+#define block_mask(a)       ((uint32_t)_mm256_movemask_epi8(a))
+#else
+#define BLOCK_SIZE 16
+typedef __m128i Block;
+#define block_load(p)       _mm_load_si128((const __m128i *)(p))
+#define block_set(c)        _mm_set1_epi8(c)
+#define block_eq(a, b)      _mm_cmpeq_epi8(a, b)
+#define block_or(a, b)      _mm_or_si128(a, b)
+#define block_sub(a, b)     _mm_sub_epi8(a, b)
+#define block_min(a, b)     _mm_min_epu8(a, b)
+#define block_mask(a)       ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#define BLOCK_BITS ((uint32_t)((1ull << BLOCK_SIZE) - 1))
+
+// bytes in lo..hi, compared unsigned after shifting the range down to 0
+static inline Block block_range(Block bytes, char lo, char hi) {
+    Block shifted = block_sub(bytes, block_set(lo));
+    return block_eq(block_min(shifted, block_set((char)(hi - lo))), shifted);
+}
+
+static inline uint32_t stop_mask(Block bytes, RunKind kind, char quote) {
+    Block nul = block_eq(bytes, block_set('\0'));
+
+    switch (kind) {
+        case RUN_WHITESPACE: {
+            Block space = block_or(
+                block_or(block_eq(bytes, block_set(' ')),
+                         block_eq(bytes, block_set('\t'))),
+                block_or(block_eq(bytes, block_set('\r')),
+                         block_eq(bytes, block_set('\n'))));
+            return ~block_mask(space) & BLOCK_BITS;
+        }
+        case RUN_LINE:
+            return block_mask(block_or(nul, block_eq(bytes, block_set('\n'))));
+        case RUN_STRING:
+            return block_mask(block_or(nul, block_eq(bytes, block_set(quote))));
+        case RUN_IDENTIFIER: {
+            // setting bit 5 folds upper case onto lower case
+            Block lower = block_or(bytes, block_set(0x20));
+            Block word = block_or(
+                block_or(block_range(lower, 'a', 'z'),
+                         block_range(bytes, '0', '9')),
+                block_eq(bytes, block_set('_')));
+            return ~block_mask(word) & BLOCK_BITS;
+        }
+        case RUN_DIGITS:
+            return ~block_mask(block_range(bytes, '0', '9')) & BLOCK_BITS;
+    }
+
+    return BLOCK_BITS;
+}
+
+// Returns the first byte at or after `p` that ends a run of `kind`. Line
+// feeds passed on the way are added to `line` by popcounting them per block.
+NO_SANITIZE_ADDRESS
+static const char *skip_run(const char *p, RunKind kind, char quote,
+                            int *line) {
+    uintptr_t offset = (uintptr_t)p & (BLOCK_SIZE - 1);
+    const char *block = p - offset;
+    uint32_t valid = (BLOCK_BITS << offset) & BLOCK_BITS;
+
+    for (;;) {
+        Block bytes = block_load(block);
+        uint32_t stop = stop_mask(bytes, kind, quote) & valid;
+        uint32_t newlines = 0;
+
+        if (line != NULL)
+            newlines = block_mask(block_eq(bytes, block_set('\n'))) & valid;
+
+        if (stop != 0) {
+            int at = bits_lowest(stop);
+            if (line != NULL)
+                *line += bits_count(newlines & ((1u << at) - 1));
+            return block + at;
+        }
+
+        if (line != NULL)
+            *line += bits_count(newlines);
+
+        block += BLOCK_SIZE;
+        valid = BLOCK_BITS;
+    }
+}
+
+#else
+
+static bool in_run(char c, RunKind kind, char quote) {
+    switch (kind) {
+        case RUN_WHITESPACE:
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        case RUN_LINE:       return c != '\n' && c != '\0';
+        case RUN_STRING:     return c != quote && c != '\0';
+        case RUN_IDENTIFIER: return is_alpha(c) || is_digit(c);
+        case RUN_DIGITS:     return is_digit(c);
+    }
+
+    return false;
+}
+
+static const char *skip_run(const char *p, RunKind kind, char quote,
+                            int *line) {
+    while (in_run(*p, kind, quote)) {
+        if (*p == '\n' && line != NULL)
+            (*line)++;
+        p++;
+    }
+    return p;
+}
+
+#endif
+
 static bool is_at_end(Scanner *scanner) {
     return *scanner->current == '\0';
 }
@@ -64,39 +220,19 @@ static Token error_token(Scanner *scanner, const char *message) {
 
 static void skip_whitespace(Scanner *scanner) {
     for (;;) {
-        switch (peek(scanner)) {
-            case ' ' :
-            case '\t':
-            case '\r': {
-                advance(scanner);
-                break;
-            }
-            case '\n': {
-                scanner->line++;
-                advance(scanner);
-                break;
-            }
-            case '/': {
-                if (peek_next(scanner) != '/')
-                    return;
+        scanner->current = skip_run(
+            scanner->current, RUN_WHITESPACE, 0, &scanner->line);
 
-                while (peek(scanner) != '\n' && !is_at_end(scanner))
-                    advance(scanner);
-                break;
-            }
-            default:
-                return;
-        }
+        if (peek(scanner) != '/' || peek_next(scanner) != '/')
+            return;
+
+        scanner->current = skip_run(scanner->current, RUN_LINE, 0, NULL);
     }
 }
 
 static Token scan_string(Scanner *scanner, char quote) {
-    while (peek(scanner) != quote && !is_at_end(scanner)) {
-        if (peek(scanner) == '\n')
-            scanner->line++;
-
-        advance(scanner);
-    }
+    scanner->current = skip_run(
+        scanner->current, RUN_STRING, quote, &scanner->line);
 
     if (is_at_end(scanner))
         return error_token(scanner, "unterminated string");
@@ -106,14 +242,11 @@ static Token scan_string(Scanner *scanner, char quote) {
 }
 
 static Token scan_number(Scanner *scanner) {
-    while (is_digit(peek(scanner)))
-        advance(scanner);
+    scanner->current = skip_run(scanner->current, RUN_DIGITS, 0, NULL);
 
     if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
-        do {
-            advance(scanner);
-        }
-        while (is_digit(peek(scanner)));
+        advance(scanner);
+        scanner->current = skip_run(scanner->current, RUN_DIGITS, 0, NULL);
     }
 
     return make_token(scanner, TOKEN_NUMBER);
@@ -164,8 +297,7 @@ static TokenType identifier_type(Scanner *scanner) {
 }
 
 static Token scan_identifier(Scanner *scanner) {
-    while (is_alpha(peek(scanner)) || is_digit(peek(scanner)))
-        advance(scanner);
+    scanner->current = skip_run(scanner->current, RUN_IDENTIFIER, 0, NULL);
 
     return make_token(scanner, identifier_type(scanner));
 }
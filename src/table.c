@@ -1,43 +1,121 @@
 #include <string.h>
 
+#if defined(__SSE2__) && !defined(TABLE_NO_SIMD)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+#include "bits.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// The table is a SwissTable: next to the entries there is one control byte
+// per slot, either CTRL_EMPTY, CTRL_DELETED or the low seven bits of the
+// key's hash. Slots are probed a group of GROUP_SIZE control bytes at a
+// time, so most misses are decided without touching an entry and a hit
+// usually compares a single key. Empty and deleted entries keep a NULL key
+// and a nil value, so walking `entries` directly still works.
+
+#define GROUP_SIZE 16
+// Once more than 7/8 of the slots hold a live entry or a tombstone the
+// table is rehashed, in place if at least half of them are tombstones and
+// into twice the capacity otherwise. It shrinks when less than 1/8 of the
+// slots are live.
+#define TABLE_MAX_LOAD_NUM 7
+#define TABLE_MAX_LOAD_DEN 8
+#define TABLE_MIN_LOAD_DEN 8
+
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
+// one bit per slot of a group, lowest bit first
+typedef uint32_t GroupMask;
+
+static inline uint8_t hash_ctrl(uint32_t hash) {
+    return hash & 0x7f;
+}
+
+static inline int hash_group(uint32_t hash, int cap) {
+    return (hash >> 7) & (cap / GROUP_SIZE - 1);
+}
+
+#ifdef TABLE_SSE2
+static inline GroupMask group_match(const uint8_t *ctrl, uint8_t byte) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+}
+
+// empty and deleted are the only control bytes with the high bit set
+static inline GroupMask group_match_free(const uint8_t *ctrl) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+static inline GroupMask group_match(const uint8_t *ctrl, uint8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (GroupMask)(ctrl[i] == byte) << i;
+    return mask;
+}
+
+static inline GroupMask group_match_free(const uint8_t *ctrl) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        mask |= (GroupMask)(ctrl[i] >> 7) << i;
+    return mask;
+}
+#endif
 
 void table_init(Table *table) {
     table->len = 0;
+    table->tombstones = 0;
     table->cap = 0;
     table->entries = NULL;
+    table->ctrl = NULL;
 }
 
 void table_free(Table *table) {
     FREE_ARRAY(Entry, table->entries, table->cap);
+    FREE_ARRAY(uint8_t, table->ctrl, table->cap);
     table_init(table);
 }
 
-static Entry *find_entry(Entry *entries, int cap, ObjString *key) {
-    uint32_t index = key->hash % cap;
-    Entry *tombstone = NULL;
+// Groups are probed in triangular order, which visits every group once
+// when their number is a power of two. Returns the slot holding `key` or
+// -1, the table must not be empty.
+static int find_slot(Table *table, ObjString *key) {
+    uint8_t ctrl = hash_ctrl(key->hash);
+    int group_mask = table->cap / GROUP_SIZE - 1;
+    int group = hash_group(key->hash, table->cap);
 
-    for (;;) {
-        Entry *entry = &entries[index];
-        if (entry->key == key || entry->key == NULL) {
-            return entry;
-        }
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone == NULL ? entry : tombstone;
-            }
-            else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key) {
-            return entry;
+    for (int step = 1;; step++) {
+        const uint8_t *group_ctrl = &table->ctrl[group * GROUP_SIZE];
+
+        for (GroupMask match = group_match(group_ctrl, ctrl); match != 0;
+             match &= match - 1) {
+            int slot = group * GROUP_SIZE + bits_lowest(match);
+            if (table->entries[slot].key == key)
+                return slot;
         }
-        index = (index + 1) % cap;
+
+        if (group_match(group_ctrl, CTRL_EMPTY) != 0)
+            return -1;
+
+        group = (group + step) & group_mask;
+    }
+}
+
+// the first empty or deleted slot on the probe sequence of `hash`
+static int find_free_slot(uint8_t *ctrl, int cap, uint32_t hash) {
+    int group_mask = cap / GROUP_SIZE - 1;
+    int group = hash_group(hash, cap);
+
+    for (int step = 1;; step++) {
+        GroupMask available = group_match_free(&ctrl[group * GROUP_SIZE]);
+        if (available != 0)
+            return group * GROUP_SIZE + bits_lowest(available);
+
+        group = (group + step) & group_mask;
     }
 }
 
@@ -51,83 +129,230 @@ void table_copy_from(Table *from, Table *to) {
 }
 
 static void adjust_capacity(Table *table, int capacity) {
+    // allocating may run the collector, which deletes from the string
+    // table, so only read the old entries once both arrays exist
     Entry *entries = ALLOCATE(Entry, capacity);
+    uint8_t *ctrl = ALLOCATE(uint8_t, capacity);
+
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    memset(ctrl, CTRL_EMPTY, capacity);
 
+    int len = 0;
     for (int i = 0; i < table->cap; i++) {
         Entry *entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry *dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int slot = find_free_slot(ctrl, capacity, entry->key->hash);
+        ctrl[slot] = hash_ctrl(entry->key->hash);
+        entries[slot] = *entry;
+        len++;
     }
 
     FREE_ARRAY(Entry, table->entries, table->cap);
+    FREE_ARRAY(uint8_t, table->ctrl, table->cap);
+    table->len = len;
+    table->tombstones = 0;
     table->cap = capacity;
     table->entries = entries;
+    table->ctrl = ctrl;
+}
+
+// Drops the tombstones without allocating: live entries are marked deleted
+// and tombstones empty, then each live entry is reinserted. One that would
+// land in its own group stays, one whose new slot is empty moves there and
+// one whose new slot holds a live entry that wasn't reinserted yet swaps
+// with it and the swapped in entry is handled next.
+static void rehash_in_place(Table *table) {
+    for (int i = 0; i < table->cap; i++) {
+        table->ctrl[i] = table->ctrl[i] & 0x80 ? CTRL_EMPTY : CTRL_DELETED;
+    }
+
+    for (int i = 0; i < table->cap; i++) {
+        if (table->ctrl[i] != CTRL_DELETED) continue;
+
+        Entry *entry = &table->entries[i];
+        uint32_t hash = entry->key->hash;
+        int slot = find_free_slot(table->ctrl, table->cap, hash);
+
+        if (slot / GROUP_SIZE == i / GROUP_SIZE) {
+            table->ctrl[i] = hash_ctrl(hash);
+            continue;
+        }
+
+        if (table->ctrl[slot] == CTRL_EMPTY) {
+            table->entries[slot] = *entry;
+            table->ctrl[slot] = hash_ctrl(hash);
+            entry->key = NULL;
+            entry->value = NIL_VAL;
+            table->ctrl[i] = CTRL_EMPTY;
+        }
+        else {
+            Entry swapped = table->entries[slot];
+            table->entries[slot] = *entry;
+            table->ctrl[slot] = hash_ctrl(hash);
+            *entry = swapped;
+            i--;
+        }
+    }
+
+    table->tombstones = 0;
+}
+
+static void shrink_to_fit(Table *table) {
+    int capacity = table->cap;
+    while (capacity > GROUP_SIZE && table->len * 4 < capacity)
+        capacity /= 2;
+
+    if (capacity != table->cap)
+        adjust_capacity(table, capacity);
 }
 
 bool table_get(Table *table, ObjString *key, Value *value) {
     if (table->len == 0) return false;
 
-    Entry *entry = find_entry(table->entries, table->cap, key);
-    if (entry->key == NULL) return false;
+    int slot = find_slot(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 bool table_set(Table *table, ObjString *key, Value value) {
-    if (table->len + 1 > table->cap * TABLE_MAX_LOAD) {
-        int new_cap = GROW_CAPACITY(table->cap);
-        adjust_capacity(table, new_cap);
+    if (table->len > 0) {
+        int slot = find_slot(table, key);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
 
-    Entry *entry = find_entry(table->entries, table->cap, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value)) table->len++;
+    // the collector only removes entries, tables it thinned out are
+    // shrunk here
+    if (table->cap > GROUP_SIZE &&
+        table->len * TABLE_MIN_LOAD_DEN < table->cap)
+        shrink_to_fit(table);
 
-    entry->key = key;
-    entry->value = value;
+    if ((table->len + table->tombstones + 1) * TABLE_MAX_LOAD_DEN >
+        table->cap * TABLE_MAX_LOAD_NUM) {
+        if (table->tombstones >= table->len && table->tombstones > 0)
+            rehash_in_place(table);
+        else
+            adjust_capacity(table, table->cap < GROUP_SIZE ? GROUP_SIZE
+                                                           : table->cap * 2);
+    }
 
-    return is_new_key;
+    int slot = find_free_slot(table->ctrl, table->cap, key->hash);
+    if (table->ctrl[slot] == CTRL_DELETED) table->tombstones--;
+    table->len++;
+
+    table->ctrl[slot] = hash_ctrl(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+
+    return true;
+}
+
+static void erase_slot(Table *table, int slot) {
+    int group = slot / GROUP_SIZE;
+
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->len--;
+
+    // Lookups stop at the first group with an empty slot, so no probe
+    // sequence has ever gone past a group that still has one. Then the
+    // slot can become empty again instead of leaving a tombstone.
+    if (group_match(&table->ctrl[group * GROUP_SIZE], CTRL_EMPTY) != 0) {
+        table->ctrl[slot] = CTRL_EMPTY;
+    }
+    else {
+        table->ctrl[slot] = CTRL_DELETED;
+        table->tombstones++;
+    }
 }
 
 bool table_del(Table *table, ObjString *key) {
     if (table->len == 0) return false;
 
-    Entry *entry = find_entry(table->entries, table->cap, key);
-    if (entry->key == NULL) return false;
+    int slot = find_slot(table, key);
+    if (slot < 0) return false;
 
-    // tombstone
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    erase_slot(table, slot);
+
+    if (table->cap > GROUP_SIZE &&
+        table->len * TABLE_MIN_LOAD_DEN < table->cap)
+        shrink_to_fit(table);
 
     return true;
 }
 
+// drop the entries whose keys were not marked by the collector, used to
+// keep the string intern table weak. This runs during a collection and
+// must not allocate, so the table is not shrunk here.
+void table_remove_white(Table *table) {
+    for (int i = 0; i < table->cap; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL && !entry->key->obj.is_marked)
+            erase_slot(table, i);
+    }
+}
+
 ObjString *table_find_string(Table *table, const char *chars,
         int length, uint32_t hash) {
     if (table->len == 0) return NULL;
 
-    int index = hash % table->cap;
+    uint8_t ctrl = hash_ctrl(hash);
+    int group_mask = table->cap / GROUP_SIZE - 1;
+    int group = hash_group(hash, table->cap);
 
-    for (;;) {
-        Entry *entry = &table->entries[index];
+    for (int step = 1;; step++) {
+        const uint8_t *group_ctrl = &table->ctrl[group * GROUP_SIZE];
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        }
-        else if (entry->key->len == length &&
-                 entry->key->hash == hash  &&
-                 memcmp(entry->key->data, chars, length) == 0) {
-            return entry->key;
+        for (GroupMask match = group_match(group_ctrl, ctrl); match != 0;
+             match &= match - 1) {
+            ObjString *key = table->entries[group * GROUP_SIZE +
+                                            bits_lowest(match)].key;
+            if (key->hash == hash &&
+                key->len == length &&
+                memcmp(key->data, chars, length) == 0) {
+                return key;
+            }
         }
 
-        index = (index + 1) % table->cap;
+        if (group_match(group_ctrl, CTRL_EMPTY) != 0)
+            return NULL;
+
+        group = (group + step) & group_mask;
     }
 }
+
+void table_stats(Table *table, TableStats *stats) {
+    stats->len = table->len;
+    stats->tombstones = table->tombstones;
+    stats->cap = table->cap;
+    stats->avg_probe = 0;
+
+    if (table->len == 0)
+        return;
+
+    // walk each live key's probe sequence up to the group it sits in
+    long groups = 0;
+    int group_mask = table->cap / GROUP_SIZE - 1;
+
+    for (int i = 0; i < table->cap; i++) {
+        ObjString *key = table->entries[i].key;
+        if (key == NULL) continue;
+
+        int group = hash_group(key->hash, table->cap);
+        for (int step = 1;; step++) {
+            groups++;
+            if (group == i / GROUP_SIZE) break;
+            group = (group + step) & group_mask;
+        }
+    }
+
+    stats->avg_probe = (double)groups / table->len;
+}
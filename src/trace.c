@@ -0,0 +1,313 @@
+#include <stdio.h>
+
+#include "trace.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+// A tracing JIT for loops. run() reports every back edge, once a loop has
+// taken vm->trace_threshold of them the recorder below runs one iteration of
+// it in place of run(), from the loop header until it jumps back there, and
+// writes down every instruction it executes with the types of its operands
+// and the direction of each branch. That iteration is compiled by
+// jit_compile_trace() into native code that repeats it for as long as the
+// types and the branches stay the same, anything else leaves through a side
+// exit and run() carries on from there.
+//
+// The recorder stops in front of anything it can't trace or that would raise
+// an error and lets run() execute it. It also gives up when the iteration
+// leaves the loop or goes around an inner loop, a loop that fails to record
+// TRACE_MAX_ABORTS times is left to the interpreter for good.
+
+TraceType trace_type(Value value) {
+    if (IS_NUMBER(value))
+        return TYPE_NUMBER;
+    if (IS_INT(value))
+        return TYPE_INT;
+    if (IS_BOOL(value))
+        return TYPE_BOOL;
+    if (IS_NIL(value))
+        return TYPE_NIL;
+    if (IS_TEXT(value))
+        return TYPE_TEXT;
+    return TYPE_UNKNOWN;
+}
+
+static Trace *find_trace(VM *vm, uint8_t *header) {
+    for (Trace *trace = vm->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header)
+            return trace;
+    }
+
+    Trace *trace = ALLOCATE(Trace, 1);
+    trace->chunk = vm->chunk;
+    trace->header = header;
+    trace->counter = 0;
+    trace->aborts = 0;
+    trace->code = NULL;
+    trace->next = vm->traces;
+    vm->traces = trace;
+    return trace;
+}
+
+// Split the instruction at `offset` into generic parts, 0 if it has none
+// that can be traced.
+static int decode(Chunk *chunk, int offset, TraceOp *parts) {
+    InstructionPart decoded[INSTRUCTION_PARTS_MAX];
+    int count = chunk_decode(chunk, offset, decoded);
+
+    for (int i = 0; i < count; i++) {
+        TraceOp *part = &parts[i];
+        part->opcode = decoded[i].opcode;
+        part->operand = decoded[i].operand;
+        part->offset = offset;
+        part->pushed = decoded[i].pushed;
+        part->next = decoded[i].next;
+        part->target = decoded[i].target;
+        part->taken = false;
+        part->types[0] = part->types[1] = TYPE_UNKNOWN;
+    }
+
+    return count < 0 ? 0 : count;
+}
+
+static void flatten_operand(VM *vm, Value *slot) {
+    if (IS_ROPE(*slot))
+        *slot = OBJ_VAL(flatten_rope(vm, AS_ROPE(*slot)));
+}
+
+// Run `op` the way run() does and note the types of its operands. Returns
+// false without doing anything if it would raise an error.
+static bool execute(VM *vm, TraceOp *op) {
+    switch (op->opcode) {
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            op->types[0] = trace_type(vm_stack_peek(vm, 1));
+            op->types[1] = trace_type(vm_stack_peek(vm, 0));
+            break;
+        case OP_NEGATE:
+            op->types[1] = trace_type(vm_stack_peek(vm, 0));
+            break;
+    }
+
+    bool numbers = (op->types[0] == TYPE_NUMBER || op->types[0] == TYPE_INT) &&
+                   (op->types[1] == TYPE_NUMBER || op->types[1] == TYPE_INT);
+
+    switch (op->opcode) {
+        case OP_CONSTANT:
+            vm_stack_push(vm, vm->chunk->constants.values[op->operand]);
+            break;
+        case OP_NIL:   vm_stack_push(vm, NIL_VAL); break;
+        case OP_TRUE:  vm_stack_push(vm, BOOL_VAL(true)); break;
+        case OP_FALSE: vm_stack_push(vm, BOOL_VAL(false)); break;
+        case OP_POP:   vm_stack_pop(vm); break;
+        case OP_NOT:
+            vm->sp[-1] = BOOL_VAL(value_is_falsy(vm->sp[-1]));
+            break;
+
+        case OP_GET_LOCAL:
+            vm_stack_push(vm, vm->stack[op->operand]);
+            break;
+        case OP_SET_LOCAL:
+            vm->stack[op->operand] = vm_stack_peek(vm, 0);
+            break;
+        case OP_GET_GLOBAL: {
+            Value value = vm->global_values.values[op->operand];
+            if (IS_UNDEFINED(value))
+                return false;
+            vm_stack_push(vm, value);
+            break;
+        }
+        case OP_SET_GLOBAL:
+            if (IS_UNDEFINED(vm->global_values.values[op->operand]))
+                return false;
+            vm->global_values.values[op->operand] = vm_stack_peek(vm, 0);
+            break;
+
+        case OP_EQUAL: {
+            flatten_operand(vm, &vm->sp[-1]);
+            flatten_operand(vm, &vm->sp[-2]);
+            Value b = vm_stack_pop(vm);
+            Value a = vm_stack_pop(vm);
+            vm_stack_push(vm, BOOL_VAL(values_equal(a, b)));
+            break;
+        }
+
+        case OP_ADD:
+            if (op->types[0] == TYPE_TEXT && op->types[1] == TYPE_TEXT) {
+                vm_concatenate(vm);
+                break;
+            }
+            // fall through
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER: {
+            if (!numbers)
+                return false;
+
+            Value b = vm_stack_pop(vm);
+            Value a = vm_stack_pop(vm);
+            switch (op->opcode) {
+                case OP_ADD:      a = number_add(a, b); break;
+                case OP_SUBTRACT: a = number_subtract(a, b); break;
+                case OP_MULTIPLY: a = number_multiply(a, b); break;
+                case OP_DIVIDE:   a = number_divide(a, b); break;
+                case OP_LESS:     a = BOOL_VAL(number_less(a, b)); break;
+                case OP_GREATER:  a = BOOL_VAL(number_greater(a, b)); break;
+            }
+            vm_stack_push(vm, a);
+            break;
+        }
+
+        case OP_NEGATE:
+            if (op->types[1] != TYPE_NUMBER && op->types[1] != TYPE_INT)
+                return false;
+            vm->sp[-1] = number_negate(vm->sp[-1]);
+            break;
+
+        case OP_PRINT:
+            value_fprint(vm->out, vm_stack_pop(vm));
+            fputc('\n', vm->out);
+            break;
+
+        case OP_JUMP:
+            op->taken = true;
+            break;
+        case OP_JUMP_IF_FALSE:
+            op->taken = value_is_falsy(vm_stack_peek(vm, 0));
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            op->taken = value_is_falsy(vm_stack_pop(vm));
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// whether the recording already went through the instruction at `offset`
+static bool visited(TraceOp *ops, int len, int offset) {
+    for (int i = 0; i < len; i++) {
+        if (ops[i].offset == offset)
+            return true;
+    }
+    return false;
+}
+
+// Record one iteration of the loop `trace` heads, whose OP_LOOP is at `loop`,
+// and compile it. Leaves vm->ip where run() has to continue, the loop header
+// once a trace was compiled.
+static bool record(VM *vm, Trace *trace, uint8_t *loop) {
+    Chunk *chunk = vm->chunk;
+    int header = (int)(trace->header - chunk->code);
+    int end = (int)(loop - chunk->code);
+    int height = (int)(vm->sp - vm->stack);
+
+    TraceOp *ops = ALLOCATE(TraceOp, TRACE_MAX_OPS);
+    int len = 0;
+    int offset = header;
+    bool closed = false;
+
+    while (!closed) {
+        TraceOp parts[INSTRUCTION_PARTS_MAX];
+        int count = decode(chunk, offset, parts);
+        if (count == 0 || len + count > TRACE_MAX_OPS)
+            break;
+
+        int i = 0;
+        for (; i < count; i++) {
+            TraceOp *part = &parts[i];
+
+            // Getting back to the header closes the recording. A for loop
+            // also jumps back from its increment to its condition, but a
+            // jump back to where the recording already was is the back edge
+            // of an inner loop, which gets a trace of its own.
+            if (part->opcode == OP_LOOP) {
+                closed = part->target == header;
+                if (closed || visited(ops, len, part->target))
+                    break;
+
+                part->taken = true;
+                ops[len++] = *part;
+                continue;
+            }
+
+            if (!execute(vm, part)) {
+                vm->sp -= part->pushed;
+                break;
+            }
+
+            ops[len++] = *part;
+        }
+
+        // stopped in front of parts[i]
+        if (i < count)
+            break;
+
+        TraceOp *last = &parts[count - 1];
+        offset = last->taken ? last->target : last->next;
+
+        // nothing after the OP_LOOP belongs to the loop
+        if (offset > end)
+            break;
+    }
+
+    JitCode *code = NULL;
+    if (closed) {
+        code = jit_compile_trace(chunk, ops, len, height);
+        offset = header;
+    }
+
+    vm->ip = &chunk->code[offset];
+    FREE_ARRAY(TraceOp, ops, TRACE_MAX_OPS);
+
+    trace->code = code;
+    return code != NULL;
+}
+
+void trace_loop(VM *vm, uint8_t *loop) {
+    Trace *trace = find_trace(vm, vm->ip);
+
+    if (trace->code == NULL) {
+        if (trace->aborts >= TRACE_MAX_ABORTS ||
+            ++trace->counter < vm->trace_threshold)
+            return;
+
+        trace->counter = 0;
+        if (!record(vm, trace, loop)) {
+            trace->aborts++;
+            vm->trace_stats.aborted++;
+            return;
+        }
+        vm->trace_stats.recorded++;
+    }
+
+    // runs until a guard fails
+    jit_run(vm, trace->code);
+    vm->trace_stats.side_exits++;
+}
+
+void trace_free_chunk(VM *vm, Chunk *chunk) {
+    Trace **link = &vm->traces;
+
+    while (*link != NULL) {
+        Trace *trace = *link;
+        if (trace->chunk != chunk) {
+            link = &trace->next;
+            continue;
+        }
+
+        *link = trace->next;
+        jit_free(trace->code);
+        FREE(Trace, trace);
+    }
+}
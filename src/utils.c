@@ -1,10 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 
-uint32_t hash_string(const char* key, int length) {
-    uint32_t hash = 2166136261u;
+#ifdef STRING_HASH_FNV1A
+
+// byte at a time FNV-1a with the seed folded into the offset basis
+uint32_t hash_string(const char *key, int length, uint64_t seed) {
+    uint32_t hash = 2166136261u ^ (uint32_t)(seed ^ seed >> 32);
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t)key[i];
         hash *= 16777619;
@@ -12,33 +21,231 @@ uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
-char *read_file(const char *path) {
-    FILE *file = fopen(path, "r");
-    if (file == NULL) {
-        fprintf(stderr, "couldn't open file '%s'\n", path);
-        return NULL;
+#else
+
+// wyhash (public domain, Wang Yi), reading the key eight bytes at a time.
+// Keys of up to 16 bytes, which covers nearly every identifier, take two
+// multiplications and no loop.
+
+static const uint64_t WY_SECRET[4] = {
+    0x2d358dccaa6c78a5u, 0x8bb84b93962eacc9u,
+    0x4b33a62ed433d4a3u, 0x4d5a2da51de1aa47u,
+};
+
+// the 128 bit product of `a` and `b`, low half into `a` and high into `b`
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 r = (uint128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wy_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t wy_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 1 to 3 bytes, the first, middle and last overlap for short keys
+static inline uint64_t wy_read3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint32_t hash_string(const char *key, int length, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)key;
+    size_t len = (size_t)length;
+    uint64_t a, b;
+
+    seed ^= wy_mix(seed ^ WY_SECRET[0], WY_SECRET[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+            b = (wy_read4(p + len - 4) << 32) |
+                wy_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = wy_read3(p, len);
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t i = len;
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ WY_SECRET[1],
+                              wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ WY_SECRET[2],
+                              wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ WY_SECRET[3],
+                              wy_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_read8(p) ^ WY_SECRET[1], wy_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    a ^= WY_SECRET[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+    uint64_t hash = wy_mix(a ^ WY_SECRET[0] ^ len, b ^ WY_SECRET[1]);
 
-    char *buffer = malloc(file_size + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "not enough memory to read '%s'\n", path);
+    return (uint32_t)(hash ^ hash >> 32);
+}
+
+#endif
+
+uint64_t random_seed(void) {
+    uint64_t seed = 0;
+
+    FILE *file = fopen("/dev/urandom", "rb");
+    if (file != NULL) {
+        if (fread(&seed, sizeof(seed), 1, file) != 1)
+            seed = 0;
         fclose(file);
-        return NULL;
     }
 
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    if (bytes_read < file_size) {
+    if (seed == 0) {
+        // no entropy device, mix the clock with an address that ASLR moves
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        seed = (uint64_t)ts.tv_sec * 1000000007u ^ (uint64_t)ts.tv_nsec ^
+               (uint64_t)(uintptr_t)&seed;
+    }
+
+    return seed;
+}
+
+double wall_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Maps `len` bytes of `fd` followed by one zero filled page. The tail of
+// the file's last page is zeroed by mmap, and when the file ends on a page
+// boundary the extra page supplies the NUL.
+static bool map_source(SourceFile *file, int fd, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapping_len = (len + page - 1) / page * page + page;
+
+    char *mapping = mmap(NULL, mapping_len, PROT_READ,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    if (mmap(mapping, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+        munmap(mapping, mapping_len);
+        return false;
+    }
+
+    file->data = mapping;
+    file->len = len;
+    file->mapping = mapping;
+    file->mapping_len = mapping_len;
+    return true;
+}
+
+static bool read_source(SourceFile *file, FILE *stream, const char *path) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buffer = malloc(cap);
+
+    for (;;) {
+        if (buffer == NULL) {
+            fprintf(stderr, "not enough memory to read '%s'\n", path);
+            return false;
+        }
+
+        len += fread(buffer + len, 1, cap - len - 1, stream);
+        if (len < cap - 1)
+            break;
+
+        cap *= 2;
+        char *grown = realloc(buffer, cap);
+        if (grown == NULL)
+            free(buffer);
+        buffer = grown;
+    }
+
+    if (ferror(stream)) {
         fprintf(stderr, "couldn't read file '%s'\n", path);
-        fclose(file); free(buffer);
-        return NULL;
+        free(buffer);
+        return false;
+    }
+
+    buffer[len] = '\0';
+    file->data = buffer;
+    file->len = len;
+    file->buffer = buffer;
+    return true;
+}
+
+bool source_file_open(SourceFile *file, const char *path) {
+    *file = (SourceFile){0};
+
+    if (strcmp(path, "-") == 0)
+        return read_source(file, stdin, "<stdin>");
+
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) {
+        fprintf(stderr, "couldn't open file '%s'\n", path);
+        return false;
     }
-    buffer[bytes_read] = '\0';
 
-    fclose(file);
-    return buffer;
+    struct stat st;
+    bool ok = false;
+    if (fstat(fileno(stream), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0)
+        ok = map_source(file, fileno(stream), (size_t)st.st_size);
+
+    // pipes, character devices, empty files and failed mappings
+    if (!ok)
+        ok = read_source(file, stream, path);
+
+    fclose(stream);
+    return ok;
 }
 
+void source_file_close(SourceFile *file) {
+    if (file->mapping != NULL)
+        munmap(file->mapping, file->mapping_len);
+    free(file->buffer);
+    *file = (SourceFile){0};
+}
@@ -1,4 +1,7 @@
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -26,36 +29,104 @@ void value_array_push(ValueArray *array, Value value) {
     array->values[array->len++] = value;
 }
 
+Value value_parse_number(const char *chars, int len) {
+    if (memchr(chars, '.', len) == NULL) {
+        char *end;
+        errno = 0;
+        long long integer = strtoll(chars, &end, 10);
+        if (errno == 0 && end == chars + len)
+            return INT_VAL(integer);
+    }
+
+    return NUMBER_VAL(strtod(chars, NULL));
+}
+
+// Prints every NaN the same way. Which sign and payload a NaN ends up with
+// depends on the operand order the interpreter, the JIT or the C compiler
+// picked, and they all have to print the same.
+static void number_fprint(FILE *file, double number) {
+    if (isnan(number))
+        fputs("nan", file);
+    else
+        fprintf(file, "%g", number);
+}
+
+#ifndef NAN_BOXING
+// Prints integers as "%g" prints the same number as a double so that both
+// kinds, and builds without integers, look alike. Only the common small ones
+// skip the floating-point formatting.
+static void int_fprint(FILE *file, int64_t integer) {
+    if (integer > -1000000 && integer < 1000000)
+        fprintf(file, "%" PRId64, integer);
+    else
+        fprintf(file, "%g", (double)integer);
+}
+#endif
+
 void value_print(Value value) {
+    value_fprint(stdout, value);
+}
+
+void value_fprint(FILE *file, Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+        fputs(AS_BOOL(value) ? "true" : "false", file);
+    else if (IS_NIL(value))
+        fputs("nil", file);
+    else if (IS_NUMBER(value))
+        number_fprint(file, AS_NUMBER(value));
+    else if (IS_OBJ(value))
+        object_print(file, value);
+#else
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            fputs(AS_BOOL(value) ? "true" : "false", file);
             break;
-        case VAL_NIL:    printf("nil"); break;
-        case VAL_OBJ:    object_print(value); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NIL:    fputs("nil", file); break;
+        case VAL_OBJ:    object_print(file, value); break;
+        case VAL_NUMBER: number_fprint(file, AS_NUMBER(value)); break;
+        case VAL_INT:    int_fprint(file, AS_INT(value)); break;
+        case VAL_UNDEFINED: break;
     }
+#endif
 }
 
-void object_print(Value value) {
+void object_print(FILE *file, Value value) {
     switch(OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fputs(AS_CSTRING(value), file);
+            break;
+        case OBJ_ROPE:
+            print_rope(file, AS_ROPE(value));
             break;
     }
 }
 
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    // compare numbers as doubles so that NaN != NaN and 0 == -0
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+
+    return a == b;
+#else
+    // an integer equals the double of the same number
     if (a.type != b.type)
-        return false;
+        return IS_NUMERIC(a) && IS_NUMERIC(b) && number_equal(a, b);
 
     switch(a.type) {
         case VAL_NIL:    return true;
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:    return AS_INT(a) == AS_INT(b);
         case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
 
         default:
             return false;
     }
+#endif
+}
+
+bool value_is_falsy(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
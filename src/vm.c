@@ -8,22 +8,46 @@
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "jit.h"
+#include "trace.h"
+#include "regcompiler.h"
+#include "regvm.h"
+#include "utils.h"
+
+void vm_concatenate(VM *vm) {
+    // leave the operands on the stack until the result exists, allocating
+    // it may run the collector
+    Obj *b = AS_OBJ(vm_stack_peek(vm, 0));
+    Obj *a = AS_OBJ(vm_stack_peek(vm, 1));
+
+    int length = text_length(a) + text_length(b);
+    Obj *result;
+
+    if (length >= ROPE_MIN_LENGTH) {
+        result = (Obj *)concat_rope(vm, a, b);
+    }
+    else {
+        // every rope is at least ROPE_MIN_LENGTH long, so both are strings
+        ObjString *sa = (ObjString *)a;
+        ObjString *sb = (ObjString *)b;
+
+        ObjString *string = reserve_string(vm, length);
+        memcpy(string->data, sa->data, sa->len);
+        memcpy(string->data + sa->len, sb->data, sb->len);
+        result = (Obj *)take_string(vm, string);
+    }
 
-static bool is_falsy(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    vm_stack_pop(vm);
+    vm_stack_pop(vm);
+    vm_stack_push(vm, OBJ_VAL(result));
 }
 
-static void concatenate(VM *vm) {
-    ObjString *b = AS_STRING(vm_stack_pop(vm));
-    ObjString *a = AS_STRING(vm_stack_pop(vm));
-
-    int length = a->len + b->len;
-    char *data = ALLOCATE(char, length + 1);
-    memcpy(data, a->data, a->len);
-    memcpy(data + a->len, b->data, b->len);
-    data[length] = '\0';
-
-    vm_stack_push(vm, OBJ_VAL(take_string(vm, data, length)));
+// Replaces a rope on the stack with its flattened string, strings are
+// compared by identity once interned.
+static void flatten_operand(VM *vm, int distance) {
+    Value value = vm_stack_peek(vm, distance);
+    if (IS_ROPE(value))
+        vm->sp[-1 - distance] = OBJ_VAL(flatten_rope(vm, AS_ROPE(value)));
 }
 
 static void reset_stack(VM *vm) {
@@ -33,26 +57,61 @@ static void reset_stack(VM *vm) {
 static void runtime_error(VM *vm, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
     int line = vm->chunk->line[vm->ip - vm->chunk->code - 1];
-    fprintf(stderr, "[line %d] in script\n", line);
+    fprintf(vm->err, "[line %d] in script\n", line);
     reset_stack(vm);
 }
 
 void vm_init(VM *vm) {
     reset_stack(vm);
+    vm->chunk = NULL;
     vm->objects = NULL;
     table_init(&vm->strings);
     table_init(&vm->globals);
+    vm->hash_seed = random_seed();
+    value_array_init(&vm->global_names);
+    value_array_init(&vm->global_values);
+
+    vm->scripts = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_gc = GC_INITIAL_HEAP;
+    vm->gc_growth_factor = GC_HEAP_GROW_FACTOR;
+    vm->gray_len = 0;
+    vm->gray_cap = 0;
+    vm->gray_stack = NULL;
+    vm->gc_stats = (GCStats){0};
+    pool_init(&vm->pool);
+    vm->lex_threads = 0;
+    vm->optimize = false;
+    vm->print_code = true;
+    vm->registers = false;
+    vm->jit = false;
+    vm->trace = false;
+    vm->trace_threshold = TRACE_THRESHOLD;
+    vm->traces = NULL;
+    vm->trace_stats = (TraceStats){0};
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->instructions = 0;
+
+    memory_bind(vm);
 }
 
 void vm_free(VM *vm) {
+    memory_bind(NULL);
+
+    while (vm->scripts != NULL)
+        vm_script_free(vm, vm->scripts);
+
     table_free(&vm->strings);
     table_free(&vm->globals);
-    free_objects(vm->objects);
+    value_array_free(&vm->global_names);
+    value_array_free(&vm->global_values);
+    free_objects(vm);
 }
 
 void vm_stack_push(VM *vm, Value value) {
@@ -67,15 +126,50 @@ Value vm_stack_peek(VM *vm, int distance) {
     return vm->sp[-1 - distance];
 }
 
-static void global_define(VM *vm, ObjString *name) {
-    table_set(&vm->globals, name, vm_stack_peek(vm, 0));
+int vm_global_slot(VM *vm, ObjString *name) {
+    Value slot;
+    if (table_get(&vm->globals, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    vm_stack_push(vm, OBJ_VAL(name));
+
+    int index = vm->global_values.len;
+    value_array_push(&vm->global_names, OBJ_VAL(name));
+    value_array_push(&vm->global_values, UNDEFINED_VAL);
+    table_set(&vm->globals, name, NUMBER_VAL(index));
+
     vm_stack_pop(vm);
+    return index;
+}
+
+bool vm_global_get(VM *vm, ObjString *name, Value *value) {
+    Value slot;
+    if (!table_get(&vm->globals, name, &slot))
+        return false;
+
+    Value global = vm->global_values.values[(int)AS_NUMBER(slot)];
+    if (IS_UNDEFINED(global))
+        return false;
+
+    *value = global;
+    return true;
+}
+
+void vm_global_set(VM *vm, ObjString *name, Value value) {
+    // a new name grows the array, so the slot has to be known first
+    int slot = vm_global_slot(vm, name);
+    vm->global_values.values[slot] = value;
+}
+
+static void global_define(VM *vm, uint16_t slot) {
+    vm->global_values.values[slot] = vm_stack_pop(vm);
 }
 
-static int global_get(VM *vm, ObjString *name) {
-    Value value;
-    if (!table_get(&vm->globals, name, &value)) {
-        runtime_error(vm, "Undefined variable '%s'.", name->data);
+static int global_get(VM *vm, uint16_t slot) {
+    Value value = vm->global_values.values[slot];
+    if (IS_UNDEFINED(value)) {
+        runtime_error(vm, "Undefined variable '%s'.",
+                      AS_STRING(vm->global_names.values[slot])->data);
         return 1;
     }
     vm_stack_push(vm, value);
@@ -83,161 +177,443 @@ static int global_get(VM *vm, ObjString *name) {
     return 0;
 }
 
-static int global_set(VM *vm, ObjString *name) {
-    if (table_set(&vm->globals, name, vm_stack_peek(vm, 0))) {
-        table_del(&vm->globals, name);
-        runtime_error(vm, "Undefined variable '%s'.", name->data);
+static int global_set(VM *vm, uint16_t slot) {
+    if (IS_UNDEFINED(vm->global_values.values[slot])) {
+        runtime_error(vm, "Undefined variable '%s'.",
+                      AS_STRING(vm->global_names.values[slot])->data);
         return 1;
     }
+    vm->global_values.values[slot] = vm_stack_peek(vm, 0);
 
     return 0;
 }
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsequence-point"
+#ifdef COMPUTED_GOTO
+// labels-as-values is a GNU extension
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 static InterpretResult run(VM *vm) {
-#define READ_BYTE() (*vm->ip++)
+    // keep the instruction pointer in a local so the compiler can hold it in
+    // a register; it is written back to the VM only when something outside
+    // of run() needs it
+    uint8_t *ip = vm->ip;
+
+#define READ_BYTE() (*ip++)
 #define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 #define READ_CONSTANT_LONG()                                                   \
     (vm->chunk->constants.values[READ_BYTE() << 8 | READ_BYTE()])
 #define READ_SHORT()                                                           \
-    (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
-#define BINARY_OP(value_type, op)                                              \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define SAVE_IP() (vm->ip = ip)
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        SAVE_IP();                                                             \
+        runtime_error(vm, __VA_ARGS__);                                        \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    } while (false)
+// `result` is computed from the numbers `a` and `b` with the number_
+// functions of value.h
+#define BINARY_OP(result)                                                      \
+    do {                                                                       \
+        if (!IS_NUMERIC(vm_stack_peek(vm, 0)) ||                               \
+            !IS_NUMERIC(vm_stack_peek(vm, 1))) {                               \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        Value b = vm_stack_pop(vm);                                            \
+        Value a = vm_stack_pop(vm);                                            \
+        vm_stack_push(vm, (result));                                           \
+    } while (false)
+#define ADD_OP()                                                               \
     do {                                                                       \
-        if (!IS_NUMBER(vm_stack_peek(vm, 0)) ||                                \
-            !IS_NUMBER(vm_stack_peek(vm, 1))) {                                \
-            runtime_error(vm, "Operands must be numbers.");                    \
-            return INTERPRET_RUNTIME_ERROR;                                    \
+        if (IS_TEXT(vm_stack_peek(vm, 0)) && IS_TEXT(vm_stack_peek(vm, 1))) {  \
+            vm_concatenate(vm);                                                \
         }                                                                      \
-        double b = AS_NUMBER(vm_stack_pop(vm));                                \
-        double a = AS_NUMBER(vm_stack_pop(vm));                                \
-        vm_stack_push(vm, value_type(a op b));                                 \
-    } while (false);
+        else if (IS_NUMERIC(vm_stack_peek(vm, 0)) &&                           \
+                 IS_NUMERIC(vm_stack_peek(vm, 1))) {                           \
+            Value b = vm_stack_pop(vm);                                        \
+            Value a = vm_stack_pop(vm);                                        \
+            vm_stack_push(vm, number_add(a, b));                               \
+        }                                                                      \
+        else {                                                                 \
+            RUNTIME_ERROR("Operands must be two numbers or strings.");         \
+        }                                                                      \
+    } while (false)
+// Quickening: a generic arithmetic or comparison instruction that finds two
+// numbers, of either kind, rewrites itself into its _NUM form, which skips
+// the type dispatch and only guards that it still gets numbers. When the
+// guard fails it turns back into the generic form and runs that instead.
+#define QUICKEN(quick)                                                         \
+    do {                                                                       \
+        if (IS_NUMERIC(vm_stack_peek(vm, 0)) &&                                \
+            IS_NUMERIC(vm_stack_peek(vm, 1)))                                  \
+            ip[-1] = (quick);                                                  \
+    } while (false)
+#define NUMBER_OP(result)                                                      \
+    if (!(IS_NUMERIC(vm_stack_peek(vm, 0)) &                                   \
+          IS_NUMERIC(vm_stack_peek(vm, 1)))) {                                 \
+        ip[-1] = chunk_generic_opcode(ip[-1]);                                 \
+        ip--;                                                                  \
+    }                                                                          \
+    else {                                                                     \
+        Value b = vm_stack_pop(vm);                                            \
+        Value a = vm_stack_pop(vm);                                            \
+        vm_stack_push(vm, (result));                                           \
+    }
+// `test` is number_greater or number_less
+#define COMPARE_JUMP(test)                                                     \
+    do {                                                                       \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!IS_NUMERIC(vm_stack_peek(vm, 0)) ||                               \
+            !IS_NUMERIC(vm_stack_peek(vm, 1))) {                               \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        }                                                                      \
+        Value b = vm_stack_pop(vm);                                            \
+        Value a = vm_stack_pop(vm);                                            \
+        if (!test(a, b))                                                       \
+            ip += offset;                                                      \
+    } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        if (vm->sp != vm->stack) {
-            printf("\t");
-            for (Value *slot = vm->stack; slot < vm->sp; slot++) {
-                printf("[");
-                value_print(*slot);
-                printf("]");
-            }
-            printf("\n");
-        }
+#define TRACE_EXECUTION()                                                      \
+    do {                                                                       \
+        if (vm->sp != vm->stack) {                                             \
+            printf("\t");                                                      \
+            for (Value *slot = vm->stack; slot < vm->sp; slot++) {             \
+                printf("[");                                                   \
+                value_print(*slot);                                            \
+                printf("]");                                                   \
+            }                                                                  \
+            printf("\n");                                                      \
+        }                                                                      \
+        disassemble_opcode(vm->chunk, (int)(ip - vm->chunk->code));            \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
 
-        disassemble_opcode(vm->chunk, (int)(vm->ip - vm->chunk->code));
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm->instructions++)
+#else
+#define COUNT_INSTRUCTION() do {} while (false)
 #endif
-        uint8_t instruction;
-        switch(instruction = READ_BYTE()) {
-            case OP_CONSTANT: vm_stack_push(vm, READ_CONSTANT()); break;
-            case OP_CONSTANT_LONG: vm_stack_push(vm, READ_CONSTANT_LONG()); break;
 
-            case OP_EQUAL: {
+// With COMPUTED_GOTO every handler ends in its own indirect jump through
+// `dispatch_table`, so each opcode gets a separate branch history instead of
+// sharing the single jump of the switch. Otherwise DISPATCH() just goes back
+// around the loop to the switch.
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CONSTANT]           = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG]      = &&L_OP_CONSTANT_LONG,
+        [OP_NOT]                = &&L_OP_NOT,
+        [OP_NIL]                = &&L_OP_NIL,
+        [OP_TRUE]               = &&L_OP_TRUE,
+        [OP_FALSE]              = &&L_OP_FALSE,
+        [OP_POP]                = &&L_OP_POP,
+        [OP_GET_LOCAL]          = &&L_OP_GET_LOCAL,
+        [OP_GET_LOCAL_LONG]     = &&L_OP_GET_LOCAL_LONG,
+        [OP_GET_GLOBAL]         = &&L_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG]    = &&L_OP_GET_GLOBAL_LONG,
+        [OP_EQUAL]              = &&L_OP_EQUAL,
+        [OP_DEFINE_GLOBAL]      = &&L_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+        [OP_LESS]               = &&L_OP_LESS,
+        [OP_GREATER]            = &&L_OP_GREATER,
+        [OP_ADD]                = &&L_OP_ADD,
+        [OP_SET_LOCAL]          = &&L_OP_SET_LOCAL,
+        [OP_SET_LOCAL_LONG]     = &&L_OP_SET_LOCAL_LONG,
+        [OP_SET_GLOBAL]         = &&L_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG]    = &&L_OP_SET_GLOBAL_LONG,
+        [OP_SUBTRACT]           = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY]           = &&L_OP_MULTIPLY,
+        [OP_DIVIDE]             = &&L_OP_DIVIDE,
+        [OP_NEGATE]             = &&L_OP_NEGATE,
+        [OP_PRINT]              = &&L_OP_PRINT,
+        [OP_JUMP]               = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE]      = &&L_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE]  = &&L_OP_POP_JUMP_IF_FALSE,
+        [OP_LOOP]               = &&L_OP_LOOP,
+        [OP_RETURN]             = &&L_OP_RETURN,
+
+        [OP_ADD_CONSTANT]             = &&L_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT]        = &&L_OP_SUBTRACT_CONSTANT,
+        [OP_ADD_LOCALS]               = &&L_OP_ADD_LOCALS,
+        [OP_ADD_LOCAL_CONSTANT]       = &&L_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT]  = &&L_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_INCREMENT_LOCAL]          = &&L_OP_INCREMENT_LOCAL,
+        [OP_JUMP_IF_NOT_EQUAL]        = &&L_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER]      = &&L_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_LESS]         = &&L_OP_JUMP_IF_NOT_LESS,
+
+        [OP_ADD_NUM]                  = &&L_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM]             = &&L_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]             = &&L_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]               = &&L_OP_DIVIDE_NUM,
+        [OP_LESS_NUM]                 = &&L_OP_LESS_NUM,
+        [OP_GREATER_NUM]              = &&L_OP_GREATER_NUM,
+    };
+
+#define SWITCH(instruction) goto *dispatch_table[instruction];
+#define CASE(opcode) L_##opcode
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        COUNT_INSTRUCTION();                                                   \
+        TRACE_EXECUTION();                                                     \
+        goto *dispatch_table[READ_BYTE()];                                     \
+    } while (false)
+#else
+#define SWITCH(instruction) switch (instruction)
+#define CASE(opcode) case opcode
+#define DISPATCH() continue
+#endif
+
+    for (;;) {
+        COUNT_INSTRUCTION();
+        TRACE_EXECUTION();
+        SWITCH(READ_BYTE()) {
+            CASE(OP_CONSTANT): vm_stack_push(vm, READ_CONSTANT()); DISPATCH();
+            CASE(OP_CONSTANT_LONG): vm_stack_push(vm, READ_CONSTANT_LONG()); DISPATCH();
+
+            CASE(OP_EQUAL): {
+                flatten_operand(vm, 0);
+                flatten_operand(vm, 1);
                 Value b = vm_stack_pop(vm);
                 Value a = vm_stack_pop(vm);
                 vm_stack_push(vm, BOOL_VAL(values_equal(a, b)));
-                break;
+                DISPATCH();
             }
 
-            case OP_NOT:   vm_stack_push(vm, BOOL_VAL(is_falsy(vm_stack_pop(vm)))); break;
-            case OP_NIL:   vm_stack_push(vm, NIL_VAL); break;
-            case OP_TRUE:  vm_stack_push(vm, BOOL_VAL(true)); break;
-            case OP_FALSE: vm_stack_push(vm, BOOL_VAL(false)); break;
-            case OP_POP:   vm_stack_pop(vm); break;
+            CASE(OP_NOT):   vm_stack_push(vm, BOOL_VAL(value_is_falsy(vm_stack_pop(vm)))); DISPATCH();
+            CASE(OP_NIL):   vm_stack_push(vm, NIL_VAL); DISPATCH();
+            CASE(OP_TRUE):  vm_stack_push(vm, BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE): vm_stack_push(vm, BOOL_VAL(false)); DISPATCH();
+            CASE(OP_POP):   vm_stack_pop(vm); DISPATCH();
 
-            case OP_GET_GLOBAL: {
-                if (global_get(vm, READ_STRING()) != 0)
+            CASE(OP_GET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                SAVE_IP();
+                if (global_get(vm, slot) != 0)
                     return INTERPRET_RUNTIME_ERROR;
-                break;
+                DISPATCH();
             }
-            case OP_GET_GLOBAL_LONG: {
-                if (global_get(vm, READ_STRING_LONG()) != 0)
+            CASE(OP_GET_GLOBAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                SAVE_IP();
+                if (global_get(vm, slot) != 0)
                     return INTERPRET_RUNTIME_ERROR;
-                break;
+                DISPATCH();
             }
 
-            case OP_DEFINE_GLOBAL: global_define(vm, READ_STRING()); break;
-            case OP_DEFINE_GLOBAL_LONG: global_define(vm, READ_STRING_LONG()); break;
+            CASE(OP_DEFINE_GLOBAL): global_define(vm, READ_BYTE()); DISPATCH();
+            CASE(OP_DEFINE_GLOBAL_LONG): global_define(vm, READ_SHORT()); DISPATCH();
 
-            case OP_SET_GLOBAL: global_set(vm, READ_STRING()); break;
-            case OP_SET_GLOBAL_LONG: global_set(vm, READ_STRING_LONG()); break;
+            CASE(OP_SET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                SAVE_IP();
+                if (global_set(vm, slot) != 0)
+                    return INTERPRET_RUNTIME_ERROR;
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                SAVE_IP();
+                if (global_set(vm, slot) != 0)
+                    return INTERPRET_RUNTIME_ERROR;
+                DISPATCH();
+            }
 
             // TODO: not implemented
-            case OP_SET_LOCAL_LONG: break;
+            CASE(OP_SET_LOCAL_LONG): DISPATCH();
             // TODO: not implemented
-            case OP_GET_LOCAL_LONG: break;
-            case OP_SET_LOCAL: {
+            CASE(OP_GET_LOCAL_LONG): DISPATCH();
+            CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                vm->stack[slot] = vm_stack_peek(vm, slot);
-                break;
+                vm->stack[slot] = vm_stack_peek(vm, 0);
+                DISPATCH();
             }
-            case OP_GET_LOCAL: {
+            CASE(OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
                 vm_stack_push(vm, vm->stack[slot]);
-                break;
+                DISPATCH();
             }
 
-            case OP_ADD: {
-                if (IS_STRING(vm_stack_peek(vm, 0)) && IS_STRING(vm_stack_peek(vm, 1))) {
-                    concatenate(vm);
-                }
-                else if (IS_NUMBER(vm_stack_peek(vm, 0)) && IS_NUMBER(vm_stack_peek(vm, 1))) {
-                    double b = AS_NUMBER(vm_stack_pop(vm));
-                    double a = AS_NUMBER(vm_stack_pop(vm));
-                    vm_stack_push(vm, NUMBER_VAL(a + b));
+            CASE(OP_ADD):      QUICKEN(OP_ADD_NUM); ADD_OP(); DISPATCH();
+            CASE(OP_SUBTRACT):
+                QUICKEN(OP_SUBTRACT_NUM);
+                BINARY_OP(number_subtract(a, b));
+                DISPATCH();
+            CASE(OP_MULTIPLY):
+                QUICKEN(OP_MULTIPLY_NUM);
+                BINARY_OP(number_multiply(a, b));
+                DISPATCH();
+            CASE(OP_DIVIDE):
+                QUICKEN(OP_DIVIDE_NUM);
+                BINARY_OP(number_divide(a, b));
+                DISPATCH();
+            CASE(OP_GREATER):
+                QUICKEN(OP_GREATER_NUM);
+                BINARY_OP(BOOL_VAL(number_greater(a, b)));
+                DISPATCH();
+            CASE(OP_LESS):
+                QUICKEN(OP_LESS_NUM);
+                BINARY_OP(BOOL_VAL(number_less(a, b)));
+                DISPATCH();
+
+            CASE(OP_NEGATE): {
+                if (!IS_NUMERIC(vm_stack_peek(vm, 0))) {
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
-                else {
-                    runtime_error(vm, "Operands must be two numbers or strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                vm_stack_push(vm, number_negate(vm_stack_pop(vm)));
+                DISPATCH();
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_GREATER:  BINARY_OP(BOOL_VAL,   >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL,   <); break;
-
-            case OP_NEGATE: {
-                if (!IS_NUMBER(vm_stack_peek(vm, 0))) {
-                    runtime_error(vm, "Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                vm_stack_push(vm, NUMBER_VAL(-AS_NUMBER(vm_stack_pop(vm))));
-                break;
+            CASE(OP_PRINT): {
+                value_fprint(vm->out, vm_stack_pop(vm));
+                fputc('\n', vm->out);
+                DISPATCH();
             }
-            case OP_PRINT: {
-                value_print(vm_stack_pop(vm));
-                printf("\n");
-                break;
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                vm->ip += offset;
-                break;
+                if (value_is_falsy(vm_stack_peek(vm, 0)))
+                    ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_POP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (is_falsy(vm_stack_peek(vm, 0)))
-                    vm->ip += offset;
-                break;
+                if (value_is_falsy(vm_stack_pop(vm)))
+                    ip += offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_SHORT();
-                vm->ip -= offset;
-                break;
+                ip -= offset;
+                if (vm->trace) {
+                    SAVE_IP();
+                    trace_loop(vm, ip + offset - 3);
+                    ip = vm->ip;
+                }
+                DISPATCH();
             }
-            case OP_RETURN:
+            CASE(OP_RETURN):
                 return INTERPRET_OK;
+
+            // Each superinstruction does the work of the sequence it
+            // replaces. Anything but numbers takes the slow path through the
+            // stack so that strings concatenate and errors read the same.
+            CASE(OP_ADD_CONSTANT): {
+                Value b = READ_CONSTANT();
+                Value a = vm_stack_peek(vm, 0);
+                if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+                    vm->sp[-1] = number_add(a, b);
+                    DISPATCH();
+                }
+                vm_stack_push(vm, b);
+                ADD_OP();
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_CONSTANT): {
+                Value b = READ_CONSTANT();
+                Value a = vm_stack_peek(vm, 0);
+                if (!IS_NUMERIC(a) || !IS_NUMERIC(b))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                vm->sp[-1] = number_subtract(a, b);
+                DISPATCH();
+            }
+            CASE(OP_ADD_LOCALS): {
+                Value a = vm->stack[READ_BYTE()];
+                Value b = vm->stack[READ_BYTE()];
+                if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+                    vm_stack_push(vm, number_add(a, b));
+                    DISPATCH();
+                }
+                vm_stack_push(vm, a);
+                vm_stack_push(vm, b);
+                ADD_OP();
+                DISPATCH();
+            }
+            CASE(OP_ADD_LOCAL_CONSTANT): {
+                Value a = vm->stack[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+                    vm_stack_push(vm, number_add(a, b));
+                    DISPATCH();
+                }
+                vm_stack_push(vm, a);
+                vm_stack_push(vm, b);
+                ADD_OP();
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+                Value a = vm->stack[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (!IS_NUMERIC(a) || !IS_NUMERIC(b))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                vm_stack_push(vm, number_subtract(a, b));
+                DISPATCH();
+            }
+            CASE(OP_INCREMENT_LOCAL): {
+                // `local = local + constant;` as a statement
+                uint8_t slot = READ_BYTE();
+                Value a = vm->stack[slot];
+                Value b = READ_CONSTANT();
+                if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+                    vm->stack[slot] = number_add(a, b);
+                    DISPATCH();
+                }
+                vm_stack_push(vm, a);
+                vm_stack_push(vm, b);
+                ADD_OP();
+                vm->stack[slot] = vm_stack_pop(vm);
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_EQUAL): {
+                uint16_t offset = READ_SHORT();
+                flatten_operand(vm, 0);
+                flatten_operand(vm, 1);
+                Value b = vm_stack_pop(vm);
+                Value a = vm_stack_pop(vm);
+                if (!values_equal(a, b))
+                    ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_GREATER):
+                COMPARE_JUMP(number_greater);
+                DISPATCH();
+            CASE(OP_JUMP_IF_NOT_LESS):
+                COMPARE_JUMP(number_less);
+                DISPATCH();
+
+            CASE(OP_ADD_NUM):      NUMBER_OP(number_add(a, b)); DISPATCH();
+            CASE(OP_SUBTRACT_NUM): NUMBER_OP(number_subtract(a, b)); DISPATCH();
+            CASE(OP_MULTIPLY_NUM): NUMBER_OP(number_multiply(a, b)); DISPATCH();
+            CASE(OP_DIVIDE_NUM):   NUMBER_OP(number_divide(a, b)); DISPATCH();
+            CASE(OP_LESS_NUM):
+                NUMBER_OP(BOOL_VAL(number_less(a, b)));
+                DISPATCH();
+            CASE(OP_GREATER_NUM):
+                NUMBER_OP(BOOL_VAL(number_greater(a, b)));
+                DISPATCH();
         }
     }
 
+#undef DISPATCH
+#undef CASE
+#undef SWITCH
+#undef COUNT_INSTRUCTION
+#undef TRACE_EXECUTION
+#undef COMPARE_JUMP
+#undef NUMBER_OP
+#undef QUICKEN
+#undef ADD_OP
 #undef BINARY_OP
-#undef READ_STRING_LONG
-#undef READ_STRING
+#undef RUNTIME_ERROR
+#undef SAVE_IP
 #undef READ_SHORT
 #undef READ_CONSTANT_LONG
 #undef READ_CONSTANT
@@ -245,19 +621,88 @@ static InterpretResult run(VM *vm) {
 }
 #pragma GCC diagnostic pop
 
-InterpretResult vm_interpret(VM *vm, const char *source) {
-    Chunk chunk; chunk_init(&chunk);
+Script *vm_script_new(VM *vm) {
+    memory_bind(vm);
 
-    if (!compile(source, vm, &chunk)) {
-        chunk_free(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+    Script *script = ALLOCATE(Script, 1);
+    chunk_init(&script->chunk);
+    reg_chunk_init(&script->reg);
+    script->jit = NULL;
+
+    script->prev = NULL;
+    script->next = vm->scripts;
+    if (vm->scripts != NULL)
+        vm->scripts->prev = script;
+    vm->scripts = script;
+
+    return script;
+}
+
+Script *vm_compile(VM *vm, const char *source) {
+    Script *script = vm_script_new(vm);
+
+    bool compiled = vm->registers
+        ? reg_compile(source, vm, &script->chunk, &script->reg)
+        : compile(source, vm, &script->chunk);
+
+    if (!compiled) {
+        vm_script_free(vm, script);
+        return NULL;
+    }
+
+    return script;
+}
+
+InterpretResult vm_run(VM *vm, Script *script, bool reset_globals) {
+    if (reset_globals) {
+        for (int i = 0; i < vm->global_values.len; i++)
+            vm->global_values.values[i] = UNDEFINED_VAL;
     }
 
-    vm->chunk = &chunk;
+    memory_bind(vm);
+    reset_stack(vm);
+
+    if (script->reg.len > 0)
+        return reg_vm_run(vm, &script->reg, &script->chunk.constants);
+
+    vm->chunk = &script->chunk;
     vm->ip = vm->chunk->code;
 
-    InterpretResult result = run(vm);
-    chunk_free(&chunk);
+    // native code hands anything it can't finish back to run(), which picks
+    // up at vm->ip
+    if (vm->jit) {
+        if (script->jit == NULL)
+            script->jit = jit_compile(&script->chunk);
+        if (script->jit != NULL && jit_run(vm, script->jit) == JIT_RETURNED)
+            return INTERPRET_OK;
+    }
+
+    return run(vm);
+}
+
+void vm_script_free(VM *vm, Script *script) {
+    if (script->prev != NULL)
+        script->prev->next = script->next;
+    else
+        vm->scripts = script->next;
+
+    if (script->next != NULL)
+        script->next->prev = script->prev;
+
+    chunk_free(&script->chunk);
+    reg_chunk_free(&script->reg);
+    jit_free(script->jit);
+    trace_free_chunk(vm, &script->chunk);
+    FREE(Script, script);
+}
+
+InterpretResult vm_interpret(VM *vm, const char *source) {
+    Script *script = vm_compile(vm, source);
+    if (script == NULL)
+        return INTERPRET_COMPILE_ERROR;
+
+    InterpretResult result = vm_run(vm, script, false);
+    vm_script_free(vm, script);
 
     return result;
 }